@@ -8,6 +8,8 @@
 #include <semaphore.h>
 #include "wavelet_v7.h"
 #include "cdotx.h"
+#include "myallocs.h"
+#include "FFTapps.h"
 
 
 //#define CUDAON
@@ -101,7 +103,8 @@ int AnalyticSignal_plan (double complex *y, double *x, unsigned int N, fftw_plan
 	return 0;
 }
 
-int AnalyticSignal_plan_float (float complex *y, float *x, unsigned int N, fftwf_plan *pin, fftwf_plan *pout) {
+/* Analytic signal of x whitened to the amplitudes T or filtered with the gains G of the N/2+1 bins (NULL: none). */
+int AnalyticSignal_gain_float (float complex *y, float *x, unsigned int N, fftwf_plan *pin, fftwf_plan *pout, const float * const G, const float * const T) {
 	float da1;
 	unsigned int n;
 
@@ -109,6 +112,7 @@ int AnalyticSignal_plan_float (float complex *y, float *x, unsigned int N, fftwf
 
 	/* out = FFT(in) */
 	fftwf_execute(*pin);
+	SpecNormf (y, N/2+1, G, T);
 
 	/* Make it analytic ( out(w<0) = 0, out(w>0) *= 2, out(0) & out(Nyquist) no change). */
 	da1 = 1/(double)N; /* For the normalization. */
@@ -123,6 +127,10 @@ int AnalyticSignal_plan_float (float complex *y, float *x, unsigned int N, fftwf
 	return 0;
 }
 
+int AnalyticSignal_plan_float (float complex *y, float *x, unsigned int N, fftwf_plan *pin, fftwf_plan *pout) {
+	return AnalyticSignal_gain_float (y, x, N, pin, pout, NULL, NULL);
+}
+
 #if 0 /* Numerically unstable when data is not exactly zero due to, e.g., finite precision errors. */
 void AmpNorm (double complex *y, unsigned int N) {
 	unsigned int n;
@@ -204,6 +212,36 @@ void AmpNormf (float complex *y, unsigned int N) {
 	}
 }
 
+/* Single precision version of AmpNorm, with the same regularization (1e-6 times the highest power). */
+/* Note that AmpNormf adds 1e-6 times the highest amplitude instead.                                 */
+void AmpNorm_float (float complex *y, unsigned int N) {
+	unsigned int n;
+	float *pf1, eps, fa1, fa2, fa3;
+
+	pf1 = (float *)y;
+	eps = 0;
+	for (n=0; n<2*N; n+=2) {
+		fa1 = pf1[n];
+		fa2 = pf1[n+1];
+		fa3 = fa1*fa1+fa2*fa2;
+		if (eps < fa3) eps = fa3;
+	}
+	eps *= 1e-6;
+	
+	for (n=0; n<2*N; n+=2) {
+		fa1 = pf1[n];
+		fa2 = pf1[n+1];
+		fa3 = 1/sqrtf(fa1*fa1+fa2*fa2 + eps);
+		if (isnormal(fa3)) {
+			pf1[n]   *= fa3;
+			pf1[n+1] *= fa3;
+		} else {
+			pf1[n]   = 0;
+			pf1[n+1] = 0;
+		}
+	}
+}
+
 double Norm (double * const x, const unsigned int n1, const unsigned int n2) {
 	double norm = 0;
 	unsigned int n;
@@ -335,8 +373,196 @@ void pccf_lowlevel (float * const y, float complex * const xan1, float complex *
 	}
 }
 
+/* Pruned inverse FFT: only the L lags lag, lag+1, ..., lag+L-1 of the real IDFT of length Nz.   */
+/* The spectrum is first modulated so that the lags of interest start at 0, Z[f] = X[f] W^(f*lag) */
+/* with W = exp(2*pi*i/Nz). Z is still Hermitian. Then, taking Nz = P*Q with Q >= L and f = P*q+p, */
+/*   y[m] = sum_p W^(p*m) A_p[m],   A_p[m] = sum_q Z[P*q+p] exp(2*pi*i*q*m/Q),                     */
+/* where the terms p and P-p are complex conjugates of each other. So only the P/2+1 Q-point IFFTs */
+/* A_0 ... A_P/2 are needed, about Nz*log2(Q) instead of Nz*log2(Nz) operations.                  */
+struct s_PrunedIFFT {
+	unsigned int  Nz, Q, P, Pc, L;
+	int           lag;
+	fftw_complex *buf;   /* Pc interleaved sequences of Q samples: buf[q*Pc + p] */
+	fftw_plan     p;
+};
+
+struct s_PrunedIFFTf {
+	unsigned int   Nz, Q, P, Pc, L;
+	int            lag;
+	fftwf_complex *buf;
+	fftwf_plan     p;
+};
+
+/* Cost model: returns the length Q of the pruned IFFTs when they are expected to be cheaper   */
+/* than the full Nz-point c2r IFFT, 0 otherwise. Counts about 2.5*N*log2(N) flops per real     */
+/* FFT, the modulation and reordering of the spectrum and the final sum over the P/2+1 partial */
+/* IFFTs. The margin covers the strided accesses; short transforms (in cache) rarely win.      */
+unsigned int pruned_ifft_length (const unsigned int Nz, const unsigned int L) {
+	unsigned int Q, P;
+	double full, pruned;
+	
+	if (Nz == 0 || (Nz & (Nz-1)) || L == 0 || L > Nz/4) return 0; /* Nz has to be a power of 2. */
+	Q = 1 << (unsigned int)ceil(log2(L));
+	if (Q < 16) Q = 16;
+	P = Nz/Q;
+	if (P < 4) return 0;
+	
+	full   = 2.5*(double)Nz*log2((double)Nz);
+	pruned = 2.5*(double)Nz*log2((double)Q) + 6*(double)Nz + 4*(double)L*(double)(P/2+1);
+	
+	return (pruned < 0.65*full) ? Q : 0;
+}
+
+t_PrunedIFFT *CreatePrunedIFFT (const unsigned int Nz, const unsigned int L, const int lag) {
+	t_PrunedIFFT *pp;
+	unsigned int Q;
+	int n;
+	
+	if (0 == (Q = pruned_ifft_length (Nz, L))) return NULL;
+	if (NULL == (pp = (t_PrunedIFFT *)malloc(sizeof(t_PrunedIFFT)) )) return NULL;
+	pp->Nz  = Nz;
+	pp->Q   = Q;
+	pp->P   = Nz/Q;
+	pp->Pc  = pp->P/2 + 1;
+	pp->L   = L;
+	pp->lag = lag;
+	if (NULL == (pp->buf = (fftw_complex *)fftw_malloc(Q*pp->Pc*sizeof(fftw_complex)) )) {
+		free(pp);
+		return NULL;
+	}
+	n = (int)Q;
+	pp->p = fftw_plan_many_dft(1, &n, pp->Pc, pp->buf, NULL, pp->Pc, 1, pp->buf, NULL, pp->Pc, 1, FFTW_BACKWARD, FFTW_ESTIMATE);
+	return pp;
+}
+
+t_PrunedIFFTf *CreatePrunedIFFTf (const unsigned int Nz, const unsigned int L, const int lag) {
+	t_PrunedIFFTf *pp;
+	unsigned int Q;
+	int n;
+	
+	if (0 == (Q = pruned_ifft_length (Nz, L))) return NULL;
+	if (NULL == (pp = (t_PrunedIFFTf *)malloc(sizeof(t_PrunedIFFTf)) )) return NULL;
+	pp->Nz  = Nz;
+	pp->Q   = Q;
+	pp->P   = Nz/Q;
+	pp->Pc  = pp->P/2 + 1;
+	pp->L   = L;
+	pp->lag = lag;
+	if (NULL == (pp->buf = (fftwf_complex *)fftw_malloc(Q*pp->Pc*sizeof(fftwf_complex)) )) {
+		free(pp);
+		return NULL;
+	}
+	n = (int)Q;
+	pp->p = fftwf_plan_many_dft(1, &n, pp->Pc, pp->buf, NULL, pp->Pc, 1, pp->buf, NULL, pp->Pc, 1, FFTW_BACKWARD, FFTW_ESTIMATE);
+	return pp;
+}
+
+void DestroyPrunedIFFT (t_PrunedIFFT *pp) {
+	if (pp != NULL) {
+		fftw_destroy_plan(pp->p);
+		fftw_free(pp->buf);
+		free(pp);
+	}
+}
+
+void DestroyPrunedIFFTf (t_PrunedIFFTf *pp) {
+	if (pp != NULL) {
+		fftwf_destroy_plan(pp->p);
+		fftw_free(pp->buf);
+		free(pp);
+	}
+}
+
+/* exp(2*pi*i*f*lag/Nz), reducing f*lag modulo Nz first to keep the accuracy. */
+double complex pruned_twiddle (const unsigned int f, const int lag, const unsigned int Nz) {
+	long long ll = ((long long)f * (long long)lag) % (long long)Nz;
+	
+	return cexp(2*PI*I*(double)ll/(double)Nz);
+}
+
+/* y[l] = sum_f X[f] exp(2*pi*i*f*(lag+l)/Nz), l = 0...L-1 (not normalized, as fftw).                    */
+/* full = 0: X holds the Nz/2+1 samples of the spectrum of a real sequence (r2c output).                 */
+/* full = 1: X holds the Nz samples of a complex spectrum and y is the real part of its IDFT.            */
+void PrunedIFFT_execute (double * const y, t_PrunedIFFT * const pp, const fftw_complex * const X, const int full) {
+	const unsigned int Nz=pp->Nz, Nh=Nz/2, Q=pp->Q, P=pp->P, Pc=pp->Pc, L=pp->L;
+	double complex w, wstep, z, *pc;
+	double da1;
+	unsigned int f, p, q, m;
+	
+	/* Modulation and reordering, buf[q*Pc + p] = Z[q*P + p] */
+	wstep = pruned_twiddle (1, pp->lag, Nz);
+	for (q=0; q<Q; q++) {
+		pc = pp->buf + q*Pc;
+		f  = q*P;
+		w  = pruned_twiddle (f, pp->lag, Nz);
+		for (p=0; p<Pc; p++, f++) {
+			if (full) z = 0.5*(X[f] + conj(X[(Nz-f) & (Nz-1)]));  /* Hermitian part. */
+			else if (f <= Nh) z = X[f];
+			else z = conj(X[Nz-f]);
+			pc[p] = z*w;
+			w *= wstep;
+		}
+	}
+	
+	/* The Pc Q-point IFFTs */
+	fftw_execute(pp->p);
+	
+	/* y[m] = Re(A_0[m]) + 2*sum_p Re(W^(p*m) A_p[m]) + Re(W^(P/2*m) A_P/2[m]) */
+	for (m=0; m<L; m++) {
+		pc = pp->buf + m*Pc;
+		wstep = pruned_twiddle (m, 1, Nz);
+		w  = wstep;
+		da1 = 0;
+		for (p=1; p<Pc-1; p++) {
+			da1 += creal(w)*creal(pc[p]) - cimag(w)*cimag(pc[p]);
+			w *= wstep;
+		}
+		y[m] = creal(pc[0]) + 2*da1 + creal(w)*creal(pc[p]) - cimag(w)*cimag(pc[p]);
+	}
+}
+
+void PrunedIFFTf_execute (float * const y, t_PrunedIFFTf * const pp, const fftwf_complex * const X, const int full) {
+	const unsigned int Nz=pp->Nz, Nh=Nz/2, Q=pp->Q, P=pp->P, Pc=pp->Pc, L=pp->L;
+	double complex w, wstep, z;
+	float complex *pc;
+	double da1;
+	unsigned int f, p, q, m;
+	
+	/* Modulation and reordering, buf[q*Pc + p] = Z[q*P + p] */
+	wstep = pruned_twiddle (1, pp->lag, Nz);
+	for (q=0; q<Q; q++) {
+		pc = pp->buf + q*Pc;
+		f  = q*P;
+		w  = pruned_twiddle (f, pp->lag, Nz);
+		for (p=0; p<Pc; p++, f++) {
+			if (full) z = 0.5*(X[f] + conjf(X[(Nz-f) & (Nz-1)]));  /* Hermitian part. */
+			else if (f <= Nh) z = X[f];
+			else z = conjf(X[Nz-f]);
+			pc[p] = (float complex)(z*w);
+			w *= wstep;
+		}
+	}
+	
+	/* The Pc Q-point IFFTs */
+	fftwf_execute(pp->p);
+	
+	/* y[m] = Re(A_0[m]) + 2*sum_p Re(W^(p*m) A_p[m]) + Re(W^(P/2*m) A_P/2[m]) */
+	for (m=0; m<L; m++) {
+		pc = pp->buf + m*Pc;
+		wstep = pruned_twiddle (m, 1, Nz);
+		w  = wstep;
+		da1 = 0;
+		for (p=1; p<Pc-1; p++) {
+			da1 += creal(w)*crealf(pc[p]) - cimag(w)*cimagf(pc[p]);
+			w *= wstep;
+		}
+		y[m] = (float)(crealf(pc[0]) + 2*da1 + creal(w)*crealf(pc[p]) - cimag(w)*cimagf(pc[p]));
+	}
+}
+
+/* When ppr is not NULL, only the L lags of interest are computed with the pruned IFFT (pout and out are not used). */
 void cc_lowlevel (double * const y, fftw_complex * const x1, fftw_complex * const x2, const int Nz, const int Lag1, const int Lag2, 
-		fftw_plan *pout, double *out, fftw_complex *fout) {
+		fftw_plan *pout, double *out, fftw_complex *fout, t_PrunedIFFT *ppr) {
 	double da1 = 1./(double)Nz;
 	unsigned int L, Nh = Nz/2 + 1;
 	int n, lag;
@@ -345,6 +571,11 @@ void cc_lowlevel (double * const y, fftw_complex * const x1, fftw_complex * cons
 	lag = (Lag2 >= Lag1) ? Lag1 : Lag2;
 	
 	for (n=0; n<Nh; n++) fout[n] = conj(x1[n])*x2[n]; /* the product        */
+	if (ppr != NULL) {
+		PrunedIFFT_execute (y, ppr, fout, 0);          /* Pruned IFFT      */
+		for (n=0; n<L; n++) y[n] *= da1;
+		return;
+	}
 	fftw_execute(*pout);                               /* IFFT of the result */
 	
 	/* Copy the lag of interest and normalize */
@@ -353,7 +584,7 @@ void cc_lowlevel (double * const y, fftw_complex * const x1, fftw_complex * cons
 }
 
 void ccf_lowlevel (float * const y, fftwf_complex * const x1, fftwf_complex * const x2, const int Nz, const int Lag1, const int Lag2, 
-		fftwf_plan *pout, float *out, fftwf_complex *fout) {
+		fftwf_plan *pout, float *out, fftwf_complex *fout, t_PrunedIFFTf *ppr) {
 	double da1 = 1./(double)Nz;
 	unsigned int L, Nh = Nz/2 + 1;
 	int n, lag;
@@ -362,6 +593,11 @@ void ccf_lowlevel (float * const y, fftwf_complex * const x1, fftwf_complex * co
 	lag = (Lag2 >= Lag1) ? Lag1 : Lag2;
 	
 	for (n=0; n<Nh; n++) fout[n] = conjf(x1[n])*x2[n]; /* the product        */
+	if (ppr != NULL) {
+		PrunedIFFTf_execute (y, ppr, fout, 0);          /* Pruned IFFT      */
+		for (n=0; n<L; n++) y[n] *= da1;
+		return;
+	}
 	fftwf_execute(*pout);                               /* IFFT of the result */
 	
 	/* Copy the lag of interest and normalize */
@@ -782,12 +1018,454 @@ int pcc1_set (float ** const y, float ** const x1, float ** const x2, const int
 	return nerr;
 }
 
-int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2) {
+/* Average whitening filter of the Tr traces x: inverse of the average amplitude spectrum in   */
+/* the band freq[0] - freq[1] (Hz), constant outside, with a maximum amplification of 100     */
+/* times the minimum, a minimum gain of 1 and smoothed with a Blackman window of 11 samples.  */
+/* The average is accumulated in parallel over the traces, one accumulator per thread.        */
+t_AveWhite *CreateAveWhite (float ** const x, const unsigned int N, const unsigned int Tr, const double freq[2], const double dt) {
+	t_AveWhite *pw;
+	double *H, *HS, da1, mn, mx, win[11];
+	unsigned int Nz, Nh, m, M, n, n1, n2, nthr=1;
+	int nerr=0;
+	
+	Nz = 1 << (unsigned int)ceil(log2(N));
+	Nh = Nz/2 + 1;  /* Number of complex used in r2c & c2r ffts. */
+	#ifdef _OPENMP
+	nthr = omp_get_max_threads();
+	#endif
+	
+	pw = (t_AveWhite *)malloc(sizeof(t_AveWhite));
+	H  = (double *)calloc((nthr+1)*Nh, sizeof(double));  /* HS & one accumulator per thread */
+	if (pw == NULL || H == NULL || NULL == (pw->H = (float *)fftw_malloc(Nh*sizeof(float)) )) {
+		printf("CreateAveWhite: Out of memory\n");
+		free(H);
+		free(pw);
+		return NULL;
+	}
+	pw->Nz = Nz;
+	pw->Nh = Nh;
+	HS = H + nthr*Nh;
+	
+	/** Average absolute spectrum **/
+	#pragma omp parallel
+	{
+		fftwf_plan pxX;
+		fftwf_complex *X;
+		float *xf;
+		double *Ht = H;
+		unsigned int n, t;
+		int tr;
+		
+		#ifdef _OPENMP
+		Ht = H + omp_get_thread_num()*Nh;
+		#endif
+		
+		#pragma omp critical
+		{
+			xf = (float *)fftw_malloc(Nz*sizeof(float));
+			X  = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			pxX = fftwf_plan_dft_r2c_1d(Nz, xf, X, FFTW_ESTIMATE); /* The FFT plan  */
+			if (xf == NULL || X == NULL) nerr = 4;
+		}
+		
+		#pragma omp for schedule(static)
+		for (tr=0; tr<Tr; tr++) {
+			if (xf == NULL || X == NULL) continue;
+			memcpy(xf, x[tr], N*sizeof(float));
+			memset(xf + N, 0, (Nz-N)*sizeof(float));
+			fftwf_execute(pxX);
+			for (n=0; n<Nh; n++) Ht[n] += cabsf(X[n]);
+		}
+		
+		/* Reduction of the accumulators */
+		#pragma omp for schedule(static)
+		for (n=0; n<Nh; n++) 
+			for (t=1; t<nthr; t++) H[n] += H[t*Nh + n];
+		
+		#pragma omp critical
+		{
+			fftwf_destroy_plan(pxX);
+			fftw_free(X);
+			fftw_free(xf);
+		}
+	}
+	if (nerr) {
+		printf("CreateAveWhite: Out of memory\n");
+		free(H);
+		DestroyAveWhite(pw);
+		return NULL;
+	}
+	
+	da1 = 1./(double)Tr;
+	for (n=0; n<Nh; n++) H[n] *= da1;
+	
+	/** Whitening filter **/
+	n2 = freq[1]*dt*(double)Nz;
+	if (n2 > Nh-1) n2 = Nh-1;
+	n1 = freq[0]*dt*(double)Nz;
+	if (n1 > n2) n1 = n2;
+	da1 = 1./H[n1];
+	for (n=0; n<n1; n++) H[n] = da1;
+	for (   ; n<n2; n++) H[n] = 1./H[n];
+	da1 = 1./H[n2];
+	for (   ; n<Nh; n++) H[n] = da1;
+	
+	/* Max amplification of 100 times of the minimum value. */
+	mn = mx = H[n1];
+	for (n=n1+1; n<n2; n++) {
+		da1 = H[n];
+		if (da1 > mx) mx = da1;
+		else if (da1 < mn) mn = da1;
+	}
+	if (mx > 100*mn) mx = 100*mn;
+	for (n=0; n<Nh; n++)
+		if (H[n] > mx) H[n] = mx;
+	da1 = 1/mn; /* 1/mn so min gain is 1 */
+	for (n=0; n<Nh; n++) H[n] *= da1;
+	
+	/* Sprectrum smoothing using the blackman window. */
+	for (m=0; m<11; m++) {
+		da1 = 2*PI*m/(N-1);
+		win[m] = 0.42 - 0.5*cos(da1) + 0.08*cos(2*da1);
+	}
+	da1 = 0;
+	for (m=0; m<11; m++) da1 += win[m];
+	da1 = 1/da1;
+	for (m=0; m<11; m++) win[m] *= da1;
+	
+	/* Convolution with mirroring (DC and Nyquist samples are considered only once) */
+	for (n=5; n<10; n++) {
+		da1 = 0;
+		for (m=0; m<=n; m++) da1 += win[m]*H[n-m];
+		for (   ; m<11; m++) da1 += win[m]*H[m-n];
+		HS[n-5] = da1;
+	}
+	for (n=10; n<Nh; n++) {
+		da1 = 0;
+		for (m=0; m<11; m++) da1 += win[m]*H[n-m];
+		HS[n-5] = da1;
+	}
+	for (n=Nh; n<Nh+5; n++) {
+		da1 = 0;
+		M = n-(Nh-1);
+		for (m=0; m<M;  m++) da1 += win[m]*H[Nh-1+m-M];
+		for (   ; m<11; m++) da1 += win[m]*H[n-m];
+		HS[n-5] = da1;
+	}
+	for (n=0; n<Nh; n++) pw->H[n] = (float)HS[n];
+	
+	free(H);
+	return pw;
+}
+
+void DestroyAveWhite (t_AveWhite *pw) {
+	if (pw == NULL) return;
+	fftw_free(pw->H);
+	free(pw);
+}
+
+/* Gains of the whitening filter at the Nz/2+1 bins of an Nz-point FFT (Nz not necessarily a  */
+/* power of 2), linearly interpolated and multiplied by scale. Freed with fftw_free.          */
+float *AveWhite_gain (const t_AveWhite * const pw, const unsigned int Nz, const double scale) {
+	float *G;
+	double da1, da2;
+	unsigned int n, k, Nh = Nz/2 + 1;
+	
+	if (NULL == (G = (float *)fftw_malloc(Nh*sizeof(float)) )) return NULL;
+	da1 = (double)pw->Nz/(double)Nz;
+	for (n=0; n<Nh; n++) {
+		da2 = n*da1;
+		k = (unsigned int)da2;
+		if (k >= pw->Nh-1) G[n] = scale*pw->H[pw->Nh-1];
+		else {
+			da2 -= k;
+			G[n] = scale*((1-da2)*pw->H[k] + da2*pw->H[k+1]);
+		}
+	}
+	return G;
+}
+
+/* Whitens the traces x in place, in parallel over the traces. gaps: > 0 keeps the gaps, runs of at */
+/* least gaps zeros (see GapRuns), at zero, as the whitening smears energy into them.               */
+int AveWhite_apply (float ** const x, const unsigned int N, const unsigned int Tr, const t_AveWhite * const pw, const int gaps) {
+	float *G;
+	unsigned int Nz = pw->Nz, Nh = pw->Nh;
+	int nerr = 0;
+	
+	/* 1/Nz to normalize the ifft */
+	if (NULL == (G = AveWhite_gain (pw, Nz, 1./(double)Nz) )) {
+		printf("AveWhite_apply: Out of memory\n");
+		return 4;
+	}
+	
+	#pragma omp parallel
+	{
+		fftwf_plan pxX, pXx;
+		fftwf_complex *X;
+		float *xf;
+		unsigned int n, K=0, *r=NULL;
+		int tr;
+		
+		#pragma omp critical
+		{
+			xf = (float *)fftw_malloc(Nz*sizeof(float));
+			X  = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			if (gaps) r = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+			pxX = fftwf_plan_dft_r2c_1d(Nz, xf, X, FFTW_ESTIMATE); /* The FFT plan  */
+			pXx = fftwf_plan_dft_c2r_1d(Nz, X, xf, FFTW_ESTIMATE); /* The IFFT plan */
+			if (xf == NULL || X == NULL || (gaps && r == NULL)) nerr = 4;
+		}
+		
+		if (xf != NULL && X != NULL && (!gaps || r != NULL)) {
+			#pragma omp for schedule(static)
+			for (tr=0; tr<Tr; tr++) {
+				if (gaps) K = GapRuns (r, x[tr], N, gaps);
+				memcpy(xf, x[tr], N*sizeof(float));
+				memset(xf + N, 0, (Nz-N)*sizeof(float));
+				fftwf_execute(pxX);
+				for (n=0; n<Nh; n++) X[n] *= G[n];
+				fftwf_execute(pXx);
+				memcpy(x[tr], xf, N*sizeof(float));
+				if (gaps) GapZero (x[tr], sizeof(float), r, K, N);
+			}
+		}
+		
+		#pragma omp critical
+		{
+			fftwf_destroy_plan(pxX);
+			fftwf_destroy_plan(pXx);
+			fftw_free(X);
+			fftw_free(xf);
+			free(r);
+		}
+	}
+	if (nerr) printf("AveWhite_apply: Out of memory\n");
+	
+	fftw_free(G);
+	return nerr;
+}
+
+/* Running absolute mean normalization of x: y[n] = x[n] / mean(|x[n-M...n+M]|), the window    */
+/* truncated at the edges. O(N) by a sliding sum. y and x must not overlap.                     */
+void RunAbsMean (float * const y, const float * const x, const unsigned int N, const unsigned int M) {
+	double s = 0;
+	unsigned int n, lo = 0, hi;
+	
+	hi = (M+1 < N) ? M+1 : N;
+	for (n=0; n<hi; n++) s += fabsf(x[n]);
+	for (n=0; n<N; n++) {
+		y[n] = (s > 0) ? x[n] * (float)((double)(hi-lo)/s) : 0;
+		if (hi < N) s += fabsf(x[hi++]);  /* Window of the next sample */
+		if (n >= M) s -= fabsf(x[lo++]);
+	}
+}
+
+/* Target amplitude spectrum of the spectral whitening at the Nz/2+1 bins of an Nz-point FFT:  */
+/* scale in the band fw[0] - fw[1], cosine tapers of width fw[2] at both sides and 0 outside.  */
+/* Freed with fftw_free.                                                                       */
+float *SpecWhite_taper (const t_TraceNorm * const pn, const unsigned int Nz, const double scale) {
+	float *T;
+	double f, df, f1 = pn->fw[0], f2 = pn->fw[1], ft = pn->fw[2];
+	unsigned int n, Nh = Nz/2 + 1;
+	
+	if (NULL == (T = (float *)fftw_malloc(Nh*sizeof(float)) )) return NULL;
+	df = 1./(Nz*pn->dt);
+	for (n=0; n<Nh; n++) {
+		f = n*df;
+		if (f >= f1 && f <= f2) T[n] = scale;
+		else if (f < f1 && f > f1-ft) T[n] = scale * 0.5*(1 + cos(PI*(f1-f)/ft));
+		else if (f > f2 && f < f2+ft) T[n] = scale * 0.5*(1 + cos(PI*(f-f2)/ft));
+		else T[n] = 0;
+	}
+	return T;
+}
+
+/* Normalization of the Nh bins of a spectrum X: spectral whitening to the amplitudes T when  */
+/* T != NULL, otherwise filtered with the gains G when G != NULL.                             */
+void SpecNorm (double complex * const X, const unsigned int Nh, const float * const G, const float * const T) {
+	double da1;
+	unsigned int n;
+	
+	if (T != NULL) 
+		for (n=0; n<Nh; n++) {
+			da1 = cabs(X[n]);
+			X[n] = (da1 > 0) ? X[n] * (T[n]/da1) : 0;
+		}
+	else if (G != NULL) 
+		for (n=0; n<Nh; n++) X[n] *= G[n];
+}
+
+void SpecNormf (float complex * const X, const unsigned int Nh, const float * const G, const float * const T) {
+	float fa1;
+	unsigned int n;
+	
+	if (T != NULL) 
+		for (n=0; n<Nh; n++) {
+			fa1 = cabsf(X[n]);
+			X[n] = (fa1 > 0) ? X[n] * (T[n]/fa1) : 0;
+		}
+	else if (G != NULL) 
+		for (n=0; n<Nh; n++) X[n] *= G[n];
+}
+
+/* Normalizes the traces x in place, in parallel over the traces: RAM and then spectral whitening. */
+int TraceNorm_apply (float ** const x, const unsigned int N, const unsigned int Tr, const t_TraceNorm * const pn) {
+	float *T = NULL;
+	unsigned int Nz, Nh;
+	int nerr = 0;
+	
+	if (pn == NULL || (pn->M == 0 && pn->fw[1] == 0)) return 0;
+	Nz = 1 << (unsigned int)ceil(log2(N));
+	Nh = Nz/2 + 1;
+	
+	/* 1/Nz to normalize the ifft */
+	if (pn->fw[1] > 0 && NULL == (T = SpecWhite_taper (pn, Nz, 1./(double)Nz) )) {
+		printf("TraceNorm_apply: Out of memory\n");
+		return 4;
+	}
+	
+	#pragma omp parallel
+	{
+		fftwf_plan pxX, pXx;
+		fftwf_complex *X;
+		float *xf;
+		int tr;
+		
+		#pragma omp critical
+		{
+			xf = (float *)fftw_malloc(Nz*sizeof(float));
+			X  = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			pxX = fftwf_plan_dft_r2c_1d(Nz, xf, X, FFTW_ESTIMATE); /* The FFT plan  */
+			pXx = fftwf_plan_dft_c2r_1d(Nz, X, xf, FFTW_ESTIMATE); /* The IFFT plan */
+			if (xf == NULL || X == NULL) nerr = 4;
+		}
+		
+		if (xf != NULL && X != NULL) {
+			#pragma omp for schedule(static)
+			for (tr=0; tr<Tr; tr++) {
+				if (pn->M) RunAbsMean (xf, x[tr], N, pn->M);
+				else memcpy(xf, x[tr], N*sizeof(float));
+				if (T != NULL) {
+					memset(xf + N, 0, (Nz-N)*sizeof(float));
+					fftwf_execute(pxX);
+					SpecNormf (X, Nh, NULL, T);
+					fftwf_execute(pXx);
+				}
+				memcpy(x[tr], xf, N*sizeof(float));
+			}
+		}
+		
+		#pragma omp critical
+		{
+			fftwf_destroy_plan(pxX);
+			fftwf_destroy_plan(pXx);
+			fftw_free(X);
+			fftw_free(xf);
+		}
+	}
+	if (nerr) printf("TraceNorm_apply: Out of memory\n");
+	
+	fftw_free(T);
+	return nerr;
+}
+
+/* Gaps: runs of at least gmin zeros, e.g., zero-filled data gaps. The valid samples between  */
+/* them are kept as runs r[2k] ... r[2k+1]-1, k < K. gap_runs_size() is the size r must have. */
+unsigned int gap_runs_size (const unsigned int N, const unsigned int gmin) {
+	return 2*((N + gmin)/(gmin + 1) + 1);
+}
+
+/* Valid runs of x. Returns K, the number of runs (0: all gaps). */
+unsigned int GapRuns (unsigned int * const r, const float * const x, const unsigned int N, const unsigned int gmin) {
+	unsigned int n, z, a = 0, K = 0;  /* a: first sample of the current run */
+	
+	for (n=0; n<N; ) {
+		if (x[n] != 0) { n++; continue; }
+		for (z=n; n<N && x[n] == 0; n++);   /* zeros z...n-1 */
+		if (n-z < gmin) continue;
+		if (z > a) {
+			r[2*K]   = a;
+			r[2*K+1] = z;
+			K++;
+		}
+		a = n;
+	}
+	if (N > a) {
+		r[2*K]   = a;
+		r[2*K+1] = N;
+		K++;
+	}
+	return K;
+}
+
+/* 1 when the K runs r do not cover the N samples. */
+int HasGaps (const unsigned int * const r, const unsigned int K, const unsigned int N) {
+	return (K != 1 || r[0] != 0 || r[1] != N);
+}
+
+/* Zeros the gaps of x, an array of N elements of size bytes (float, double, complex, ...). */
+void GapZero (void * const x, const size_t size, const unsigned int * const r, const unsigned int K, const unsigned int N) {
+	char *pc = (char *)x;
+	unsigned int k, a = 0;
+	
+	for (k=0; k<K; k++) {
+		memset(pc + a*size, 0, (r[2*k]-a)*size);
+		a = r[2*k+1];
+	}
+	memset(pc + a*size, 0, (N-a)*size);
+}
+
+/* Prefix sums of the mask of the runs r: C[n] = number of valid samples before n, n <= N. */
+void GapCount (double * const C, const unsigned int * const r, const unsigned int K, const unsigned int N) {
+	unsigned int n, k, a = 0;
+	double c = 0;
+	
+	for (k=0; k<K; k++) {
+		for (n=a; n<r[2*k]; n++)  C[n] = c;
+		for (   ; n<r[2*k+1]; n++) C[n] = c++;
+		a = n;
+	}
+	for (n=a; n<=N; n++) C[n] = c;
+}
+
+/* Masked normalization of the L lags lag, lag+1, ...: e[l] = sum over the runs r of the sums  */
+/* P[r[2k+1]+t] - P[r[2k]+t], t = s*(lag+l), of the prefix sums P (N+1, clamped at the edges). */
+/* s = 1: sum_n m1[n] x2[n+t] with the runs of x1 & the prefix sums of x2.                     */
+/* s =-1: sum_n x1[n] m2[n+t] with the runs of x2 & the prefix sums of x1. O(L*K).             */
+void gap_lowlevel (double * const e, const double * const P, const unsigned int N, const unsigned int * const r, 
+		const unsigned int K, const int s, const unsigned int L, const int lag) {
+	long t, n1, n2;
+	unsigned int l, k;
+	double da1;
+	
+	for (l=0; l<L; l++) {
+		t = s*((long)lag + l);
+		da1 = 0;
+		for (k=0; k<K; k++) {
+			n1 = r[2*k]   + t;
+			n2 = r[2*k+1] + t;
+			if (n2 <= 0 || n1 >= (long)N) continue;
+			if (n1 < 0) n1 = 0;
+			if (n2 > (long)N) n2 = N;
+			da1 += P[n2] - P[n1];
+		}
+		e[l] = da1;
+	}
+}
+
+/* pn: per-trace RAM & spectral whitening (NULL: none), done on the fly in the same pass. The whitening is     */
+/* applied on the spectra of the analytic signals, which are then computed at length Nz on the zero-padded     */
+/* traces and cut back to N samples, as in ccgn.                                                               */
+/* gaps: > 0 masks the gaps, runs of at least gaps zeros (see GapRuns), of the phase signals, each lag is then */
+/* normalized by the number of valid overlapping samples instead of N.                                         */
+int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, 
+		const t_TraceNorm * const pn, const int gaps) {
 //#ifdef CUDAON
 //	return cuda_pcc2_set (y, x1, x2, N, Tr, Lag1, Lag2);
 //#else
 	unsigned int Nz, M, ua1, ua2;
 	int L, lag, nerr=0;
+	float *T=NULL;
 	
 	if (Lag2 >= Lag1) {
 		L=Lag2-Lag1+1;
@@ -804,13 +1482,21 @@ int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsi
 	M = (ua1 > ua2) ? ua1 : ua2;
 	Nz = 1 << (unsigned int)ceil(log2(N+M)); /* Because the lags higher than M are rejected */
 	
+	/* Spectral whitening amplitudes at length Nz */
+	if (pn != NULL && pn->fw[1] > 0 && NULL == (T = SpecWhite_taper (pn, Nz, 1) )) {
+		printf("pcc2_set: Out of memory\n");
+		return 4;
+	}
+	
 	#pragma omp parallel
 	{
-		fftwf_plan pain1, paout1, pain2, paout2, pin1, pin2, pout;
+		fftwf_plan pain1, paout1, pain2, paout2, pin1, pin2, pout, pwain1=NULL, pwaout1=NULL, pwain2=NULL, pwaout2=NULL;
 		float *x, fa1;
 		fftwf_complex *xa1=NULL, *xa2=NULL, *out=NULL;
-		unsigned int tr;
-		int n;
+		t_PrunedIFFTf *ppr;
+		double *C=NULL, *c=NULL;
+		unsigned int tr, K1=0, K2=0, *r1=NULL, *r2=NULL;
+		int n, masked = 0;
 		
 		#pragma omp critical
 		{
@@ -818,6 +1504,13 @@ int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			xa1  = (fftwf_complex *)fftw_malloc(Nz*sizeof(fftwf_complex));
 			xa2  = (fftwf_complex *)fftw_malloc(Nz*sizeof(fftwf_complex));
 			out  = (fftwf_complex *)fftw_malloc(Nz*sizeof(fftwf_complex));
+			if (gaps) {  /* Runs of valid samples & their overlapping counts */
+				r1 = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+				r2 = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+				C  = (double *)malloc((N+1)*sizeof(double));
+				c  = (double *)malloc(L*sizeof(double));
+				if (r1 == NULL || r2 == NULL || C == NULL || c == NULL) nerr = 4;
+			}
 			
 			pain1 = fftwf_plan_dft_r2c_1d(N, x, xa1, FFTW_ESTIMATE);
 			pain2 = fftwf_plan_dft_r2c_1d(N, x, xa2, FFTW_ESTIMATE);
@@ -826,34 +1519,70 @@ int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			pin1 = fftwf_plan_dft_1d(Nz, xa1, xa1, FFTW_FORWARD, FFTW_ESTIMATE);
 			pin2 = fftwf_plan_dft_1d(Nz, xa2, xa2, FFTW_FORWARD, FFTW_ESTIMATE);
 			pout = fftwf_plan_dft_1d(Nz, out, out, FFTW_BACKWARD, FFTW_ESTIMATE); /* IFFT plan          */
+			ppr  = CreatePrunedIFFTf (Nz, L, lag);   /* NULL when the full IFFT is cheaper */
+			if (T != NULL) {  /* Analytic signals of the zero-padded traces, whitened */
+				pwain1  = fftwf_plan_dft_r2c_1d(Nz, x, xa1, FFTW_ESTIMATE);
+				pwain2  = fftwf_plan_dft_r2c_1d(Nz, x, xa2, FFTW_ESTIMATE);
+				pwaout1 = fftwf_plan_dft_1d(Nz, xa1, xa1, FFTW_BACKWARD, FFTW_ESTIMATE);
+				pwaout2 = fftwf_plan_dft_1d(Nz, xa2, xa2, FFTW_BACKWARD, FFTW_ESTIMATE);
+			}
 		}
 		
-		if (xa1 != NULL && x2 != NULL && out != NULL) {
+		if (xa1 != NULL && x2 != NULL && out != NULL && (!gaps || (r1 != NULL && r2 != NULL && C != NULL && c != NULL))) {
 			fa1 = 1/((float)Nz*(float)N); /* N*Nz may become a very high number */
 
 			/* Analytic signal, zero padding and FFT of every x */
 			#pragma omp for schedule(static)
 			for (tr=0; tr<Tr; tr++) {
+				if (gaps) {
+					K1 = GapRuns (r1, x1[tr], N, gaps);
+					K2 = GapRuns (r2, x2[tr], N, gaps);
+					masked = HasGaps (r1, K1, N) || HasGaps (r2, K2, N);
+				}
+				
 				/* Phase signal zero padding and the FFT before the actual xcorr */
-				memcpy(x, x1[tr], N*sizeof(float));
-				AnalyticSignal_plan_float (xa1, x, N, &pain1, &paout1);
+				if (pn != NULL && pn->M) RunAbsMean (x, x1[tr], N, pn->M);
+				else memcpy(x, x1[tr], N*sizeof(float));
+				if (pwain1 != NULL) {
+					memset(x + N, 0, (Nz-N)*sizeof(float));
+					AnalyticSignal_gain_float (xa1, x, Nz, &pwain1, &pwaout1, NULL, T);
+				} else AnalyticSignal_plan_float (xa1, x, N, &pain1, &paout1);
 				AmpNormf(xa1, N);
+				if (masked) GapZero (xa1, sizeof(fftwf_complex), r1, K1, N);
 				for (n=N; n<Nz; n++) xa1[n] = 0;
 				fftwf_execute(pin1);
 				
-				memcpy(x, x2[tr], N*sizeof(float));
-				AnalyticSignal_plan_float (xa2, x, N, &pain2, &paout2);
+				if (pn != NULL && pn->M) RunAbsMean (x, x2[tr], N, pn->M);
+				else memcpy(x, x2[tr], N*sizeof(float));
+				if (pwain2 != NULL) {
+					memset(x + N, 0, (Nz-N)*sizeof(float));
+					AnalyticSignal_gain_float (xa2, x, Nz, &pwain2, &pwaout2, NULL, T);
+				} else AnalyticSignal_plan_float (xa2, x, N, &pain2, &paout2);
 				AmpNormf(xa2, N);
+				if (masked) GapZero (xa2, sizeof(fftwf_complex), r2, K2, N);
 				for (n=N; n<Nz; n++) xa2[n] = 0;
 				fftwf_execute(pin2);
 				
 				/* The actual xcorr */
 				for (n=0; n<Nz; n++) out[n] = conj(xa1[n])*xa2[n];  /* the product        */
-				fftwf_execute(pout);                                /* IFFT of the result */
+				if (ppr != NULL) {
+					/* Only the real part of the lags of interest */
+					PrunedIFFTf_execute (y[tr], ppr, out, 1);
+					for (n=0; n<L; n++) y[tr][n] *= fa1;
+				} else {
+					fftwf_execute(pout);                            /* IFFT of the result */
 				
-				/* Copy the lags of interest and normalize */
-				for (n=0; n<-lag; n++) y[tr][n] = fa1 * out[n+Nz+lag];
-				for (   ; n<L;    n++) y[tr][n] = fa1 * out[n+lag];
+					/* Copy the lags of interest and normalize */
+					for (n=0; n<-lag; n++) y[tr][n] = fa1 * out[n+Nz+lag];
+					for (   ; n<L;    n++) y[tr][n] = fa1 * out[n+lag];
+				}
+				
+				/* Gaps: normalized by the valid overlapping samples of each lag */
+				if (masked) {
+					GapCount (C, r2, K2, N);
+					gap_lowlevel (c, C, N, r1, K1, 1, L, lag);
+					for (n=0; n<L; n++) y[tr][n] = (c[n] > 0.5) ? y[tr][n] * (float)(N/c[n]) : 0;
+				}
 			}
 		}
 		
@@ -867,23 +1596,43 @@ int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fftwf_destroy_plan(pain2);
 			fftwf_destroy_plan(paout1);
 			fftwf_destroy_plan(paout2);
+			if (pwain1 != NULL) {
+				fftwf_destroy_plan(pwain1);
+				fftwf_destroy_plan(pwain2);
+				fftwf_destroy_plan(pwaout1);
+				fftwf_destroy_plan(pwaout2);
+			}
+			DestroyPrunedIFFTf(ppr);
 			
 			/* Clean up */
 			fftw_free(out);
 			fftw_free(xa2);
 			fftw_free(xa1);
 			fftw_free(x);
+			free(r1);
+			free(r2);
+			free(C);
+			free(c);
 		}
 	}
 	
+	if (nerr) printf("pcc2_set: Out of memory\n");
+	fftw_free(T);
 	return nerr;
 //#endif
 }
 
-int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2) {
+/* pn: per-trace RAM & spectral whitening (NULL: none), done on the fly in the same pass. The      */
+/* whitening is applied on the spectra of the xcorr, the whitened traces being recovered, cut to N */
+/* samples and transformed again.                                                                  */
+/* gaps: > 0 normalizes each lag by the energies on the valid overlapping samples, the gaps being  */
+/* the runs of at least gaps zeros (see GapRuns). The whitened traces are gap-zeroed as well.      */
+int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, 
+		const t_TraceNorm * const pn, const int gaps) {
 	unsigned int Nz, M, Nh, ua1, ua2;
 	unsigned int n11=0, n21=0, n12=N, n22=N;
 	int L, lag, nerr=0;
+	float *T=NULL;
 	
 	if (Lag2 >= Lag1) {
 		L=Lag2-Lag1+1;
@@ -909,13 +1658,23 @@ int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsi
 	Nz = 1 << (unsigned int)ceil(log2(N+M));  /* Because the lags higher than M are rejected */
 	Nh = Nz/2 + 1;  /* Number of complex used in r2c & c2r ffts. */
 	
+	/* Spectral whitening amplitudes at length Nz */
+	if (pn != NULL && pn->fw[1] > 0 && NULL == (T = SpecWhite_taper (pn, Nz, 1) )) {
+		printf("ccgn_set: Out of memory\n");
+		return 4;
+	}
+	
 	#pragma omp parallel
 	{
-		fftw_plan pin1, pin2, pout;
+		fftw_plan pin1, pin2, pout, pwin1=NULL, pwin2=NULL;
 		double *in1, *in2, *out, *yd;
-		double norm1, norm2;
+		double norm1, norm2, da1 = 1./(double)Nz, da2;
+		double *P1=NULL, *P2=NULL, *e1=NULL, *e2=NULL;
+		float *xr = NULL;
 		fftw_complex *fout, *fin1, *fin2;
-		unsigned int n, tr;
+		t_PrunedIFFT *ppr;
+		unsigned int n, tr, K1=0, K2=0, *r1=NULL, *r2=NULL;
+		int masked = 0;
 		
 		#pragma omp critical
 		{
@@ -926,32 +1685,98 @@ int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fin1 = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
 			fin2 = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
 			fout = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
+			if (pn != NULL && pn->M) {
+				xr = (float *)fftw_malloc(N*sizeof(float));  /* RAM normalized trace */
+				if (xr == NULL) nerr = 4;
+			}
+			if (gaps) {  /* Runs of valid samples & the energies on the overlapping ones */
+				r1 = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+				r2 = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+				P1 = (double *)malloc((N+1)*sizeof(double));
+				P2 = (double *)malloc((N+1)*sizeof(double));
+				e1 = (double *)malloc(L*sizeof(double));
+				e2 = (double *)malloc(L*sizeof(double));
+				if (r1 == NULL || r2 == NULL || P1 == NULL || P2 == NULL || e1 == NULL || e2 == NULL) nerr = 4;
+			}
 			
 			/* Make plans */
 			pin1 = fftw_plan_dft_r2c_1d(Nz, in1, fin1, FFTW_ESTIMATE); /* FFT plan  */
 			pin2 = fftw_plan_dft_r2c_1d(Nz, in2, fin2, FFTW_ESTIMATE); /*    "      */
 			pout = fftw_plan_dft_c2r_1d(Nz, fout, out, FFTW_ESTIMATE); /* IFFT plan */
+			ppr  = CreatePrunedIFFT (Nz, L, lag);                      /* NULL when the full IFFT is cheaper */
+			if (T != NULL) {
+				pwin1 = fftw_plan_dft_c2r_1d(Nz, fin1, in1, FFTW_ESTIMATE); /* Whitened traces */
+				pwin2 = fftw_plan_dft_c2r_1d(Nz, fin2, in2, FFTW_ESTIMATE); /*       "         */
+			}
 		}
 		
-		if (in1 != NULL && in2 != NULL && out != NULL && fin1 != NULL && fin2 != NULL && fout != NULL) {
+		if (in1 != NULL && in2 != NULL && out != NULL && fin1 != NULL && fin2 != NULL && fout != NULL && (xr != NULL || pn == NULL || !pn->M) && 
+				(!gaps || (r1 != NULL && r2 != NULL && P1 != NULL && P2 != NULL && e1 != NULL && e2 != NULL))) {
 			
 			#pragma omp for schedule(static)
 			for (tr=0; tr<Tr; tr++) {
-				F2D_vec(in1, x1[tr], N);
+				if (gaps) {
+					K1 = GapRuns (r1, x1[tr], N, gaps);
+					K2 = GapRuns (r2, x2[tr], N, gaps);
+					masked = HasGaps (r1, K1, N) || HasGaps (r2, K2, N);
+				}
+				
+				if (xr != NULL) {
+					RunAbsMean (xr, x1[tr], N, pn->M);
+					F2D_vec(in1, xr, N);
+				} else F2D_vec(in1, x1[tr], N);
 				for (n=N; n<Nz; n++) in1[n] = 0;    /* Zero padding */
 				fftw_execute(pin1);                 /* FFT  */
 				
-				F2D_vec(in2, x2[tr], N);
+				if (xr != NULL) {
+					RunAbsMean (xr, x2[tr], N, pn->M);
+					F2D_vec(in2, xr, N);
+				} else F2D_vec(in2, x2[tr], N);
 				for (n=N; n<Nz; n++) in2[n] = 0;    /* Zero padding */
 				fftw_execute(pin2);                 /* FFT  */
 				
+				/* Whitening. The whitened traces are cut back to N samples & their gaps zeroed  */
+				/* before the FFTs of the xcorr, so that it sees the same samples as its norms.  */
+				if (T != NULL) {
+					SpecNorm (fin1, Nh, NULL, T);
+					SpecNorm (fin2, Nh, NULL, T);
+					fftw_execute(pwin1);
+					fftw_execute(pwin2);
+					for (n=0; n<N; n++) {
+						in1[n] *= da1;
+						in2[n] *= da1;
+					}
+					for (n=N; n<Nz; n++) in1[n] = in2[n] = 0;
+					if (masked) {  /* Whitening smears energy into the gaps */
+						GapZero (in1, sizeof(double), r1, K1, N);
+						GapZero (in2, sizeof(double), r2, K2, N);
+					}
+					fftw_execute(pin1);
+					fftw_execute(pin2);
+				}
+				
 				/* The actual xcorrs */
-				cc_lowlevel (yd, fin1, fin2, Nz, Lag1, Lag2, &pout, out, fout);
+				cc_lowlevel (yd, fin1, fin2, Nz, Lag1, Lag2, &pout, out, fout, ppr);
 				
-				/* Normalized by || x1 || * || x2 ||  (on the overlapping part only) */
-				norm1 = Norm (in1, n11, n12);    /* norm of the first lag. */
-				norm2 = Norm (in2, n21, n22);    /*         "              */
-				gn_lowlevel (yd, in1, in2, norm1, norm2, N, L, lag);
+				if (masked) {
+					/* Normalized by || x1 || * || x2 || on the valid overlapping samples of each lag */
+					P1[0] = P2[0] = 0;
+					for (n=0; n<N; n++) {
+						P1[n+1] = P1[n] + in1[n]*in1[n];
+						P2[n+1] = P2[n] + in2[n]*in2[n];
+					}
+					gap_lowlevel (e1, P1, N, r2, K2, -1, L, lag);
+					gap_lowlevel (e2, P2, N, r1, K1,  1, L, lag);
+					for (n=0; n<L; n++) {
+						da2 = e1[n]*e2[n];
+						yd[n] = (da2 > 0) ? yd[n]/sqrt(da2) : 0;
+					}
+				} else {
+					/* Normalized by || x1 || * || x2 ||  (on the overlapping part only) */
+					norm1 = Norm (in1, n11, n12);    /* norm of the first lag. */
+					norm2 = Norm (in2, n21, n22);    /*         "              */
+					gn_lowlevel (yd, in1, in2, norm1, norm2, N, L, lag);
+				}
 				D2F_vec(y[tr], yd, L);
 			}
 		}
@@ -962,6 +1787,9 @@ int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fftw_destroy_plan(pout);
 			fftw_destroy_plan(pin1);
 			fftw_destroy_plan(pin2);
+			if (pwin1 != NULL) fftw_destroy_plan(pwin1);
+			if (pwin2 != NULL) fftw_destroy_plan(pwin2);
+			DestroyPrunedIFFT(ppr);
 	
 			/* Clean up */
 			fftw_free(fout);
@@ -971,16 +1799,31 @@ int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fftw_free(in2);
 			fftw_free(out);
 			fftw_free(yd);
+			fftw_free(xr);
+			free(r1);
+			free(r2);
+			free(P1);
+			free(P2);
+			free(e1);
+			free(e2);
 		}
 	}
 	
+	if (nerr) printf("ccgn_set: Out of memory\n");
+	fftw_free(T);
 	return nerr;
 }
 
-int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2) {
+/* pn: per-trace RAM & spectral whitening (NULL: none), done on the fly in the same pass, before the  */
+/* 1-bit normalization.                                                                               */
+/* gaps: > 0 masks the gaps, runs of at least gaps zeros (see GapRuns), each lag is then normalized   */
+/* by the valid overlapping samples.                                                                  */
+int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, 
+		const t_TraceNorm * const pn, const int gaps) {
 	unsigned int Nz, M, Nh, ua1, ua2;
 	unsigned int n11=0, n21=0, n12=N, n22=N;
 	int L, lag, nerr=0;
+	float *T=NULL;
 	
 	if (Lag2 >= Lag1) {
 		L=Lag2-Lag1+1;
@@ -1008,13 +1851,21 @@ int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsi
 	Nz = 1 << (unsigned int)ceil(log2(N+M));  /* Because the lags higher than M are rejected */
 	Nh = Nz/2 + 1;  /* Number of complex used in r2c & c2r ffts. */
 	
+	/* Spectral whitening amplitudes at length Nz */
+	if (pn != NULL && pn->fw[1] > 0 && NULL == (T = SpecWhite_taper (pn, Nz, 1) )) {
+		printf("cc1b_set: Out of memory\n");
+		return 4;
+	}
+	
 	#pragma omp parallel
 	{
-		fftwf_plan pin1, pin2, pout;
+		fftwf_plan pin1, pin2, pout, pwin1=NULL, pwin2=NULL;
 		float *in1, *in2, *out, *pf1;
-		double norm1, norm2;
+		double norm1, norm2, *C=NULL, *c=NULL;
 		fftwf_complex *fout, *fin1, *fin2;
-		unsigned n, tr;
+		t_PrunedIFFTf *ppr;
+		unsigned n, tr, K1=0, K2=0, *r1=NULL, *r2=NULL;
+		int masked = 0;
 		
 		#pragma omp critical
 		{
@@ -1024,27 +1875,76 @@ int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fin1 = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
 			fin2 = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
 			fout = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			if (gaps) {  /* Runs of valid samples & their overlapping counts */
+				r1 = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+				r2 = (unsigned int *)malloc(gap_runs_size(N, gaps)*sizeof(unsigned int));
+				C  = (double *)malloc((N+1)*sizeof(double));
+				c  = (double *)malloc(L*sizeof(double));
+				if (r1 == NULL || r2 == NULL || C == NULL || c == NULL) nerr = 4;
+			}
 			
 			pin1 = fftwf_plan_dft_r2c_1d(Nz, in1, fin1, FFTW_ESTIMATE); /* FFT plan  */
 			pin2 = fftwf_plan_dft_r2c_1d(Nz, in2, fin2, FFTW_ESTIMATE); /*    "      */
 			pout = fftwf_plan_dft_c2r_1d(Nz, fout, out, FFTW_ESTIMATE); /* IFFT plan */
+			ppr  = CreatePrunedIFFTf (Nz, L, lag);                      /* NULL when the full IFFT is cheaper */
+			if (T != NULL) {
+				pwin1 = fftwf_plan_dft_c2r_1d(Nz, fin1, in1, FFTW_ESTIMATE); /* Whitened traces */
+				pwin2 = fftwf_plan_dft_c2r_1d(Nz, fin2, in2, FFTW_ESTIMATE); /*       "         */
+			}
 		}
 	
-		if (in1 != NULL && in2 != NULL && out != NULL && fin1 != NULL && fin2 != NULL && fout != NULL) {
+		if (in1 != NULL && in2 != NULL && out != NULL && fin1 != NULL && fin2 != NULL && fout != NULL && 
+				(!gaps || (r1 != NULL && r2 != NULL && C != NULL && c != NULL))) {
 			#pragma omp for schedule(static)
 			for (tr=0; tr<Tr; tr++) {
+				if (gaps) {
+					K1 = GapRuns (r1, x1[tr], N, gaps);
+					K2 = GapRuns (r2, x2[tr], N, gaps);
+					masked = HasGaps (r1, K1, N) || HasGaps (r2, K2, N);
+				}
+				
+				/* Whitening, the scale does not matter before the 1-bit. Neither does */
+				/* the RAM normalization when the traces are not whitened.            */
 				pf1 = x1[tr];
+				if (T != NULL) {
+					if (pn != NULL && pn->M) RunAbsMean (in1, pf1, N, pn->M);
+					else memcpy(in1, pf1, N*sizeof(float));
+					memset(in1 + N, 0, (Nz-N)*sizeof(float));
+					fftwf_execute(pin1);
+					SpecNormf (fin1, Nh, NULL, T);
+					fftwf_execute(pwin1);
+					pf1 = in1;
+				}
 				for (n=0; n<N; n++)  in1[n] = (pf1[n] >= 0) ? 1 : -1;
+				if (masked) GapZero (in1, sizeof(float), r1, K1, N);
 				for (n=N; n<Nz; n++) in1[n] = 0;    /* Zero padding */
 				fftwf_execute(pin1);                /* FFT  */
 				
 				pf1 = x2[tr];
+				if (T != NULL) {
+					if (pn != NULL && pn->M) RunAbsMean (in2, pf1, N, pn->M);
+					else memcpy(in2, pf1, N*sizeof(float));
+					memset(in2 + N, 0, (Nz-N)*sizeof(float));
+					fftwf_execute(pin2);
+					SpecNormf (fin2, Nh, NULL, T);
+					fftwf_execute(pwin2);
+					pf1 = in2;
+				}
 				for (n=0; n<N; n++)  in2[n] = (pf1[n] >  0) ? 1 : -1;
+				if (masked) GapZero (in2, sizeof(float), r2, K2, N);
 				for (n=N; n<Nz; n++) in2[n] = 0;    /* Zero padding */
 				fftwf_execute(pin2);                /* FFT  */
 				
 				/* The actual xcorrs */
-				ccf_lowlevel (y[tr], fin1, fin2, Nz, Lag1, Lag2, &pout, out, fout);
+				ccf_lowlevel (y[tr], fin1, fin2, Nz, Lag1, Lag2, &pout, out, fout, ppr);
+				
+				if (masked) {
+					/* Normalized by the valid overlapping samples of each lag */
+					GapCount (C, r2, K2, N);
+					gap_lowlevel (c, C, N, r1, K1, 1, L, lag);
+					for (n=0; n<L; n++) y[tr][n] = (c[n] > 0.5) ? y[tr][n] / c[n] : 0;
+					continue;
+				}
 				
 				/* Normalized by || x1 || * || x2 ||  (on the overlapping part only) */
 				norm1 = Normf (in1, n11, n12);    /* norm of the first lag. */
@@ -1059,6 +1959,9 @@ int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fftwf_destroy_plan(pout);
 			fftwf_destroy_plan(pin1);
 			fftwf_destroy_plan(pin2);
+			if (pwin1 != NULL) fftwf_destroy_plan(pwin1);
+			if (pwin2 != NULL) fftwf_destroy_plan(pwin2);
+			DestroyPrunedIFFTf(ppr);
 			
 			/* Clean up */
 			fftw_free(fout);
@@ -1067,175 +1970,780 @@ int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsi
 			fftw_free(in1);
 			fftw_free(in2);
 			fftw_free(out);
+			free(r1);
+			free(r2);
+			free(C);
+			free(c);
 		}
 	}
+	
+	if (nerr) printf("cc1b_set: Out of memory\n");
+	fftw_free(T);
 	return nerr;
 }
 
-/* Frequency domain version. */
-int tspcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, 
-		const unsigned int Tr, const int Lag1, const int Lag2, double pmin, double pmax, unsigned int V, int type, double op1) {
-	unsigned int J, S;
-	unsigned int Nz, M, m, ua1, ua2, Ls0;
-	double s0, b0, K0;
-	int L, nerr = 0;
-	t_WaveletFamily *pWF;
-	
-	L = abs(Lag2-Lag1+1);
+/* Overlap-save (block convolution) versions of ccgn, cc1b & pcc2.                  */
+/* x1 is cut in blocks of B = Nseg-L+1 samples and x2 in overlapping segments of    */
+/* B+L-1 samples starting Lag1 samples later, so the Nseg-point circular xcorr of   */
+/* each pair holds exactly the L lags of interest. The cross-spectra of all blocks  */
+/* are accumulated and only one Nseg-point IFFT is done per trace.                  */
+
+/* FFT length of the overlap-save segments, about 4 times the lag span. Returns 0   */
+/* when a segment would not be shorter than the whole-trace FFT (Nz >= N+M).        */
+unsigned int ols_length (const unsigned int N, const int Lag1, const int Lag2) {
+	unsigned int L, M, Nz, Nseg, ua1, ua2;
 	
-	/* Memory allocation */
+	L = abs(Lag2-Lag1)+1;
 	ua1 = abs(Lag1);
 	ua2 = abs(Lag2);
-	if (ua1 >= N || ua2 >= N) return -3; /* Too large lags */
 	M = (ua1 > ua2) ? ua1 : ua2;
-	Nz = 1 << (unsigned int)ceil(log2(N+M)); /* Because the lags higher than M are rejected */
+	Nz = 1 << (unsigned int)ceil(log2(N+M));
+	Nseg = 1 << (unsigned int)ceil(log2(4*L));
+	if (Nseg < 256) Nseg = 256;
+	
+	return (Nseg < Nz) ? Nseg : 0;
+}
+
+int ccgn_ols_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, 
+		const int Lag1, const int Lag2, const unsigned int Nseg) {
+	unsigned int B, Nh, ua1, ua2;
+	unsigned int n11=0, n21=0, n12=N, n22=N;
+	int L, lag, nerr=0;
+	
+	if (Lag2 >= Lag1) {
+		L=Lag2-Lag1+1;
+		lag = Lag1;
+	} else {
+		L=Lag1-Lag2+1;
+		lag = Lag2;
+	}
+	
+	if (lag > 0) { 
+		n21  = (unsigned)lag;
+		n12 -= (unsigned)lag;
+	} else {
+		n11  = (unsigned)(-lag);
+		n22 -= (unsigned)(-lag);
+	}
+	
+	ua1 = abs(Lag1);
+	ua2 = abs(Lag2);
+	if (ua1 >= N || ua2 >= N) return -3; /* Too large lags */
+	if (Nseg < 2*L) return -3;           /* Too short segments */
+	B  = Nseg - L + 1;  /* x1 samples per segment. */
+	Nh = Nseg/2 + 1;    /* Number of complex used in r2c & c2r ffts. */
+	
+	#pragma omp parallel
+	{
+		fftw_plan pin1, pin2, pout;
+		double *in1, *in2, *out, da1 = 1./(double)Nseg;
+		fftw_complex *fin1, *fin2, *fout;
+		unsigned int n, n0, nb, tr;
+		int m;
+		
+		#pragma omp critical
+		{
+			in1 = (double *)fftw_malloc(Nseg*sizeof(double));
+			in2 = (double *)fftw_malloc(Nseg*sizeof(double));
+			out = (double *)fftw_malloc(Nseg*sizeof(double));
+			fin1 = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
+			fin2 = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
+			fout = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
+			
+			/* Make plans */
+			pin1 = fftw_plan_dft_r2c_1d(Nseg, in1, fin1, FFTW_ESTIMATE); /* FFT plan  */
+			pin2 = fftw_plan_dft_r2c_1d(Nseg, in2, fin2, FFTW_ESTIMATE); /*    "      */
+			pout = fftw_plan_dft_c2r_1d(Nseg, fout, out, FFTW_ESTIMATE); /* IFFT plan */
+		}
+		
+		if (in1 != NULL && in2 != NULL && out != NULL && fin1 != NULL && fin2 != NULL && fout != NULL) {
+			#pragma omp for schedule(static)
+			for (tr=0; tr<Tr; tr++) {
+				memset(fout, 0, Nh*sizeof(fftw_complex));
+				for (n0=0; n0<N; n0+=B) {
+					nb = (N-n0 < B) ? N-n0 : B;
+					F2D_vec(in1, x1[tr] + n0, nb);
+					for (n=nb; n<Nseg; n++) in1[n] = 0;   /* Zero padding */
+					m = (int)n0 + lag;
+					for (n=0; n<nb+L-1; n++, m++) in2[n] = (m >= 0 && m < (int)N) ? x2[tr][m] : 0;
+					for (   ; n<Nseg;   n++)      in2[n] = 0;
+					fftw_execute(pin1);
+					fftw_execute(pin2);
+					for (n=0; n<Nh; n++) fout[n] += conj(fin1[n])*fin2[n]; /* the product */
+				}
+				fftw_execute(pout);                                     /* IFFT of the result */
+				for (n=0; n<L; n++) y[tr][n] = da1 * out[n];
+				
+				/* Normalized by || x1 || * || x2 ||  (on the overlapping part only) */
+				gnf_lowlevel (y[tr], x1[tr], x2[tr], Normf(x1[tr], n11, n12), Normf(x2[tr], n21, n22), N, L, lag);
+			}
+		}
+		
+		#pragma omp critical
+		{
+			/* Destroy the FFT & IFFT plans */
+			fftw_destroy_plan(pout);
+			fftw_destroy_plan(pin1);
+			fftw_destroy_plan(pin2);
+			
+			/* Clean up */
+			fftw_free(fout);
+			fftw_free(fin2);
+			fftw_free(fin1);
+			fftw_free(in1);
+			fftw_free(in2);
+			fftw_free(out);
+		}
+	}
+	
+	return nerr;
+}
+
+int cc1b_ols_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, 
+		const int Lag1, const int Lag2, const unsigned int Nseg) {
+	unsigned int B, Nh, ua1, ua2;
+	int L, lag, nerr=0;
+	
+	if (Lag2 >= Lag1) {
+		L=Lag2-Lag1+1;
+		lag = Lag1;
+	} else {
+		L=Lag1-Lag2+1;
+		lag = Lag2;
+	}
+	
+	ua1 = abs(Lag1);
+	ua2 = abs(Lag2);
+	if (ua1 >= N || ua2 >= N) return -3; /* Too large lags */
+	if (Nseg < 2*L) return -3;           /* Too short segments */
+	B  = Nseg - L + 1;  /* x1 samples per segment. */
+	Nh = Nseg/2 + 1;    /* Number of complex used in r2c & c2r ffts. */
+	
+	#pragma omp parallel
+	{
+		fftwf_plan pin1, pin2, pout;
+		float *in1, *in2, *out, fa1 = 1./(float)Nseg;
+		fftwf_complex *fin1, *fin2, *fout;
+		unsigned int n, n0, nb, tr;
+		int m;
+		
+		#pragma omp critical
+		{
+			in1 = (float *)fftw_malloc(Nseg*sizeof(float));
+			in2 = (float *)fftw_malloc(Nseg*sizeof(float));
+			out = (float *)fftw_malloc(Nseg*sizeof(float));
+			fin1 = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			fin2 = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			fout = (fftwf_complex *)fftw_malloc(Nh*sizeof(fftwf_complex));
+			
+			pin1 = fftwf_plan_dft_r2c_1d(Nseg, in1, fin1, FFTW_ESTIMATE); /* FFT plan  */
+			pin2 = fftwf_plan_dft_r2c_1d(Nseg, in2, fin2, FFTW_ESTIMATE); /*    "      */
+			pout = fftwf_plan_dft_c2r_1d(Nseg, fout, out, FFTW_ESTIMATE); /* IFFT plan */
+		}
+		
+		if (in1 != NULL && in2 != NULL && out != NULL && fin1 != NULL && fin2 != NULL && fout != NULL) {
+			#pragma omp for schedule(static)
+			for (tr=0; tr<Tr; tr++) {
+				memset(fout, 0, Nh*sizeof(fftwf_complex));
+				for (n0=0; n0<N; n0+=B) {
+					nb = (N-n0 < B) ? N-n0 : B;
+					for (n=0; n<nb;   n++) in1[n] = (x1[tr][n0+n] >= 0) ? 1 : -1;
+					for (   ; n<Nseg; n++) in1[n] = 0;    /* Zero padding */
+					m = (int)n0 + lag;
+					for (n=0; n<nb+L-1; n++, m++) 
+						in2[n] = (m < 0 || m >= (int)N) ? 0 : (x2[tr][m] > 0) ? 1 : -1;
+					for (   ; n<Nseg;   n++) in2[n] = 0;  /* Zero padding */
+					fftwf_execute(pin1);
+					fftwf_execute(pin2);
+					for (n=0; n<Nh; n++) fout[n] += conjf(fin1[n])*fin2[n]; /* the product */
+				}
+				fftwf_execute(pout);                                     /* IFFT of the result */
+				
+				/* Normalized by || x1 || * || x2 ||, the number of overlapping samples for 1-bit signals. */
+				for (n=0; n<L; n++) y[tr][n] = fa1 * out[n] / (float)(N - abs(lag + (int)n));
+			}
+		}
+		
+		#pragma omp critical
+		{
+			 /* Destroy the FFT & IFFT plans */
+			fftwf_destroy_plan(pout);
+			fftwf_destroy_plan(pin1);
+			fftwf_destroy_plan(pin2);
+			
+			/* Clean up */
+			fftw_free(fout);
+			fftw_free(fin2);
+			fftw_free(fin1);
+			fftw_free(in1);
+			fftw_free(in2);
+			fftw_free(out);
+		}
+	}
+	return nerr;
+}
+
+int pcc2_ols_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, 
+		const int Lag1, const int Lag2, const unsigned int Nseg) {
+	unsigned int B, ua1, ua2;
+	int L, lag, nerr=0;
+	
+	if (Lag2 >= Lag1) {
+		L=Lag2-Lag1+1;
+		lag = Lag1;
+	} else {
+		L=Lag1-Lag2+1;
+		lag = Lag2;
+	}
+	
+	ua1 = abs(Lag1);
+	ua2 = abs(Lag2);
+	if (ua1 >= N || ua2 >= N) return -3; /* Too large lags */
+	if (Nseg < 2*L) return -3;           /* Too short segments */
+	B = Nseg - L + 1;  /* x1 samples per segment. */
+	
+	#pragma omp parallel
+	{
+		fftwf_plan pain1, paout1, pain2, paout2, pin1, pin2, pout;
+		float *x, fa1;
+		fftwf_complex *xa1=NULL, *xa2=NULL, *in1=NULL, *in2=NULL, *out=NULL;
+		unsigned int n, n0, nb, tr;
+		int m;
+		
+		#pragma omp critical
+		{
+			x    = (float *)fftw_malloc(N*sizeof(float));
+			xa1  = (fftwf_complex *)fftw_malloc(N*sizeof(fftwf_complex));
+			xa2  = (fftwf_complex *)fftw_malloc(N*sizeof(fftwf_complex));
+			in1  = (fftwf_complex *)fftw_malloc(Nseg*sizeof(fftwf_complex));
+			in2  = (fftwf_complex *)fftw_malloc(Nseg*sizeof(fftwf_complex));
+			out  = (fftwf_complex *)fftw_malloc(Nseg*sizeof(fftwf_complex));
+			
+			pain1 = fftwf_plan_dft_r2c_1d(N, x, xa1, FFTW_ESTIMATE);
+			pain2 = fftwf_plan_dft_r2c_1d(N, x, xa2, FFTW_ESTIMATE);
+			paout1 = fftwf_plan_dft_1d(N, xa1, xa1, FFTW_BACKWARD, FFTW_ESTIMATE);
+			paout2 = fftwf_plan_dft_1d(N, xa2, xa2, FFTW_BACKWARD, FFTW_ESTIMATE);
+			pin1 = fftwf_plan_dft_1d(Nseg, in1, in1, FFTW_FORWARD, FFTW_ESTIMATE);
+			pin2 = fftwf_plan_dft_1d(Nseg, in2, in2, FFTW_FORWARD, FFTW_ESTIMATE);
+			pout = fftwf_plan_dft_1d(Nseg, out, out, FFTW_BACKWARD, FFTW_ESTIMATE); /* IFFT plan          */
+		}
+		
+		if (x != NULL && xa1 != NULL && xa2 != NULL && in1 != NULL && in2 != NULL && out != NULL) {
+			fa1 = 1/((float)Nseg*(float)N);
+			
+			#pragma omp for schedule(static)
+			for (tr=0; tr<Tr; tr++) {
+				/* Phase signals of the whole traces */
+				memcpy(x, x1[tr], N*sizeof(float));
+				AnalyticSignal_plan_float (xa1, x, N, &pain1, &paout1);
+				AmpNormf(xa1, N);
+				
+				memcpy(x, x2[tr], N*sizeof(float));
+				AnalyticSignal_plan_float (xa2, x, N, &pain2, &paout2);
+				AmpNormf(xa2, N);
+				
+				/* Segment by segment xcorr */
+				memset(out, 0, Nseg*sizeof(fftwf_complex));
+				for (n0=0; n0<N; n0+=B) {
+					nb = (N-n0 < B) ? N-n0 : B;
+					memcpy(in1, xa1 + n0, nb*sizeof(fftwf_complex));
+					for (n=nb; n<Nseg; n++) in1[n] = 0;
+					m = (int)n0 + lag;
+					for (n=0; n<nb+L-1; n++, m++) in2[n] = (m >= 0 && m < (int)N) ? xa2[m] : 0;
+					for (   ; n<Nseg;   n++)      in2[n] = 0;
+					fftwf_execute(pin1);
+					fftwf_execute(pin2);
+					for (n=0; n<Nseg; n++) out[n] += conjf(in1[n])*in2[n];  /* the product */
+				}
+				fftwf_execute(pout);                                         /* IFFT of the result */
+				
+				/* Copy the lags of interest and normalize */
+				for (n=0; n<L; n++) y[tr][n] = fa1 * crealf(out[n]);
+			}
+		}
+		
+		#pragma omp critical
+		{
+			/* Destroy plans */
+			fftwf_destroy_plan(pout);
+			fftwf_destroy_plan(pin1);
+			fftwf_destroy_plan(pin2);
+			fftwf_destroy_plan(pain1);
+			fftwf_destroy_plan(pain2);
+			fftwf_destroy_plan(paout1);
+			fftwf_destroy_plan(paout2);
+			
+			/* Clean up */
+			fftw_free(out);
+			fftw_free(in2);
+			fftw_free(in1);
+			fftw_free(xa2);
+			fftw_free(xa1);
+			fftw_free(x);
+		}
+	}
+	
+	return nerr;
+}
+
+/* Zero padded spectrum of the trace x, shifted Ls0 samples and scaled by da2. */
+void tspcc2_decomposition (double complex * const in, float * const x, const unsigned int N, const unsigned int Nz, 
+		const unsigned int Ls0, const double da2, fftw_plan pin) {
+	double *pd1, *pd0 = (double *)in;  /* In-place r2c, the real samples are stored in the spectrum. */
+	unsigned int n;
+	
+	memset(pd0, 0, Ls0*sizeof(double));
+	pd1 = pd0 + Ls0;
+	for (n=0; n<N; n++) pd1[n] = da2*x[n];
+	memset(pd1 + N, 0, (Nz-N-Ls0)*sizeof(double));
+	fftw_execute(pin);
+}
+
+void tspcc2f_decomposition (float complex * const in, float * const x, const unsigned int N, const unsigned int Nz, 
+		const unsigned int Ls0, const float fa2, fftwf_plan pin) {
+	float *pd1, *pd0 = (float *)in;  /* In-place r2c, the real samples are stored in the spectrum. */
+	unsigned int n;
+	
+	memset(pd0, 0, Ls0*sizeof(float));
+	pd1 = pd0 + Ls0;
+	for (n=0; n<N; n++) pd1[n] = fa2*x[n];
+	memset(pd1 + N, 0, (Nz-N-Ls0)*sizeof(float));
+	fftwf_execute(pin);
+}
+
+/* Adds the wavelet phase cross-correlation at one scale to the spectrum y_wt.             */
+/* in1 & in2 are the half spectra of the two traces and fw the W bins k1 ... k1+W-1 (mod Nz) of */
+/* the band of the wavelet. Only the Nz/D bins k0 ... k0+Nz/D-1 (mod Nz) are transformed,  */
+/* x1_wt & x2_wt are Nz/D scratch.                                                          */
+void tspcc2_lowlevel (double complex * const y_wt, double complex * const in1, double complex * const in2, 
+		double complex * const fw, const unsigned int k1, const unsigned int W, const unsigned int Nz, const unsigned int D, const unsigned int k0, const double scale, 
+		double complex * const x1_wt, double complex * const x2_wt, fftw_plan px1_iwt, fftw_plan px1_wt, fftw_plan px2_iwt, fftw_plan px2_wt) {
+	unsigned int n, j, k, Nd = Nz/D;
+	double da3;
+	
+	/* BPFs, the band of the wavelet within the window */
+	memset(x1_wt, 0, Nd*sizeof(fftw_complex));
+	memset(x2_wt, 0, Nd*sizeof(fftw_complex));
+	for (j=0, k=k1; j<W; j++, k=(k+1) & (Nz-1)) {
+		n = (k - k0) & (Nz-1);
+		if (n < Nd) {
+			if (k <= Nz/2) {
+				x1_wt[n] = in1[k]*fw[j];
+				x2_wt[n] = in2[k]*fw[j];
+			} else {  /* Hermitian symmetry of the real inputs */
+				x1_wt[n] = conj(in1[Nz-k])*fw[j];
+				x2_wt[n] = conj(in2[Nz-k])*fw[j];
+			}
+		}
+	}
+	
+	/* CWT of in1 & in2 at the scale s */
+	fftw_execute(px1_iwt);
+	AmpNorm(x1_wt, Nd);
+	fftw_execute(px1_wt);
+	
+	fftw_execute(px2_iwt);
+	AmpNorm(x2_wt, Nd);
+	fftw_execute(px2_wt);
+	
+	/* Product & Lazy inverse */
+	/* The spectra of the decimated phase signals are D times smaller. */
+	da3 = (double)D*(double)D/(scale * (double)Nz);
+	for (n=0, k=k0; n<Nd; n++, k=(k+1) & (Nz-1)) y_wt[k] += da3 * conj(x1_wt[n])*x2_wt[n];  /* the product      */
+}
+
+/* Single precision version. */
+void tspcc2f_lowlevel (float complex * const y_wt, float complex * const in1, float complex * const in2, 
+		float complex * const fw, const unsigned int k1, const unsigned int W, const unsigned int Nz, const unsigned int D, const unsigned int k0, const double scale, 
+		float complex * const x1_wt, float complex * const x2_wt, fftwf_plan px1_iwt, fftwf_plan px1_wt, fftwf_plan px2_iwt, fftwf_plan px2_wt) {
+	unsigned int n, j, k, Nd = Nz/D;
+	float fa3;
+	
+	/* BPFs, the band of the wavelet within the window */
+	memset(x1_wt, 0, Nd*sizeof(fftwf_complex));
+	memset(x2_wt, 0, Nd*sizeof(fftwf_complex));
+	for (j=0, k=k1; j<W; j++, k=(k+1) & (Nz-1)) {
+		n = (k - k0) & (Nz-1);
+		if (n < Nd) {
+			if (k <= Nz/2) {
+				x1_wt[n] = in1[k]*fw[j];
+				x2_wt[n] = in2[k]*fw[j];
+			} else {  /* Hermitian symmetry of the real inputs */
+				x1_wt[n] = conjf(in1[Nz-k])*fw[j];
+				x2_wt[n] = conjf(in2[Nz-k])*fw[j];
+			}
+		}
+	}
+	
+	/* CWT of in1 & in2 at the scale s */
+	fftwf_execute(px1_iwt);
+	AmpNorm_float(x1_wt, Nd);
+	fftwf_execute(px1_wt);
+	
+	fftwf_execute(px2_iwt);
+	AmpNorm_float(x2_wt, Nd);
+	fftwf_execute(px2_wt);
+	
+	/* Product & Lazy inverse */
+	fa3 = (double)D*(double)D/(scale * (double)Nz);
+	for (n=0, k=k0; n<Nd; n++, k=(k+1) & (Nz-1)) y_wt[k] += fa3 * conjf(x1_wt[n])*x2_wt[n];  /* the product      */
+}
+
+/* Inverse of y_wt (destroyed), the real part of the lags of interest scaled by C. */
+void tspcc2_inverse (float * const y, double complex * const y_wt, const double C, const int L, const int lag, const unsigned int Nz, 
+		fftw_plan py_wt, t_PrunedIFFT *ppr, double * const yd) {
+	int n;
+	
+	if (ppr != NULL) {
+		/* Only the real part of the lags of interest */
+		PrunedIFFT_execute (yd, ppr, y_wt, 1);
+		for (n=0; n<L; n++) y[n] = C * yd[n];
+		return;
+	}
+	fftw_execute(py_wt);                                         /* IFFT of the result */
+	
+	/* Copy the lag of interest and normalize */
+	for (n=0; n<-lag; n++) y[n] = C * creal(y_wt[n+Nz+lag]);
+	for (   ; n<L;    n++) y[n] = C * creal(y_wt[n+lag]);
+}
+
+void tspcc2f_inverse (float * const y, float complex * const y_wt, const float C, const int L, const int lag, const unsigned int Nz, 
+		fftwf_plan py_wt, t_PrunedIFFTf *ppr) {
+	int n;
+	
+	if (ppr != NULL) {
+		/* Only the real part of the lags of interest */
+		PrunedIFFTf_execute (y, ppr, y_wt, 1);
+		for (n=0; n<L; n++) y[n] *= C;
+		return;
+	}
+	fftwf_execute(py_wt);                                         /* IFFT of the result */
+	
+	/* Copy the lag of interest and normalize */
+	for (n=0; n<-lag; n++) y[n] = C * crealf(y_wt[n+Nz+lag]);
+	for (   ; n<L;    n++) y[n] = C * crealf(y_wt[n+lag]);
+}
+
+/* Process-wide cache of the wavelet spectra used by wpcc, see GetWaveletSpectra. */
+t_WaveletSpectra *WaveletSpectraCache = NULL;
+
+void DestroyWaveletSpectra (t_WaveletSpectra *pWS) {
+	unsigned int s;
+	
+	if (pWS == NULL) return;
+	if (pWS->fw != NULL) 
+		for (s=0; s<pWS->S; s++) myfree(pWS->fw[s]);
+	free(pWS->fw);
+	free(pWS->scale);
+	free(pWS->k1);
+	free(pWS->W);
+	free(pWS);
+}
+
+/* Spectra of the S = V*J scales of the wavelet family at length Nz, computed directly from */
+/* the Fourier transform of the wavelets and keeping the bands higher than 1e-8 the peak.   */
+t_WaveletSpectra *CreateWaveletSpectra (int type, unsigned int V, unsigned int J, double s0, double op1, unsigned int Nz) {
+	t_WaveletSpectra *pWS;
+	double da1;
+	unsigned int s, S = V*J;
+	
+	if (NULL == (pWS = (t_WaveletSpectra *)calloc(1, sizeof(t_WaveletSpectra)) )) return NULL;
+	pWS->type = type;
+	pWS->V    = V;
+	pWS->J    = J;
+	pWS->s0   = s0;
+	pWS->op1  = op1;
+	pWS->Nz   = Nz;
+	pWS->S    = S;
+	pWS->scale = (double *)malloc(S*sizeof(double));
+	pWS->k1    = (unsigned int *)malloc(S*sizeof(unsigned int));
+	pWS->W     = (unsigned int *)malloc(S*sizeof(unsigned int));
+	pWS->fw    = (double complex **)calloc(S, sizeof(double complex *));
+	if (pWS->scale == NULL || pWS->k1 == NULL || pWS->W == NULL || pWS->fw == NULL) {
+		DestroyWaveletSpectra (pWS);
+		return NULL;
+	}
+	
+	da1 = s0;  /* Same scales as CreateWaveletFamily. */
+	for (s=0; s<S; s++) {
+		pWS->scale[s] = da1;
+		da1 *= pow(2, 1/(double)V);
+		if (NULL == (pWS->fw[s] = WaveletSpectrum (type, op1, pWS->scale[s], Nz, 1e-8, pWS->k1 + s, pWS->W + s) )) {
+			DestroyWaveletSpectra (pWS);
+			return NULL;
+		}
+	}
+	
+	return pWS;
+}
+
+/* Returns the wavelet spectra of (type, V, J, s0, op1, Nz), computing them only the first  */
+/* time. They are kept until ClearWaveletSpectraCache, so they must not be destroyed.       */
+t_WaveletSpectra *GetWaveletSpectra (int type, unsigned int V, unsigned int J, double s0, double op1, unsigned int Nz) {
+	t_WaveletSpectra *pWS;
+	
+	#pragma omp critical (WaveletSpectraCache)
+	{
+		for (pWS = WaveletSpectraCache; pWS != NULL; pWS = pWS->next)
+			if (pWS->type == type && pWS->V == V && pWS->J == J && pWS->s0 == s0 && pWS->op1 == op1 && pWS->Nz == Nz) break;
+		
+		if (pWS == NULL && NULL != (pWS = CreateWaveletSpectra (type, V, J, s0, op1, Nz) )) {
+			pWS->next = WaveletSpectraCache;
+			WaveletSpectraCache = pWS;
+		}
+	}
+	
+	return pWS;
+}
+
+void ClearWaveletSpectraCache () {
+	t_WaveletSpectra *pWS;
+	
+	#pragma omp critical (WaveletSpectraCache)
+	{
+		while (WaveletSpectraCache != NULL) {
+			pWS = WaveletSpectraCache;
+			WaveletSpectraCache = pWS->next;
+			DestroyWaveletSpectra (pWS);
+		}
+	}
+}
+
+/* Decimation D[s] of each scale s and the first bin ks[s] of the Nz/D[s] bins centered on  */
+/* the band of the wavelet (the bins higher than 1e-3 times the peak), which has to fit     */
+/* twice. D = 2^floor(log2(Down_smp)), Down_smp = floor(s0*b0*2^j) as in the dyadic wavelet */
+/* families (j = s/V). b0 = 0: D[s] = 1 and ks[s] = 0, the full rate.                       */
+void tspcc2_decimation (unsigned int * const D, unsigned int * const ks, t_WaveletSpectra * const pWS, const double b0) {
+	double complex *pc;
+	double da1, da2, Ds;
+	unsigned int s, j, jp, j1, j2, W, Nz = pWS->Nz;
+	
+	for (s=0; s<pWS->S; s++) {
+		D[s]  = 1;
+		ks[s] = 0;
+		Ds = floor(pWS->s0*b0*pow(2, s/pWS->V));
+		if (Ds < 2) continue;
+		
+		pc = pWS->fw[s];
+		jp = 0;
+		da2 = 0;
+		for (j=0; j<pWS->W[s]; j++) 
+			if (da2 < (da1 = cabs(pc[j]))) {
+				da2 = da1;
+				jp  = j;
+			}
+		da2 *= 1e-3;
+		for (j1=jp; j1>0             && cabs(pc[j1-1]) > da2; j1--);
+		for (j2=jp; j2<pWS->W[s]-1 && cabs(pc[j2+1]) > da2; j2++);
+		W = j2 - j1 + 1;
+		
+		D[s] = 1 << (unsigned int)floor(log2(Ds));   /* Power of 2 so that Nz/D is an integer. */
+		while (D[s] > 1 && Nz/D[s] < 2*W) D[s] /= 2; /* The band of the wavelet has to fit.   */
+		ks[s] = (pWS->k1[s] + j1 + W/2 - Nz/D[s]/2) & (Nz-1);  /* Centered on the band.  */
+	}
+}
+
+/* Frequency domain version.                                                                  */
+/* b0 = 0: every scale is computed at the full rate.                                          */
+/* b0 > 0: multirate, the scale s is decimated by D, the power of 2 not higher than the        */
+/*   Down_smp = floor(s0*b0*2^j) of the dyadic family. Only the Nz/D bins around the band of   */
+/*   the wavelet are transformed back to time, phase normalized and transformed forward, then  */
+/*   they are accumulated back at the same bins of y_wt.                                        */
+int tspcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, 
+		const unsigned int Tr, const int Lag1, const int Lag2, double pmin, double pmax, unsigned int V, int type, double op1, double b0) {
+	unsigned int J, S;
+	unsigned int Nz, M, m, ua1, ua2, Ls0;
+	double s0, K0;
+	int L, nerr = 0;
+	#ifdef CUDAON
+	t_WaveletFamily *pWF;
+	#endif
+	
+	L = abs(Lag2-Lag1+1);
+	
+	/* Memory allocation */
+	ua1 = abs(Lag1);
+	ua2 = abs(Lag2);
+	if (ua1 >= N || ua2 >= N) return -3; /* Too large lags */
+	M = (ua1 > ua2) ? ua1 : ua2;
+	Nz = 1 << (unsigned int)ceil(log2(N+M)); /* Because the lags higher than M are rejected */
 	
 	/* Zero outputs. */
 	for (int tr=0; tr<Tr; tr++) memset(y[tr], 0, L*sizeof(float));
 	
 	/* Wavelet initializations */
-	/* Downsampling is not supported yet. So, b0 is not used. */ 
+	#ifdef CUDAON
+	b0 = 0;  /* Downsampling is not supported in the CUDA version. */
+	#endif
+	if (b0 < 0) return -3;
 	if (type == -3) { /*    MexHat    */
 		s0 = pmin/(sqrt(2)*PI);
-		b0 = 0.5;
 	} else if (type == -1 || type == -2) { /*    Morlet    */
 		if (op1==0) op1 = PI*sqrt(2/log(2));  /* w0 parameter */
 		// op1 = PI*sqrt(2/log(2));  /* w0 parameter */
 		s0 = pmin*op1/(2*PI);
-		b0 = 0.5; // b0 = (unsigned int)pow( 2, round(log2(s0)) );
 	} else return -3;
 	J = (unsigned int)round(1./(double)V + log(pmax/pmin)/log(2));
-	pWF = CreateWaveletFamily (type, J, V, Nz, s0, b0, 0, op1, 1);
-	
 	S = V*J;
-	Ls0 = pWF->Ls[S-1];
+	#ifdef CUDAON
+	pWF = CreateWaveletFamily (type, J, V, Nz, s0, b0, 0, op1, (b0 == 0));
+	#endif
+	Ls0 = 2*(unsigned int)ceil(NSIGMAS*s0*pow(2, (S-1)/(double)V)) + 1;  /* Length of the longest wavelet */
+	if (Ls0 > Nz) Ls0 = Nz;
 	if (Nz-(N+M) < Ls0) Nz *= 2; /* The longest wavelet (Ls0) is limited to Nz, so Nz *= 2 is enough. */
 	
-	K0 = 0;
-	for (m=0; m<S; m++) K0 += 1/pWF->scale[m];
-	
 	#ifdef CUDAON
 	{
+		K0 = 0;
+		for (m=0; m<S; m++) K0 += 1/pWF->scale[m];
+		
 		/* float C = ( log(pWF->a0) / (2 * pWF->Cpsi * pWF->V) ) / (double)N; */
 		float C = 1./(K0*(double)N);
 		
 		cuda_tspcc2_set_freq(y, x1, x2, N, Tr, Nz, Lag1, Lag2, S, pWF->scale, pWF->wframe.wc, pWF->Ls, pWF->center, pWF->Down_smp, C);
+		DestroyWaveletFamily (pWF);
 	}
 	#else
 	{
-		fftw_plan pw;
-		double complex *pc, **fw;
-		int c, Ls, lag;
+		double complex **ywt_all, *sh1=NULL, *sh2=NULL;
+		t_WaveletSpectra *pWS;
+		unsigned int *D, *ks;
+		int lag;
 		
 		lag = (Lag2 >= Lag1) ? Lag1 : Lag2;
 		
-		fw = (fftw_complex **)malloc(S*sizeof(fftw_complex *));
-		fw[0] = (fftw_complex *)fftw_malloc(S*Nz*sizeof(fftw_complex));
-		for (int s=1; s<S; s++) fw[s] = fw[s-1] + Nz;
+		D  = (unsigned int *)malloc(S*sizeof(unsigned int));  /* Decimation of each scale.           */
+		ks = (unsigned int *)malloc(S*sizeof(unsigned int));  /* First bin of the band of each scale. */
 		
-		/* FFTs of the Wavelet Family */
-		for (int s=0; s<S; s++) {
-			pw = fftw_plan_dft_1d(Nz, fw[s], fw[s], FFTW_FORWARD, FFTW_ESTIMATE);
-			
-			pc = pWF->wframe.wc[s];
-			c  = pWF->center[s];
-			Ls = pWF->Ls[s]; 
-			memcpy(fw[s],        pc+c, (Ls-c)*sizeof(fftw_complex));
-			memset(fw[s] + Ls-c, 0,    (Nz-Ls)*sizeof(fftw_complex));
-			memcpy(fw[s] + Nz-c, pc,   c*sizeof(fftw_complex));
-			
-			fftw_execute(pw);
-			fftw_destroy_plan(pw);
+		/* Spectra of the Wavelet Family, shared by all the calls with the same family and Nz */
+		pWS = GetWaveletSpectra (type, V, J, s0, op1, Nz);
+		if (pWS == NULL || D == NULL || ks == NULL) {
+			printf("tspcc2_set: Out of memory\n");
+			free(ks);
+			free(D);
+			return 4;
 		}
+		tspcc2_decimation (D, ks, pWS, b0);
+		
+		K0 = 0;
+		for (m=0; m<S; m++) K0 += 1/pWS->scale[m];
+		
+		/* Scale-parallel mode when there are less traces than threads: the traces are done one */
+		/* after the other, splitting the scales among threads with private y_wt accumulators.  */
+		#ifdef _OPENMP
+		ywt_all = (double complex **)malloc(omp_get_max_threads()*sizeof(double complex *));
+		#else
+		ywt_all = (double complex **)malloc(sizeof(double complex *));
+		#endif
 		
 		#pragma omp parallel
 		{
-			fftw_plan pin1, pin2, py_wt, px1_wt, px2_wt, px1_iwt, px2_iwt;
-			double complex *in1, *in2, *x1_wt, *x2_wt, *y_wt, *pc1;
-			double da2, da3, C;
-			float *pf1;
-			int tr, s, n;
+			fftw_plan pin1, pin2, py_wt, *px1_wt, *px2_wt, *px1_iwt, *px2_iwt;
+			double complex *in1, *in2, *x1_wt, *x2_wt, *y_wt;
+			double da2, C, *yd;
+			t_PrunedIFFT *ppr;
+			int tr, s, n, t, nthr=1, tid=0;
+			
+			#ifdef _OPENMP
+			nthr = omp_get_num_threads();
+			tid  = omp_get_thread_num();
+			#endif
 			
 			#pragma omp critical
 			{
 				/* Initializations */
-				in1 = (fftw_complex *)fftw_malloc(Nz*sizeof(fftw_complex));
-				in2 = (fftw_complex *)fftw_malloc(Nz*sizeof(fftw_complex));
+				in1 = (fftw_complex *)fftw_malloc((Nz/2+1)*sizeof(fftw_complex));  /* Half spectra (real inputs) */
+				in2 = (fftw_complex *)fftw_malloc((Nz/2+1)*sizeof(fftw_complex));
 				x1_wt = (fftw_complex *)fftw_malloc(Nz*sizeof(fftw_complex));
 				x2_wt = (fftw_complex *)fftw_malloc(Nz*sizeof(fftw_complex));
 				y_wt  = (fftw_complex *)fftw_malloc(Nz*sizeof(fftw_complex));
+				px1_wt  = (fftw_plan *)malloc(4*S*sizeof(fftw_plan));
+				px2_wt  = px1_wt + S;
+				px1_iwt = px2_wt + S;
+				px2_iwt = px1_iwt + S;
 				
 				/* Create plans */
-				pin1 = fftw_plan_dft_1d(Nz, in1, in1, FFTW_FORWARD, FFTW_ESTIMATE);
-				pin2 = fftw_plan_dft_1d(Nz, in2, in2, FFTW_FORWARD, FFTW_ESTIMATE);
-				px1_iwt = fftw_plan_dft_1d(Nz, x1_wt, x1_wt, FFTW_BACKWARD, FFTW_ESTIMATE);
-				px2_iwt = fftw_plan_dft_1d(Nz, x2_wt, x2_wt, FFTW_BACKWARD, FFTW_ESTIMATE);
-				px1_wt  = fftw_plan_dft_1d(Nz, x1_wt, x1_wt, FFTW_FORWARD,  FFTW_ESTIMATE);
-				px2_wt  = fftw_plan_dft_1d(Nz, x2_wt, x2_wt, FFTW_FORWARD,  FFTW_ESTIMATE);
+				pin1 = fftw_plan_dft_r2c_1d(Nz, (double *)in1, in1, FFTW_ESTIMATE);
+				pin2 = fftw_plan_dft_r2c_1d(Nz, (double *)in2, in2, FFTW_ESTIMATE);
+				for (s=0; s<S; s++) { /* One length per scale (Nz/D) */
+					px1_iwt[s] = fftw_plan_dft_1d(Nz/D[s], x1_wt, x1_wt, FFTW_BACKWARD, FFTW_ESTIMATE);
+					px2_iwt[s] = fftw_plan_dft_1d(Nz/D[s], x2_wt, x2_wt, FFTW_BACKWARD, FFTW_ESTIMATE);
+					px1_wt[s]  = fftw_plan_dft_1d(Nz/D[s], x1_wt, x1_wt, FFTW_FORWARD,  FFTW_ESTIMATE);
+					px2_wt[s]  = fftw_plan_dft_1d(Nz/D[s], x2_wt, x2_wt, FFTW_FORWARD,  FFTW_ESTIMATE);
+				}
 				py_wt   = fftw_plan_dft_1d(Nz,  y_wt,  y_wt, FFTW_BACKWARD, FFTW_ESTIMATE); /* IFFT plan          */
+				ppr = CreatePrunedIFFT (Nz, L, lag);  /* NULL when the full IFFT is cheaper */
+				yd  = (double *)fftw_malloc(L*sizeof(double));
+				ywt_all[tid] = y_wt;
+				if (tid == 0) {
+					sh1 = in1;
+					sh2 = in2;
+				}
 			}
 			
 			/* C = ( log(pWF->a0) / (2 * pWF->Cpsi * pWF->V) )  / (double)N; */
 			C = 1./(K0*(double)N);
 			da2 = 1./(double)Nz;
 			
-			#pragma omp for schedule(static)
-			for (tr=0; tr<Tr; tr++) {
-				/* Decomposition */
-				pf1 = x1[tr];
-				memset(in1, 0, Ls0*sizeof(fftw_complex));
-				pc1 = in1 + Ls0;
-				for (n=0; n<N; n++) pc1[n] = da2*pf1[n];
-				memset(pc1 + N, 0, (Nz-N-Ls0)*sizeof(fftw_complex));
-				fftw_execute(pin1);
-				
-				pf1 = x2[tr];
-				memset(in2, 0, Ls0*sizeof(fftw_complex));
-				pc1 = in2 + Ls0;
-				for (n=0; n<N; n++) pc1[n] = da2*pf1[n];
-				memset(pc1 + N, 0, (Nz-N-Ls0)*sizeof(fftw_complex));
-				fftw_execute(pin2);
-				
-				/* BPFs + PCCs + Lazy Inverse */
-				memset(y_wt, 0, Nz*sizeof(fftw_complex));
-				for (s=0; s<S; s++) {
-					pc1 = fw[s];
-					/* CWT of in1 at the scale s */
-					for (n=0; n<Nz; n++) x1_wt[n] = in1[n]*pc1[n];
-					fftw_execute(px1_iwt);
-					AmpNorm(x1_wt, Nz);
-					fftw_execute(px1_wt);
+			#pragma omp barrier
+			if (Tr < nthr && S > 1) {
+				/* The master thread does the decomposition and the inverse of each trace. */
+				for (tr=0; tr<Tr; tr++) {
+					#pragma omp master
+					{
+						tspcc2_decomposition (in1, x1[tr], N, Nz, Ls0, da2, pin1);
+						tspcc2_decomposition (in2, x2[tr], N, Nz, Ls0, da2, pin2);
+					}
+					memset(y_wt, 0, Nz*sizeof(fftw_complex));
+					#pragma omp barrier
 					
-					/* CWT of in2 at the scale s */
-					for (n=0; n<Nz; n++) x2_wt[n] = in2[n]*pc1[n];
-					fftw_execute(px2_iwt);
-					AmpNorm(x2_wt, Nz);
-					fftw_execute(px2_wt);
+					/* BPFs + PCCs, the scales shared among threads */
+					#pragma omp for schedule(dynamic,1)
+					for (s=0; s<S; s++) 
+						tspcc2_lowlevel (y_wt, sh1, sh2, pWS->fw[s], pWS->k1[s], pWS->W[s], Nz, D[s], ks[s], pWS->scale[s], x1_wt, x2_wt, px1_iwt[s], px1_wt[s], px2_iwt[s], px2_wt[s]);
 					
-					/* Product & Lazy inverse */
-					// for (n=0; n<Nz; n++) y_wt[n] += x1_wt[n]*conj(x2_wt[n]); /* the product        */
-					da3 = 1./(pWF->scale[s] * (double)Nz);
-					for (n=0; n<Nz; n++) y_wt[n] += da3 * conj(x1_wt[n])*x2_wt[n];  /* the product      */
-				} 
-				fftw_execute(py_wt);                                         /* IFFT of the result */
-				
-				/* Copy the lag of interest and normalize */
-				for (n=0; n<-lag; n++) y[tr][n] = C * creal(y_wt[n+Nz+lag]);
-				for (   ; n<L;    n++) y[tr][n] = C * creal(y_wt[n+lag]);
+					/* Reduction in the accumulator of the master thread */
+					#pragma omp for schedule(static)
+					for (n=0; n<Nz; n++) 
+						for (t=1; t<nthr; t++) ywt_all[0][n] += ywt_all[t][n];
+					
+					/* Lazy Inverse */
+					#pragma omp master
+					tspcc2_inverse (y[tr], y_wt, C, L, lag, Nz, py_wt, ppr, yd);
+				}
+			} else {
+				#pragma omp for schedule(static)
+				for (tr=0; tr<Tr; tr++) {
+					/* Decomposition */
+					tspcc2_decomposition (in1, x1[tr], N, Nz, Ls0, da2, pin1);
+					tspcc2_decomposition (in2, x2[tr], N, Nz, Ls0, da2, pin2);
+					
+					/* BPFs + PCCs + Lazy Inverse */
+					memset(y_wt, 0, Nz*sizeof(fftw_complex));
+					for (s=0; s<S; s++) 
+						tspcc2_lowlevel (y_wt, in1, in2, pWS->fw[s], pWS->k1[s], pWS->W[s], Nz, D[s], ks[s], pWS->scale[s], x1_wt, x2_wt, px1_iwt[s], px1_wt[s], px2_iwt[s], px2_wt[s]);
+					tspcc2_inverse (y[tr], y_wt, C, L, lag, Nz, py_wt, ppr, yd);
+				}
 			}
 			
+			#pragma omp barrier  /* The accumulators & spectra of other threads may be in use. */
 			#pragma omp critical
 			{
 				/* Destroy plans */
 				fftw_destroy_plan(pin1);
 				fftw_destroy_plan(pin2);
-				fftw_destroy_plan(px1_wt);
-				fftw_destroy_plan(px2_wt);
-				fftw_destroy_plan(px1_iwt);
-				fftw_destroy_plan(px2_iwt);
+				for (s=0; s<S; s++) {
+					fftw_destroy_plan(px1_wt[s]);
+					fftw_destroy_plan(px2_wt[s]);
+					fftw_destroy_plan(px1_iwt[s]);
+					fftw_destroy_plan(px2_iwt[s]);
+				}
+				free(px1_wt);
 				fftw_destroy_plan(py_wt);
-			
+				DestroyPrunedIFFT(ppr);
+				
 				/* Cleaning */
+				fftw_free(yd);
 				fftw_free(x1_wt);
 				fftw_free(x2_wt);
 				fftw_free(y_wt);
@@ -1244,13 +2752,215 @@ int tspcc2_set (float ** const y, float ** const x1, float ** const x2, const un
 			}
 		}
 		
-		fftw_free(fw[0]);
-		free(fw);
+		free(ywt_all);
+		
+		free(ks);
+		free(D);
 	}
 	#endif
-	
-	DestroyWaveletFamily (pWF);
 
 	return nerr;
 }
 
+
+/* Single precision version of tspcc2_set (CPU only, the CUDA version is already in single precision). */
+/* Only the band of each scale of the wavelet spectra is kept, see tspcc2_set.                          */
+int tspcc2f_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, 
+		const unsigned int Tr, const int Lag1, const int Lag2, double pmin, double pmax, unsigned int V, int type, double op1, double b0) {
+#ifdef CUDAON
+	return tspcc2_set (y, x1, x2, N, Tr, Lag1, Lag2, pmin, pmax, V, type, op1, b0);
+#else
+	unsigned int J, S;
+	unsigned int Nz, M, m, ua1, ua2, Ls0, Nf;
+	double s0, K0;
+	float complex **fwf, **ywt_all, *sh1=NULL, *sh2=NULL;
+	t_WaveletSpectra *pWS;
+	unsigned int *D, *ks;
+	int L, lag, nerr = 0;
+	
+	L = abs(Lag2-Lag1+1);
+	lag = (Lag2 >= Lag1) ? Lag1 : Lag2;
+	
+	/* Memory allocation */
+	ua1 = abs(Lag1);
+	ua2 = abs(Lag2);
+	if (ua1 >= N || ua2 >= N) return -3; /* Too large lags */
+	M = (ua1 > ua2) ? ua1 : ua2;
+	Nz = 1 << (unsigned int)ceil(log2(N+M)); /* Because the lags higher than M are rejected */
+	
+	/* Zero outputs. */
+	for (int tr=0; tr<Tr; tr++) memset(y[tr], 0, L*sizeof(float));
+	
+	/* Wavelet initializations */
+	if (b0 < 0) return -3;
+	if (type == -3) { /*    MexHat    */
+		s0 = pmin/(sqrt(2)*PI);
+	} else if (type == -1 || type == -2) { /*    Morlet    */
+		if (op1==0) op1 = PI*sqrt(2/log(2));  /* w0 parameter */
+		s0 = pmin*op1/(2*PI);
+	} else return -3;
+	J = (unsigned int)round(1./(double)V + log(pmax/pmin)/log(2));
+	S = V*J;
+	Ls0 = 2*(unsigned int)ceil(NSIGMAS*s0*pow(2, (S-1)/(double)V)) + 1;  /* Length of the longest wavelet */
+	if (Ls0 > Nz) Ls0 = Nz;
+	if (Nz-(N+M) < Ls0) Nz *= 2; /* The longest wavelet (Ls0) is limited to Nz, so Nz *= 2 is enough. */
+	
+	D  = (unsigned int *)malloc(S*sizeof(unsigned int));  /* Decimation of each scale.           */
+	ks = (unsigned int *)malloc(S*sizeof(unsigned int));  /* First bin of the band of each scale. */
+	fwf = (fftwf_complex **)malloc(S*sizeof(fftwf_complex *));
+	
+	/* Spectra of the Wavelet Family, single precision copy of the band of each scale */
+	pWS = GetWaveletSpectra (type, V, J, s0, op1, Nz);
+	if (pWS == NULL || D == NULL || ks == NULL || fwf == NULL) nerr = 4;
+	else {
+		for (Nf=0, m=0; m<S; m++) Nf += pWS->W[m];
+		if (NULL == (fwf[0] = (fftwf_complex *)fftw_malloc(Nf*sizeof(fftwf_complex)) )) nerr = 4;
+		else {
+			for (m=1; m<S; m++) fwf[m] = fwf[m-1] + pWS->W[m-1];
+			for (m=0; m<S; m++) 
+				for (ua1=0; ua1<pWS->W[m]; ua1++) fwf[m][ua1] = (float complex)pWS->fw[m][ua1];
+		}
+	}
+	if (nerr) {
+		printf("tspcc2f_set: Out of memory\n");
+		free(fwf);
+		free(ks);
+		free(D);
+		return 4;
+	}
+	tspcc2_decimation (D, ks, pWS, b0);
+	
+	K0 = 0;
+	for (m=0; m<S; m++) K0 += 1/pWS->scale[m];
+	
+	/* Scale-parallel mode when there are less traces than threads: the traces are done one */
+	/* after the other, splitting the scales among threads with private y_wt accumulators.  */
+	#ifdef _OPENMP
+	ywt_all = (float complex **)malloc(omp_get_max_threads()*sizeof(float complex *));
+	#else
+	ywt_all = (float complex **)malloc(sizeof(float complex *));
+	#endif
+	
+	#pragma omp parallel
+	{
+		fftwf_plan pin1, pin2, py_wt, *px1_wt, *px2_wt, *px1_iwt, *px2_iwt;
+		float complex *in1, *in2, *x1_wt, *x2_wt, *y_wt;
+		float da2, C;
+		t_PrunedIFFTf *ppr;
+		int tr, s, n, t, nthr=1, tid=0;
+		
+		#ifdef _OPENMP
+		nthr = omp_get_num_threads();
+		tid  = omp_get_thread_num();
+		#endif
+		
+		#pragma omp critical
+		{
+			/* Initializations */
+			in1 = (fftwf_complex *)fftw_malloc((Nz/2+1)*sizeof(fftwf_complex));  /* Half spectra (real inputs) */
+			in2 = (fftwf_complex *)fftw_malloc((Nz/2+1)*sizeof(fftwf_complex));
+			x1_wt = (fftwf_complex *)fftw_malloc(Nz*sizeof(fftwf_complex));
+			x2_wt = (fftwf_complex *)fftw_malloc(Nz*sizeof(fftwf_complex));
+			y_wt  = (fftwf_complex *)fftw_malloc(Nz*sizeof(fftwf_complex));
+			px1_wt  = (fftwf_plan *)malloc(4*S*sizeof(fftwf_plan));
+			px2_wt  = px1_wt + S;
+			px1_iwt = px2_wt + S;
+			px2_iwt = px1_iwt + S;
+			
+			/* Create plans */
+			pin1 = fftwf_plan_dft_r2c_1d(Nz, (float *)in1, in1, FFTW_ESTIMATE);
+			pin2 = fftwf_plan_dft_r2c_1d(Nz, (float *)in2, in2, FFTW_ESTIMATE);
+			for (s=0; s<S; s++) { /* One length per scale (Nz/D) */
+				px1_iwt[s] = fftwf_plan_dft_1d(Nz/D[s], x1_wt, x1_wt, FFTW_BACKWARD, FFTW_ESTIMATE);
+				px2_iwt[s] = fftwf_plan_dft_1d(Nz/D[s], x2_wt, x2_wt, FFTW_BACKWARD, FFTW_ESTIMATE);
+				px1_wt[s]  = fftwf_plan_dft_1d(Nz/D[s], x1_wt, x1_wt, FFTW_FORWARD,  FFTW_ESTIMATE);
+				px2_wt[s]  = fftwf_plan_dft_1d(Nz/D[s], x2_wt, x2_wt, FFTW_FORWARD,  FFTW_ESTIMATE);
+			}
+			py_wt   = fftwf_plan_dft_1d(Nz,  y_wt,  y_wt, FFTW_BACKWARD, FFTW_ESTIMATE); /* IFFT plan          */
+			ppr = CreatePrunedIFFTf (Nz, L, lag);  /* NULL when the full IFFT is cheaper */
+			ywt_all[tid] = y_wt;
+			if (tid == 0) {
+				sh1 = in1;
+				sh2 = in2;
+			}
+		}
+		
+		C = 1./(K0*(double)N);
+		da2 = 1./(float)Nz;
+		
+		#pragma omp barrier
+		if (Tr < nthr && S > 1) {
+			/* The master thread does the decomposition and the inverse of each trace. */
+			for (tr=0; tr<Tr; tr++) {
+				#pragma omp master
+				{
+					tspcc2f_decomposition (in1, x1[tr], N, Nz, Ls0, da2, pin1);
+					tspcc2f_decomposition (in2, x2[tr], N, Nz, Ls0, da2, pin2);
+				}
+				memset(y_wt, 0, Nz*sizeof(fftwf_complex));
+				#pragma omp barrier
+				
+				/* BPFs + PCCs, the scales shared among threads */
+				#pragma omp for schedule(dynamic,1)
+				for (s=0; s<S; s++) 
+					tspcc2f_lowlevel (y_wt, sh1, sh2, fwf[s], pWS->k1[s], pWS->W[s], Nz, D[s], ks[s], pWS->scale[s], x1_wt, x2_wt, px1_iwt[s], px1_wt[s], px2_iwt[s], px2_wt[s]);
+				
+				/* Reduction in the accumulator of the master thread */
+				#pragma omp for schedule(static)
+				for (n=0; n<Nz; n++) 
+					for (t=1; t<nthr; t++) ywt_all[0][n] += ywt_all[t][n];
+				
+				/* Lazy Inverse */
+				#pragma omp master
+				tspcc2f_inverse (y[tr], y_wt, C, L, lag, Nz, py_wt, ppr);
+			}
+		} else {
+			#pragma omp for schedule(static)
+			for (tr=0; tr<Tr; tr++) {
+				/* Decomposition */
+				tspcc2f_decomposition (in1, x1[tr], N, Nz, Ls0, da2, pin1);
+				tspcc2f_decomposition (in2, x2[tr], N, Nz, Ls0, da2, pin2);
+				
+				/* BPFs + PCCs + Lazy Inverse */
+				memset(y_wt, 0, Nz*sizeof(fftwf_complex));
+				for (s=0; s<S; s++) 
+					tspcc2f_lowlevel (y_wt, in1, in2, fwf[s], pWS->k1[s], pWS->W[s], Nz, D[s], ks[s], pWS->scale[s], x1_wt, x2_wt, px1_iwt[s], px1_wt[s], px2_iwt[s], px2_wt[s]);
+				tspcc2f_inverse (y[tr], y_wt, C, L, lag, Nz, py_wt, ppr);
+			}
+		}
+		
+		#pragma omp barrier  /* The accumulators & spectra of other threads may be in use. */
+		#pragma omp critical
+		{
+			/* Destroy plans */
+			fftwf_destroy_plan(pin1);
+			fftwf_destroy_plan(pin2);
+			for (s=0; s<S; s++) {
+				fftwf_destroy_plan(px1_wt[s]);
+				fftwf_destroy_plan(px2_wt[s]);
+				fftwf_destroy_plan(px1_iwt[s]);
+				fftwf_destroy_plan(px2_iwt[s]);
+			}
+			free(px1_wt);
+			fftwf_destroy_plan(py_wt);
+			DestroyPrunedIFFTf(ppr);
+			
+			/* Cleaning */
+			fftw_free(x1_wt);
+			fftw_free(x2_wt);
+			fftw_free(y_wt);
+			fftw_free(in1);
+			fftw_free(in2);
+		}
+	}
+	
+	free(ywt_all);
+	
+	fftw_free(fwf[0]);
+	free(fwf);
+	free(ks);
+	free(D);
+	
+	return nerr;
+#endif
+}
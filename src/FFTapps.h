@@ -2,6 +2,63 @@
 #define FFTAPPS_H
 
 #include <complex.h>
+#include <stddef.h>
+
+/* Pruned IFFT: only the L lags lag...lag+L-1 of an Nz-point IDFT. */
+typedef struct s_PrunedIFFT  t_PrunedIFFT;
+typedef struct s_PrunedIFFTf t_PrunedIFFTf;
+unsigned int pruned_ifft_length (const unsigned int Nz, const unsigned int L);
+t_PrunedIFFT  *CreatePrunedIFFT  (const unsigned int Nz, const unsigned int L, const int lag);
+t_PrunedIFFTf *CreatePrunedIFFTf (const unsigned int Nz, const unsigned int L, const int lag);
+void DestroyPrunedIFFT  (t_PrunedIFFT  *pp);
+void DestroyPrunedIFFTf (t_PrunedIFFTf *pp);
+void PrunedIFFT_execute  (double * const y, t_PrunedIFFT  * const pp, const double complex * const X, const int full);
+void PrunedIFFTf_execute (float  * const y, t_PrunedIFFTf * const pp, const float complex  * const X, const int full);
+
+/* Spectra of a wavelet family at length Nz: bins k1[s] ... k1[s]+W[s]-1 (mod Nz) of each scale. */
+typedef struct s_WaveletSpectra {
+	int type;
+	unsigned int V, J, Nz, S;
+	double s0, op1;
+	double *scale;
+	unsigned int *k1, *W;
+	double complex **fw;
+	struct s_WaveletSpectra *next;
+} t_WaveletSpectra;
+t_WaveletSpectra *GetWaveletSpectra (int type, unsigned int V, unsigned int J, double s0, double op1, unsigned int Nz);
+void ClearWaveletSpectraCache ();
+
+/* Average spectral whitening filter of a station: gain of the Nh = Nz/2+1 bins of an Nz-point FFT. */
+typedef struct {
+	unsigned int Nz, Nh;
+	float *H;
+} t_AveWhite;
+t_AveWhite *CreateAveWhite (float ** const x, const unsigned int N, const unsigned int Tr, const double freq[2], const double dt);
+void DestroyAveWhite (t_AveWhite *pw);
+float *AveWhite_gain (const t_AveWhite * const pw, const unsigned int Nz, const double scale);
+int AveWhite_apply (float ** const x, const unsigned int N, const unsigned int Tr, const t_AveWhite * const pw, const int gaps);
+
+/* Per-trace normalizations: running absolute mean (RAM) & spectral whitening. */
+typedef struct {
+	unsigned int M;  /* RAM: half length of the running window in samples (0: none). */
+	double fw[3];    /* Spectral whitening: band fw[0] - fw[1] & cosine taper width fw[2] in Hz (fw[1] = 0: none). */
+	double dt;
+} t_TraceNorm;
+void RunAbsMean (float * const y, const float * const x, const unsigned int N, const unsigned int M);
+float *SpecWhite_taper (const t_TraceNorm * const pn, const unsigned int Nz, const double scale);
+void SpecNorm  (double complex * const X, const unsigned int Nh, const float * const G, const float * const T);
+void SpecNormf (float complex  * const X, const unsigned int Nh, const float * const G, const float * const T);
+int TraceNorm_apply (float ** const x, const unsigned int N, const unsigned int Tr, const t_TraceNorm * const pn);
+
+/* Gaps: runs of at least gmin zeros (GAPMIN by default), masked in the correlations when asked. */
+#define GAPMIN 4
+unsigned int gap_runs_size (const unsigned int N, const unsigned int gmin);
+unsigned int GapRuns (unsigned int * const r, const float * const x, const unsigned int N, const unsigned int gmin);
+int HasGaps (const unsigned int * const r, const unsigned int K, const unsigned int N);
+void GapZero (void * const x, const size_t size, const unsigned int * const r, const unsigned int K, const unsigned int N);
+void GapCount (double * const C, const unsigned int * const r, const unsigned int K, const unsigned int N);
+void gap_lowlevel (double * const e, const double * const P, const unsigned int N, const unsigned int * const r, 
+	const unsigned int K, const int s, const unsigned int L, const int lag);
 
 int AnalyticSignal (double complex *y, double *x, unsigned int N);
 int xcorr (double complex *y, double complex *x1, double complex *x2, unsigned int N);
@@ -10,9 +67,14 @@ int PhaseSignal (double complex *y, double *x, unsigned int N);
 
 int pcc_set  (float ** const y, float ** const x1, float ** const x2, const int N, const unsigned int Tr, const double v, const int Lag1, const int Lag2);
 int pcc1_set (float ** const y, float ** const x1, float ** const x2, const int N, const unsigned int Tr, const int Lag1, const int Lag2);
-int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2);
-int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2);
-int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2);
-int tspcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, double pmin, double pmax, unsigned int V, int type, double op1);
+int pcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, const t_TraceNorm * const pn, const int gaps);
+int ccgn_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, const t_TraceNorm * const pn, const int gaps);
+int cc1b_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, const t_TraceNorm * const pn, const int gaps);
+unsigned int ols_length (const unsigned int N, const int Lag1, const int Lag2);
+int pcc2_ols_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, const unsigned int Nseg);
+int ccgn_ols_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, const unsigned int Nseg);
+int cc1b_ols_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, const unsigned int Nseg);
+int tspcc2_set (float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, double pmin, double pmax, unsigned int V, int type, double op1, double b0);
+int tspcc2f_set(float ** const y, float ** const x1, float ** const x2, const unsigned int N, const unsigned int Tr, const int Lag1, const int Lag2, double pmin, double pmax, unsigned int V, int type, double op1, double b0);
 
 #endif
@@ -130,6 +130,88 @@ void MexicanHatFun (double complex *w, int *center, double dump, unsigned int Ls
 	}
 }
 
+/* Frequency domain versions: Fourier transform (exp(-i*w*u) convention) at the frequency w */
+/* (rad/sample) of the wavelets above, without the truncation to Ls samples.               */
+double complex MorletFun_freq (double w, double w0, double scale) {
+	double k, daux;
+	
+	k = sqrt(2*scale*sqrt(PI));   /* 1/sqrt(sqrt(PI)*scale) * scale*sqrt(2*PI) */
+	daux = scale*w - w0;
+	return k*exp(-0.5*daux*daux);
+}
+
+double complex Complete_MorletFun_freq (double w, double w0, double scale) {
+	const double ze = exp((-w0*w0)/2);
+	double k, daux;
+	
+	k = sqrt(2*scale*sqrt(PI));
+	daux = scale*w;
+	return k*(exp(-0.5*(daux-w0)*(daux-w0)) - ze*exp(-0.5*daux*daux));
+}
+
+double complex MexicanHatFun_freq (double w, double dump, double scale) {
+	double k, daux;
+	
+	if (w <= 0) return 0;  /* Analytic */
+	k = 2*sqrt(2*scale*sqrt(PI)/3);  /* 2/sqrt(3*sqrt(PI)*scale) * scale*sqrt(2*PI) */
+	daux = scale*w;
+	daux *= daux;
+	return -2*k*daux*exp(-0.5*daux);
+}
+
+/***********************************************************************/
+/* Spectrum of a complex wavelet at length N (as the N-point fft of    */
+/* the wavelet centered at 0), computed from its Fourier transform.    */
+/* Only the band higher than about eps times the peak is returned:     */
+/* the W bins k1 ... k1+W-1 (mod N) in a vector allocated by mymalloc. */
+/***********************************************************************/
+double complex *WaveletSpectrum (int type, double op1, double scale, unsigned int N, double eps, unsigned int *k1, unsigned int *W) {
+	double complex (*FreqWavelets[])(double, double, double) = {NULL, MorletFun_freq, Complete_MorletFun_freq, MexicanHatFun_freq};
+	double complex *fw;
+	double x, w1, w2, dw;
+	unsigned int n;
+	int m, kmin, kmax;
+	
+	if (type >= 0 || type < -MAXCMPLX_WAVE) {
+		prerror("WaveletSpectrum: Complex wavelet not defined.");
+		return NULL;
+	}
+	
+	/* Band, in rad/sample */
+	x = sqrt(-2*log(eps));
+	switch (type) {
+	case -1: w1 = (op1 - x)/scale;
+	         w2 = (op1 + x)/scale;
+	         break;
+	case -2: w1 = ((op1 < 2*x) ? -x : op1 - x)/scale;
+	         w2 = (op1 + x)/scale;
+	         break;
+	default: w1 = 0;
+	         w2 = (x + 3)/scale;   /* w^2 exp(-w^2/2) decays a bit slower. */
+	}
+	
+	dw = 2*PI/(double)N;
+	kmin = (int)floor(w1/dw);
+	kmax = (int)ceil(w2/dw);
+	if (kmax - kmin + 1 >= (int)N) {
+		kmin = -(int)N/2;
+		kmax = kmin + (int)N - 1;
+	}
+	*W  = kmax - kmin + 1;
+	*k1 = (unsigned int)(kmin + (kmin < 0 ? (int)N : 0)) % N;
+	
+	if (NULL == (fw = (double complex *)mymalloc(*W*sizeof(double complex)) )) return NULL;
+	
+	/* Periodization of the sampled wavelet: sum of the images at +-2*PI. */
+	for (n=0; n<*W; n++) {
+		fw[n] = 0;
+		for (m=-1; m<=1; m++) 
+			fw[n] += (*FreqWavelets[-type])(dw*(double)(kmin + (int)n) + 2*PI*m, op1, scale);
+	}
+	
+	return fw;
+}
+
 double Morlet_Cpsi (double w0) {
 	double w, Cpsi=0, aux;
 
@@ -69,6 +69,7 @@ typedef struct {
 
 t_WaveletFamily *CreateWaveletFamily (int type, unsigned int J, unsigned int V, unsigned int N, double s0, double b0, int convtype, double w0, int continuous);
 void DestroyWaveletFamily (t_WaveletFamily *pWF);
+double complex *WaveletSpectrum (int type, double op1, double scale, unsigned int N, double eps, unsigned int *k1, unsigned int *W);
 
 t_RWTvar *CreateRealWaveletVar (t_WaveletFamily *pWF, unsigned int N);
 t_CWTvar *CreateComplexWaveletVar (t_WaveletFamily *pWF, unsigned int N);
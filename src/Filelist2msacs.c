@@ -3,57 +3,263 @@
 /* the PCC_fullpair code. This increases the average reading speed by  */
 /* reducing latencies because of time acces in conventional hard disc. */
 /*                                                                     */
+/* The sac files are read ahead in parallel (see ingest.h). With the   */
+/* append option only the traces not in the output yet are read and   */
+/* appended to it, so that adding a new day costs O(new files). The    */
+/* output can be split in one file per year or month.                  */
+/*                                                                     */
 /* Authors: Sergi Ventosa Rahuet (sergiventosa@hotmail.com)            */
 /***********************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include "ReadManySacs.h"
+#include "resample.h"
+#include "quantize.h"
+#include "ingest.h"
+
+#define SPLIT_NONE  0
+#define SPLIT_YEAR  1
+#define SPLIT_MONTH 2
+
+/* Identity of a trace: its beginning time & channel. */
+typedef struct {
+	int64_t  t;
+	int32_t  msec;
+	char     id[40];   /* net.sta.loc.chn */
+	unsigned int n;    /* Traces in the outputs first, then the files in the list. */
+} t_TraceKey;
 
-int main_job (char *outfile, char *infiles, int Nmax);
+int main_job (char *outfile, char *infiles, int Nmax, float dt, int enc, int append, int split);
+unsigned int NewFiles (char **pnew, char **names, const unsigned int Tr, char *outfile, const int split, unsigned int *pN, float *pdt);
+char *SplitName (const char *outfile, const time_t t, const int split);
 void usage ();
 int RDint    (int * const x, const char *str);
+int RDfloat  (float * const x, const char *str);
 
 int main(int argc, char *argv[]) {
 	char *filelist, *outfile;
-	int Nmax = 0;
+	int i, Nmax = 0, enc = ENC_F32, append = 0, split = SPLIT_NONE;
+	float dt = 0;
 	
 	if (argc < 3) usage();
 	else {
 		filelist = argv[1];
 		outfile  = argv[2];
-		if (argc > 3) {
-			if (!strncmp(argv[3], "Nmax=", 5)) {
-				if ( RDint(&Nmax, argv[3] + 5) ) {
+		SetIngest(INGEST_URING, 0);  /* Parallel reading by default */
+		for (i=3; i<argc; i++) {
+			if (!strncmp(argv[i], "Nmax=", 5)) {
+				if ( RDint(&Nmax, argv[i] + 5) ) {
 					puts("Error when reading Nmax.\n"); Nmax = 0; 
 				}
+			} else if (!strncmp(argv[i], "dt=", 3)) {
+				if ( RDfloat(&dt, argv[i] + 3) ) {
+					puts("Error when reading dt.\n"); dt = 0; 
+				}
+			} else if (!strncmp(argv[i], "prec=", 5)) {
+				if ( EncParse(&enc, argv[i] + 5) ) {
+					puts("Error when reading prec.\n"); enc = ENC_F32; 
+				}
+			} else if (!strncmp(argv[i], "ingest", 6)) {
+				if ( IngestParse((argv[i][6] == '=') ? argv[i] + 7 : "") ) {
+					puts("Error when reading ingest.\n"); SetIngest(INGEST_SACIO, 0); 
+				}
+			} else if (!strncmp(argv[i], "append", 6)) append = 1;
+			else if (!strncmp(argv[i], "split=", 6)) {
+				if      (!strcmp(argv[i] + 6, "year"))  split = SPLIT_YEAR;
+				else if (!strcmp(argv[i] + 6, "month")) split = SPLIT_MONTH;
+				else puts("Error when reading split.\n");
 			}
 		}
-		main_job (outfile, filelist, Nmax);
+		main_job (outfile, filelist, Nmax, dt, enc, append, split);
+		ClearResamplerCache ();
 	}
 	
 	return 0;
 }
 
-int main_job (char *outfile, char *filelist, int Nmax) {
-	float **x=NULL;
-	t_HeaderInfo *hdr=NULL;
-	unsigned int Tr, N = Nmax;
+int main_job (char *outfile, char *filelist, int Nmax, float dt, int enc, int append, int split) {
+	float **x=NULL, **xg=NULL;
+	t_HeaderInfo *hdr=NULL, *hg=NULL;
+	char **names=NULL, **pnew=NULL, **gname=NULL;
+	unsigned int Tr, Trf, Trn, N = Nmax, tr, n, g;
 	int nerr=0;
-	float dt;
 	
-	nerr = ReadManySacs (&x, &hdr, NULL, &Tr, &N, &dt, filelist);
-	if (nerr != 0) printf("Error %d when reading %s.\n", nerr, filelist);
-	else {
-		nerr = Write_ManySacsFile (x, hdr, Tr, N, outfile);
-		if (nerr != 0) printf("Error %d when writing to %s.\n", nerr, outfile);
+	if ( (nerr = CreateFilelist (&names, &Trf, filelist)) || Trf == 0 ) {
+		printf("Error %d when reading %s.\n", nerr, filelist);
+		DestroyFilelist(names);
+		return -2;
+	}
+	if (NULL == (pnew = (char **)malloc(Trf*sizeof(char *)) )) {
+		DestroyFilelist(names);
+		return 4;
+	}
+	
+	/* Only the traces not in the outputs yet when appending */
+	if (append) {
+		Trn = NewFiles (pnew, names, Trf, outfile, split, &N, &dt);
+		printf("%u of the %u files are new.\n", Trn, Trf);
+	} else {
+		memcpy(pnew, names, Trf*sizeof(char *));
+		Trn = Trf;
+	}
+	if (Trn == 0) {
+		free(pnew);
+		DestroyFilelist(names);
+		return 0;
 	}
+	
+	nerr = ReadSacFiles (&x, &hdr, pnew, Trn, &Tr, &N, &dt);
+	free(pnew);
+	DestroyFilelist(names);
+	if (nerr != 0) {
+		printf("Error %d when reading %s.\n", nerr, filelist);
+		return nerr;
+	}
+	
+	/* Output of each trace, then written (appended) group by group */
+	if (NULL == (gname = (char **)calloc(Tr, sizeof(char *)) ) || 
+		NULL == (xg = (float **)malloc(Tr*sizeof(float *)) ) || 
+		NULL == (hg = (t_HeaderInfo *)malloc(Tr*sizeof(t_HeaderInfo)) )) nerr = 4;
+	for (tr=0; tr<Tr && !nerr; tr++) 
+		if (NULL == (gname[tr] = SplitName (outfile, hdr[tr].t, split) )) nerr = 4;
+	if (nerr) printf("Out of memory when writing to %s.\n", outfile);
+	
+	for (tr=0; tr<Tr && !nerr; tr++) {
+		if (gname[tr][0] == '\0') continue;  /* Already written */
+		for (n=0, g=tr; g<Tr; g++) {
+			if (strcmp(gname[g], gname[tr])) continue;
+			xg[n] = x[g];
+			hg[n] = hdr[g];
+			n++;
+			if (g > tr) gname[g][0] = '\0';
+		}
+		if (append) nerr = Append_ManySacsFile (xg, hg, n, N, gname[tr], enc);
+		else nerr = Write_ManySacsFile (xg, hg, n, N, gname[tr], enc);
+		if (nerr != 0) printf("Error %d when writing to %s.\n", nerr, gname[tr]);
+		else if (split) printf("%u traces written to %s.\n", n, gname[tr]);
+	}
+	
+	if (gname != NULL) for (tr=0; tr<Tr; tr++) free(gname[tr]);
+	free(gname);
+	free(xg);
+	free(hg);
+	free(hdr);
+	Destroy_FloatArrayList (x, Tr);
 	return nerr;
 }
 
+/* Output of the traces beginning at t: outfile, or with the year (.YYYY) or month (.YYYY-MM) */
+/* before its extension when split.                                                          */
+char *SplitName (const char *outfile, const time_t t, const int split) {
+	const char *pext, *pdir;
+	struct tm *ptm;
+	size_t len = strlen(outfile);
+	char *name;
+	
+	if (NULL == (name = (char *)malloc(len + 16) )) return NULL;
+	if (split == SPLIT_NONE || NULL == (ptm = gmtime(&t) )) {
+		strcpy(name, outfile);
+		return name;
+	}
+	pext = strrchr(outfile, '.');
+	pdir = strrchr(outfile, '/');
+	if (pext == NULL || (pdir != NULL && pext < pdir)) pext = outfile + len;
+	memcpy(name, outfile, pext - outfile);
+	if (split == SPLIT_YEAR) sprintf(name + (pext - outfile), ".%04d%s", ptm->tm_year + 1900, pext);
+	else sprintf(name + (pext - outfile), ".%04d-%02d%s", ptm->tm_year + 1900, ptm->tm_mon + 1, pext);
+	return name;
+}
+
+int KeyCmp (const void *a, const void *b) {
+	const t_TraceKey *ka = (const t_TraceKey *)a, *kb = (const t_TraceKey *)b;
+	int i;
+	
+	if (ka->t != kb->t) return (ka->t < kb->t) ? -1 : 1;
+	if (ka->msec != kb->msec) return (ka->msec < kb->msec) ? -1 : 1;
+	if ( (i = strcmp(ka->id, kb->id)) ) return i;
+	return (ka->n < kb->n) ? -1 : (ka->n > kb->n);
+}
+
+void TraceKey (t_TraceKey * const pk, const t_HeaderInfo * const h, const unsigned int n) {
+	pk->t    = h->t;
+	pk->msec = h->msec;
+	pk->n    = n;
+	snprintf(pk->id, sizeof(pk->id), "%.8s.%.8s.%.8s.%.8s", h->net, h->sta, h->loc, h->chn);
+}
+
+/* Sets in pnew[] the files of names[] whose trace (time & channel) is neither in their output */
+/* msacs file nor earlier in the list, reading only their headers. Returns how many. *pN and   */
+/* *pdt, when 0, are set to the ones of the first output found.                                */
+unsigned int NewFiles (char **pnew, char **names, const unsigned int Tr, char *outfile, const int split, unsigned int *pN, float *pdt) {
+	t_HeaderInfo *hdr, *hold;
+	t_TraceKey *key = NULL, *pk;
+	char **oname = NULL, *name;
+	unsigned int tr, n, k, K = 0, No, O = 0, Told, Tk = 0, Trn = 0;
+	int enc;
+	
+	if (NULL == (hdr = (t_HeaderInfo *)malloc(Tr*sizeof(t_HeaderInfo)) ) ||
+		NULL == (oname = (char **)calloc(Tr, sizeof(char *)) )) {
+		printf("NewFiles: Out of memory, all the files are read.\n");
+		free(hdr);
+		memcpy(pnew, names, Tr*sizeof(char *));
+		return Tr;
+	}
+	ReadSacHeaders (hdr, names, Tr);
+	
+	/* The traces of each output touched, once */
+	for (tr=0; tr<Tr; tr++) {
+		if (hdr[tr].npts == 0) continue;
+		if (NULL == (name = SplitName (outfile, hdr[tr].t, split) )) continue;
+		for (n=0; n<O; n++) if (!strcmp(oname[n], name)) break;
+		if (n < O) { free(name); continue; }
+		oname[O++] = name;
+		if (Read_ManySacsHeaders (&hold, &Told, &No, &enc, name)) continue;
+		if (*pN == 0)  *pN  = No;
+		if (*pdt == 0 && Told) *pdt = hold[0].dt;
+		if (NULL == (pk = (t_TraceKey *)realloc(key, (K + Told + Tr)*sizeof(t_TraceKey)) )) { free(hold); continue; }
+		key = pk;
+		for (k=0; k<Told; k++) TraceKey (&key[K++], &hold[k], k);
+		Tk += Told;
+		free(hold);
+	}
+	
+	/* The new ones, after the ones in the outputs with the same key */
+	if (NULL == (pk = (t_TraceKey *)realloc(key, (K + Tr + 1)*sizeof(t_TraceKey)) )) {
+		printf("NewFiles: Out of memory, all the files are read.\n");
+		memcpy(pnew, names, Tr*sizeof(char *));
+		Trn = Tr;
+	} else {
+		key = pk;
+		for (tr=0; tr<Tr; tr++) 
+			if (hdr[tr].npts > 0) TraceKey (&key[K++], &hdr[tr], Tk + tr);
+		qsort(key, K, sizeof(t_TraceKey), KeyCmp);
+		for (k=0; k<K; k++) {
+			if (key[k].n < Tk) continue;
+			if (k > 0 && key[k].t == key[k-1].t && key[k].msec == key[k-1].msec && !strcmp(key[k].id, key[k-1].id)) continue;
+			hdr[key[k].n - Tk].npts = -1;  /* New */
+		}
+		for (tr=0; tr<Tr; tr++) if (hdr[tr].npts == -1) pnew[Trn++] = names[tr];
+	}
+	
+	for (n=0; n<O; n++) free(oname[n]);
+	free(oname);
+	free(key);
+	free(hdr);
+	return Trn;
+}
+
 void usage () {
-	puts("\nUSAGE: Filelist2msacs \"List of sac files\" \"Output file name\" [Nmax=\"maximum number of samples per sequence\"]");
+	puts("\nUSAGE: Filelist2msacs \"List of sac (or miniSEED) files\" \"Output file name\" [Nmax=\"maximum number of samples per sequence\"]");
+	puts("       [dt=\"sampling period the sequences are resampled to, by default the one of the first file\"]");
+	puts("       [prec=\"precision of the samples: f32 (default), f16, bf16 or i16 (scaled per sequence)\"]");
+	puts("       [ingest[=uring|pread|sacio][,qd] \"the sac files are read ahead in parallel, qd files in flight (64 by");
+	puts("        default), or one by one with the sac library (sacio)\"]");
+	puts("       [append \"append the traces not in the output file yet, the ones with a new time or channel\"]");
+	puts("       [split=year|month \"one output file per year or month, named .YYYY or .YYYY-MM before the extension\"]");
 }
 
 int RDint (int * const x, const char *str) {
@@ -62,3 +268,10 @@ int RDint (int * const x, const char *str) {
 	*x = strtol(str, &pstr, 10);
 	return (str == pstr) ? 1 : 0; 
 }
+
+int RDfloat (float * const x, const char *str) {
+	char *pstr;
+	
+	*x = strtof(str, &pstr);
+	return (str == pstr) ? 1 : 0; 
+}
@@ -62,9 +62,16 @@
 #include <float.h>
 #include "FFTapps.h"
 #include "ReadManySacs.h"
+#include "preprocess.h"
+#include "resample.h"
 #include "rotlib.h"
 #include "sac2bin.h"
 #include "sph.h"
+#include "writer.h"
+#include "quantize.h"
+#include "tensor.h"
+#include "ingest.h"
+#include "inventory.h"
 
 #ifndef PI
 #define PI 3.14159265358979323846
@@ -79,7 +86,7 @@ typedef struct {
 	unsigned int  iformat;
 	unsigned int  oformat;
 	unsigned int  pcc;
-	unsigned int  wpcc;
+	unsigned int  wpcc;     /* 0: no wpcc, 1: double precision wpcc, 2: single precision wpcc. */
 	unsigned int  ccgn;
 	unsigned int  cc1b;
 	unsigned int  clip;
@@ -101,8 +108,43 @@ typedef struct {
 	int           autopair; /* 0: Pair filelists line per line, 1: pair filelists automatically according to the metadata (default 1). */
 	int           acc;      /* 0: cross-correlation, 1: autocorrelation */
 	int           verbose;  /* 0: Silent mode (no message), 1: some message (default), 2: a few more. */
+	int           ols;      /* 0: correlate whole traces (default), 1: overlap-save segments (ccgn, cc1b & pcc2). */
+	unsigned int  Nseg;     /* ols: FFT length of the segments (default 0, about 4 times the lag span). */
+	double        b0;       /* wpcc2: Multirate sampling step, scales decimated by about b0*scale (default 0, full rate). */
+	double        ram;      /* Length of the running-absolute-mean normalization window in seconds (default 0, none). */
+	double        swhite[2];/* Band of the per-trace spectral whitening in Hz (default none). */
+	double        swtaper;  /* Width of the cosine tapers of the spectral whitening in Hz (default 10% of the band). */
+	t_Conditioning cond;    /* Detrend, taper, band-pass & decimation of the input traces (default none). cond.gaps: */
+							/* > 0: masks the zero-filled gaps, runs of at least cond.gaps zeros, in ccgn, cc1b &    */
+							/* pcc2 (default 0).                                                                     */
+	double        dt;       /* Sampling period all the traces are resampled to (default 0, the one of the first trace). */
+	double        win;      /* Length of the sub-daily windows in seconds (default 0, whole traces). */
+	double        step;     /* Step between the windows in seconds (default win/2). */
+	int           stack;    /* 1: the correlations of the windows of each pair are stacked (default 0). */
+	char          *oarcname;/* Archive of the oarc output (default NULL: net1.sta1.loc1.net2.sta2.loc2.arc). */
+	int           oenc;     /* Encoding of the samples of the oarc output (default ENC_F32, see quantize.h). */
+	char          *otensor; /* Tensor of the otensor output (default pcc.tensor). */
+	int           tgrid[2]; /* Year & day of the first time slot of a new tensor. */
+	double        tstep;    /* Time between the slots of a new tensor in seconds. */
+	unsigned int  tslots;   /* Number of time slots of a new tensor (default 0: from the first run). */
+	char          *inv;     /* Station inventory giving the locations & time spans (default NULL, see inventory.h). */
 } t_PCCmatrix;
 
+/* Normalizations and parameters shared by all the correlations of a station pair. */
+typedef struct {
+	t_TraceNorm   *pn;
+	unsigned int  Nseg;     /* ols segment length (0: whole traces or windows). */
+	double        pmin;     /* wpcc2 periods in samples. */
+	double        pmax;
+} t_CCsetup;
+
+#define CC_PCC   1
+#define CC_WPCC  2
+#define CC_CCGN  3
+#define CC_CC1B  4
+#define WINBATCH 1024  /* Windows correlated at once when they are stacked. */
+#define WRBATCH  256   /* Pairs correlated before handing their outputs to the writer. */
+
 typedef struct {
 	unsigned int  ind;
 	time_t        time;
@@ -110,24 +152,24 @@ typedef struct {
 } t_elem;
 
 int PCCfullpair_main (t_PCCmatrix *fpcc);
+int Correlate_set (float **y, float **x1, float **x2, unsigned int N, unsigned int Tr, int Lag1, int Lag2, int method, 
+	t_PCCmatrix *fpcc, t_CCsetup *ps);
+int Correlate_windows (float **y, float **x1, float **x2, unsigned int Nw, unsigned int Ns, unsigned int W, unsigned int Tr, 
+	int stack, unsigned int L, int Lag1, int Lag2, int method, t_PCCmatrix *fpcc, t_CCsetup *ps);
 
 int StoreInManySacs (float **y, unsigned int L, unsigned int Tr, int Lag1, t_HeaderInfo *SacHeader1, 
 	t_HeaderInfo *SacHeader2, float dt, char *ccname, int verbose);
 int StoreInManyBins (float **y, unsigned int L, unsigned int Tr, int Lag1,  t_HeaderInfo *SacHeader1, 
 	t_HeaderInfo *SacHeader2, float dt, char *ccname, char *prefix, int verbose);
 int wrsac(char *filename, char *kstnm, float beg, float dt, float *y, int nsamp, t_HeaderInfo *ptr1, t_HeaderInfo *ptr2);
+int StoreJob (t_WriteJob *pj);
 
 void infooo();
 void usage();
-void clipping (float *x, unsigned int N);
-int RemoveOutlierTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *Tr0, float *std, float nstd);
 int SortTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *Tr0);
 int MakePairedLists (float **xOut1[], t_HeaderInfo *SacHeader1[], unsigned int *TrOut1, 
 	float **xOut2[], t_HeaderInfo *SacHeader2[], unsigned int *TrOut2);
 int CheckPairs (t_HeaderInfo *SacHeader1, unsigned int Tr1, t_HeaderInfo *SacHeader2, unsigned int Tr2);
-int AveWhite (float **x0, unsigned int N, unsigned int Tr, double freq[2], double dt);
-float qmedian(float a[], int n);
-float qabsmedian(float input[], int n);
 
 int RDint (int * const x, const char *str);
 int RDuint (unsigned int * const x, const char *str);
@@ -163,10 +205,25 @@ int main(int argc, char *argv[]) {
 			fpcc.oformat = 2;
 			if (!strncmp(argv[i], "obin=",  5)) fpcc.obinprefix = argv[i] + 5;
 		} 
+		else if (!strncmp(argv[i], "oarc",   4)) {
+			fpcc.oformat = 3;
+			if (!strncmp(argv[i], "oarc=",  5)) fpcc.oarcname = argv[i] + 5;
+		} 
+		else if (!strncmp(argv[i], "oprec=", 6)) er += EncParse(&fpcc.oenc, argv[i] + 6);
+		else if (!strncmp(argv[i], "otensor",7)) {
+			fpcc.oformat = 4;
+			if (!strncmp(argv[i], "otensor=", 8)) fpcc.otensor = argv[i] + 8;
+		} 
+		else if (!strncmp(argv[i], "tgrid=", 6)) 
+			er += (4 != sscanf(argv[i] + 6, "%d-%d,%lf,%u", &fpcc.tgrid[0], &fpcc.tgrid[1], &fpcc.tstep, &fpcc.tslots) || !(fpcc.tstep > 0));
+		else if (!strncmp(argv[i], "inv=",   4)) fpcc.inv = argv[i] + 4;
+		else if (!strncmp(argv[i], "ingest", 6)) er += IngestParse((argv[i][6] == '=') ? argv[i] + 7 : "");
 		else if (!strncmp(argv[i], "pcc",    3)) fpcc.pcc  = 1;
+		else if (!strncmp(argv[i], "wpccf",  5)) fpcc.wpcc = 2;
 		else if (!strncmp(argv[i], "wpcc",   4)) fpcc.wpcc = 1;
 		else if (!strncmp(argv[i], "ccgn",   4)) fpcc.ccgn = 1;
 		else if (!strncmp(argv[i], "cc1b",   4)) fpcc.cc1b = 1;
+		else if (!strncmp(argv[i], "clip=hist", 9)) fpcc.clip = 2;
 		else if (!strncmp(argv[i], "clip",   4)) fpcc.clip = 1;
 		else if (!strncmp(argv[i], "std=",   4)) er += RDdouble(&fpcc.std, argv[i] + 4);
 		else if (!strncmp(argv[i], "mindist=", 8)) er += RDdouble(&fpcc.mindist, argv[i] + 8);
@@ -179,9 +236,31 @@ int main(int argc, char *argv[]) {
 		else if (!strncmp(argv[i], "V=",     2)) er += RDuint(&fpcc.V, argv[i] + 2);
 		else if (!strncmp(argv[i], "type=",  5)) er += RDint(&fpcc.type, argv[i] + 5);
 		else if (!strncmp(argv[i], "w0=",    3)) er += RDdouble(&fpcc.op1, argv[i] + 3);
+		else if (!strncmp(argv[i], "b0=",    3)) er += RDdouble(&fpcc.b0, argv[i] + 3);
 		else if (!strncmp(argv[i], "awhite=",7)) er += RDdouble_array(fpcc.awhite, argv[i] + 7, 2);
+		else if (!strncmp(argv[i], "swhite=",7)) er += RDdouble_array(fpcc.swhite, argv[i] + 7, 2);
+		else if (!strncmp(argv[i], "swtaper=",8)) er += RDdouble(&fpcc.swtaper, argv[i] + 8);
+		else if (!strncmp(argv[i], "ram=",   4)) er += RDdouble(&fpcc.ram, argv[i] + 4);
+		else if (!strncmp(argv[i], "detrend",7)) fpcc.cond.detrend = 1;
+		else if (!strncmp(argv[i], "taper=", 6)) er += RDdouble(&fpcc.cond.taper, argv[i] + 6);
+		else if (!strncmp(argv[i], "bp=",    3)) er += RDdouble_array(fpcc.cond.fb, argv[i] + 3, 2);
+		else if (!strncmp(argv[i], "bporder=",8)) er += RDuint(&fpcc.cond.order, argv[i] + 8);
+		else if (!strncmp(argv[i], "dec=",   4)) er += RDuint(&fpcc.cond.D, argv[i] + 4);
+		else if (!strncmp(argv[i], "dt=",    3)) er += RDdouble(&fpcc.dt, argv[i] + 3);
+		else if (!strncmp(argv[i], "gaps=",  5)) er += RDint(&fpcc.cond.gaps, argv[i] + 5);
+		else if (!strncmp(argv[i], "gaps",   4)) fpcc.cond.gaps = GAPMIN;
+		else if (!strncmp(argv[i], "stalta=",7)) er += RDdouble_array(fpcc.cond.stalta, argv[i] + 7, 4);
+		else if (!strncmp(argv[i], "stalta_dw", 9)) fpcc.cond.downweight = 1;
+		else if (!strncmp(argv[i], "win=",   4)) er += RDdouble(&fpcc.win, argv[i] + 4);
+		else if (!strncmp(argv[i], "step=",  5)) er += RDdouble(&fpcc.step, argv[i] + 5);
+		else if (!strncmp(argv[i], "stack",  5)) fpcc.stack = 1;
 		else if (!strncmp(argv[i], "NoAutoPairing", 13)) fpcc.autopair = 0;
 		else if (!strncmp(argv[i], "verbose=", 8)) er += RDint(&fpcc.verbose, argv[i] + 8);
+		else if (!strncmp(argv[i], "ols",    3)) fpcc.ols = 1;
+		else if (!strncmp(argv[i], "Nseg=",  5)) {
+			er += RDuint(&fpcc.Nseg, argv[i] + 5);
+			fpcc.ols = 1;
+		}
 		else if (!strncmp(argv[i], "info",   4)) {
 			infooo();
 			return 0;
@@ -192,28 +271,83 @@ int main(int argc, char *argv[]) {
 		printf("PCCfullpair: Warning, the std option cannot be used without automatic trace pairing.\n");
 		fpcc.std = 0;
 	}
+	if (fpcc.oenc != ENC_F32 && fpcc.oformat != 3) 
+		printf("PCCfullpair: Warning, oprec only applies to the oarc output, the outputs are float32.\n");
 	er = PCCfullpair_main(&fpcc); /* The one who make the job. */
+	ClearWaveletSpectraCache ();
+	ClearResamplerCache ();
 	return er;
 }
 
 int PCCfullpair_main (t_PCCmatrix *fpcc) {
-	t_HeaderInfo *SacHeader1=NULL, *SacHeader2=NULL;
-	float *std=NULL;
-	float dt, dt1;
+	t_HeaderInfo *SacHeader1=NULL, *SacHeader2=NULL, *hdrw1=NULL, *hdrw2=NULL, *phd1, *phd2;
+	float dt, dt1, dt0;
 	double pmin, pmax;
-	float **x1=NULL, **x2=NULL, **y=NULL, *px;
-	double lat1=-90, lon1=0, lat2=90, lon2=0, gcarc, da2;
-	unsigned int tr, Tr, Tr1, Tr2, n, N, N1;
-	int Lag1, Lag2, ia1, L, nerr=0, nerr1=0, stloc=1;
-	char nickpcc[16]; /* Up to the first 8 are saved in the sac header. */
+	float **x1=NULL, **x2=NULL, **y[2]={NULL, NULL}, **yb;
+	t_AveWhite *pw1=NULL, *pw2=NULL;
+	t_TraceNorm tn, *pn=NULL;
+	t_CCsetup cs;
+	double lat1=-90, lon1=0, lat2=90, lon2=0, gcarc;
+	unsigned int Tr, Tr1, Tr2, N, N1, Nseg=0, Nc, Nw=0, Ns=0, W=0, Tro, Wo, tr, tr0, B, w, m, c, nc, ny, k, nshort = 0, nshort2 = 0;
+	int Lag1, Lag2, ia1, L, nerr=0, nerr1=0, nerr2, stloc=1, tdnorm;
+	unsigned long *sq, *sqb;  /* Sequence numbers of the last writes of each chunk of pairs */
+	t_Writer wr;
+	t_WriteJob job;
+	int wrt;                  /* Outputs through the writer */
+	t_Tensor *ten = NULL;
+	float **yt = NULL;
+	struct tm tm;
+	int64_t t0 = 0;
+	double tstep = 0;
+	unsigned int nslot = 0;
+	t_Conditioning *pc;
+	t_Inventory *pinv;
+	const t_InvStation *ps1 = NULL, *ps2 = NULL;
+	int invloc = 0;
+	char nickpcc[16], *pch; /* Up to the first 8 are saved in the sac header. */
+	char arcname[64];
+	int narc = 0;
 	
 	/* Input checkings */
 	if (fpcc == NULL) {       printf("PCCfullpair_main: NULL input\n");           return -1; }
 	if (fpcc->fin1 == NULL) { printf("PCCfullpair_main: NULL input filename1\n"); return -1; }
 	if (fpcc->fin2 == NULL) { printf("PCCfullpair_main: NULL input filename2\n"); return -1; }
 	
+	if (fpcc->cond.gaps < 0) fpcc->cond.gaps = 0;
+	if (fpcc->cond.stalta[1] > 0 && !fpcc->cond.downweight && !fpcc->cond.gaps) fpcc->cond.gaps = GAPMIN;  /* The masked transients are gaps. */
+	pc = (fpcc->cond.detrend || fpcc->cond.taper > 0 || fpcc->cond.fb[0] > 0 || fpcc->cond.fb[1] > 0 || fpcc->cond.D > 1 || 
+		fpcc->cond.gaps || fpcc->cond.stalta[1] > 0) ? &fpcc->cond : NULL;
+	
+	/* Locations & common time from the station inventory, without opening any data file */
+	if (fpcc->inv != NULL) {
+		if (NULL == (pinv = ReadInventory (fpcc->inv) )) 
+			printf("PCCfullpair_main: Warning, cannot read the station inventory %s, following without it.\n", fpcc->inv);
+		else {
+			ps1 = InventoryFind (pinv, fpcc->fin1);
+			ps2 = (fpcc->acc) ? ps1 : InventoryFind (pinv, fpcc->fin2);
+			if (ps1 == NULL || ps2 == NULL) 
+				printf("PCCfullpair_main: Warning, %s is not in the station inventory %s.\n", (ps1 == NULL) ? fpcc->fin1 : fpcc->fin2, fpcc->inv);
+			else if (InventoryOverlap (pinv, ps1, ps2) <= 0) {
+				printf("PCCfullpair_main: No data at the same time on %s - %s.\n", fpcc->fin1, fpcc->fin2);
+				DestroyInventory (pinv);
+				return 0;
+			} else {
+				invloc = 1;
+				stloc  = !ps1->nostloc && !ps2->nostloc;
+				lat1 = ps1->lat; lon1 = ps1->lon;
+				lat2 = ps2->lat; lon2 = ps2->lon;
+			}
+			DestroyInventory (pinv);
+		}
+	}
+	
 	/* Read input files */
-	if (fpcc->iformat == 1) {
+	if (invloc) {
+		if (fpcc->iformat != 1 && fpcc->iformat != 2) { 
+			printf("PCCfullpair_main: Unknown format."); 
+			nerr = 5; 
+		}
+	} else if (fpcc->iformat == 1) {
 		if ( -4 == (nerr1 = ReadLocation (&lat1, &lon1, fpcc->fin1)) ) {
 			printf("PCCfullpair_main: Warning, the station location of %s is not available, following with 0.\n", fpcc->fin1);
 			stloc = 0;
@@ -274,7 +408,8 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 		}
 	}
 	
-	N1 = fpcc->Nmax;
+	N1  = fpcc->Nmax;
+	dt1 = (float)fpcc->dt;  /* Target sampling, 0: the one of the first file */
 	if (fpcc->iformat == 1)
 		nerr1 = ReadManySacs (&x1, &SacHeader1, NULL, &Tr1, &N1, &dt1, fpcc->fin1);
 	else if (fpcc->iformat == 2)
@@ -289,10 +424,10 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 	}
 	if (nerr1) { printf("PCCfullpair_main: Something went wrong when reading the data from station 1! (nerr = %d)\n", nerr1); return nerr1; }
 	
-	nerr = RemoveZeroTraces (&x1, &SacHeader1, &Tr1, N1);
-	if (nerr) printf("PCCfullpair_main: Something went wrong when RemoveZeroTraces of station 1! (nerr = %d)\n", nerr);
+	dt0 = dt1;  /* Station 2 is resampled to the sampling of station 1 */
 	
-	N = fpcc->Nmax;
+	N  = fpcc->Nmax;
+	dt = dt0;
 	if (fpcc->acc == 0) {
 		if (fpcc->iformat == 1)
 			nerr  = ReadManySacs (&x2, &SacHeader2, NULL, &Tr2, &N, &dt, fpcc->fin2);
@@ -313,11 +448,34 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 			return 0;
 		}
 		if (nerr)  { printf("PCCfullpair_main: Something went wrong when reading the data from station 2! (nerr = %d)\n", nerr);  return nerr; }
+	}
+	
+	/* Partial traces (e.g., station restarts) are zero-padded, their ends are masked as gaps. */
+	/* Decided on both stations before conditioning any, so that they are conditioned alike.   */
+	if (!fpcc->cond.gaps) {
+		if ( (nshort = ShortTraces (SacHeader1, Tr1, N1)) )
+			printf("PCCfullpair_main: %u traces of %s are shorter than %u samples, their zero-padded ends are masked (gaps).\n", nshort, fpcc->fin1, N1);
+		if (fpcc->acc == 0 && (nshort2 = ShortTraces (SacHeader2, Tr2, N)) )
+			printf("PCCfullpair_main: %u traces of %s are shorter than %u samples, their zero-padded ends are masked (gaps).\n", nshort2, fpcc->fin2, N);
+		if (nshort || nshort2) {
+			fpcc->cond.gaps = GAPMIN;
+			pc = &fpcc->cond;
+		}
+	}
+	
+	/* Conditioning, zeros, polarity, clipping & outliers of station 1 */
+	nerr = PreprocessTraces (&x1, &SacHeader1, &Tr1, &N1, &dt1, pc, 1, fpcc->clip, fpcc->std);
+	if (nerr) { printf("PCCfullpair_main: Something went wrong when PreprocessTraces of station 1! (nerr = %d)\n", nerr); return nerr; }
+	
+	if (fpcc->acc == 0) {
+		/* Conditioning, zeros, polarity, clipping & outliers of station 2 */
+		nerr = PreprocessTraces (&x2, &SacHeader2, &Tr2, &N, &dt, pc, 1, fpcc->clip, fpcc->std);
+		if (nerr) { printf("PCCfullpair_main: Something went wrong when PreprocessTraces of station 2! (nerr = %d)\n", nerr); return nerr; }
 		
-		nerr = RemoveZeroTraces (&x2, &SacHeader2, &Tr2, N);
-		if (nerr) printf("PCCfullpair_main: Something went wrong when RemoveZeroTraces of station 2! (nerr = %d)\n", nerr);
-		
-		if (N1 != N) printf("PCCfullpair_main: These traces have different lengths: %u:%u\n", N1, N);
+		if (N1 != N) {
+			printf("PCCfullpair_main: These traces have different lengths: %u:%u\n", N1, N);
+			if (N1 < N) N = N1;  /* The common part only */
+		}
 		if (dt1 != dt) printf("PCCfullpair_main: These stations have different samplings: %11.9f:%11.9f\n", dt1, dt);
 	} else {
 		x2 = x1;
@@ -327,62 +485,6 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 		dt  = dt1;
 	}
 	
-	/* Outliers and clippling for station 1 */
-	/* Data std. (The signal should have no mean). */
-	if (fpcc->std) {
-		if (NULL == (std = (float *)calloc(Tr1, sizeof(float)) )) {
-			Destroy_FloatArrayList(x1, Tr1);
-			free(SacHeader1);
-			return 4;
-		}
-	
-		for (tr=0; tr<Tr1; tr++) {
-			px = x1[tr];
-			da2 = 0;
-			for (n=0; n<N; n++) da2 += px[n] * px[n];
-			std[tr] = (float)sqrt(da2/N);
-		}
-	}
-
-	/* Clipping */
-	if (fpcc->clip)
-		for (tr=0; tr<Tr1; tr++) clipping (x1[tr], N);
-	
-	/* Remove traces having much higher or lower energy than the others ones. */
-	if (fpcc->std) {
-		nerr = RemoveOutlierTraces (&x1, &SacHeader1, &Tr1, std, fpcc->std);
-		if (nerr) { printf("PCCfullpair_main: Something went wrong when RemoveOutlierTraces of station 1! (nerr = %d)\n", nerr); return nerr; }
-	}
-	
-	/* Outliers and clippling for station 2 */
-	if (fpcc->acc == 0) {
-		if (fpcc->std) {
-			if (NULL == (std = (float *)calloc(Tr2, sizeof(float)) )) {
-				Destroy_FloatArrayList(x2, Tr2);
-				free(SacHeader2);
-				return 4;
-			}
-		
-			for (tr=0; tr<Tr2; tr++) {
-				px = x2[tr];
-				da2 = 0;
-				for (n=0; n<N; n++) da2 += px[n] * px[n];
-				std[tr] = (float)sqrt(da2/N);
-			}
-		}
-	
-		/* Clipping */
-		if (fpcc->clip)
-			for (tr=0; tr<Tr2; tr++) clipping (x2[tr], N);
-		
-		/* Remove traces having much higher or lower energy than the others ones. */
-		if (fpcc->std) {
-			nerr = RemoveOutlierTraces (&x2, &SacHeader2, &Tr2, std, fpcc->std);
-			if (nerr) { printf("PCCfullpair_main: Something went wrong when RemoveOutlierTraces of station 2! (nerr = %d)\n", nerr); return nerr; }
-			free(std);
-		}
-	} else Tr2 = Tr1;
-	
 	if (fpcc->autopair) {
 		/* Sort out each list. */
 		SortTraces (&x1, &SacHeader1, &Tr1);
@@ -396,12 +498,6 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 	}
 	Tr = Tr1;
 	
-	/* Whittenings */
-	if (fpcc->awhite[0] > 0 && fpcc->awhite[1] > fpcc->awhite[0]) {
-		AveWhite (x1, N, Tr, fpcc->awhite, dt);
-		AveWhite (x2, N, Tr, fpcc->awhite, dt);
-	}
-	
 	/* Calculate lags. */
 	if (fpcc->nl1) Lag1 = fpcc->nl1;
 	else if (fpcc->tl1) Lag1 = (int)round(fpcc->tl1 / (double)dt);
@@ -411,13 +507,90 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 	else Lag2 = 0;
 	
 	if (Lag1 > Lag2) { ia1 = Lag1; Lag1 = Lag2; Lag2 = ia1; }
-	if (abs(Lag1) >= N || abs(Lag2) >= N) { 
-		printf("PCCfullpair_main: TOO LARGE LAGS!!! The modulus of the Lags have to be lower than the sequence length.\n");
+	
+	/* Sub-daily windows, correlated as Tr*W short traces of Nc samples */
+	Nc = N;
+	if (fpcc->win > 0) {
+		Nw = (unsigned int)round(fpcc->win/dt);
+		Ns = (fpcc->step > 0) ? (unsigned int)round(fpcc->step/dt) : Nw/2;
+		if (Ns == 0) Ns = 1;
+		if (Nw == 0 || Nw > N) printf("PCCfullpair_main: Warning, the windows are longer than the traces, following with whole traces.\n");
+		else {
+			W  = 1 + (N - Nw)/Ns;
+			Nc = Nw;
+		}
+	}
+	
+	if (abs(Lag1) >= Nc || abs(Lag2) >= Nc) { 
+		printf("PCCfullpair_main: TOO LARGE LAGS!!! The modulus of the Lags have to be lower than the sequence (window) length.\n");
 		return 6; 
 	}
 	L = Lag2-Lag1+1;
 	
+	/* Segment length of the overlap-save correlations. */
+	if (fpcc->ols) {
+		if (fpcc->Nseg && fpcc->Nseg < 2*L) 
+			printf("PCCfullpair_main: Warning, Nseg=%u is shorter than twice the lag span, following with the default.\n", fpcc->Nseg);
+		Nseg = (fpcc->Nseg >= 2*L) ? fpcc->Nseg : ols_length(Nc, Lag1, Lag2);
+		if (Nseg == 0) printf("PCCfullpair_main: The lag span is too long for the overlap-save correlations, following with whole traces.\n");
+		if (Nseg && fpcc->cond.gaps) {
+			printf("PCCfullpair_main: Warning, the gaps are only masked on whole traces, following without ols.\n");
+			Nseg = 0;
+		}
+	}
+	if (fpcc->cond.gaps && (fpcc->wpcc || (fpcc->pcc && fpcc->v != 2)))
+		printf("PCCfullpair_main: Warning, the gaps are only masked in ccgn, cc1b & pcc2.\n");
+	
+	/* Normalizations: ccgn, cc1b & pcc2 do them on the fly on their own spectra, the other */
+	/* methods need the normalized traces. An autocorrelation is normalized only once.      */
+	tdnorm = (fpcc->wpcc || (fpcc->pcc && (fpcc->v != 2 || Nseg)) || (Nseg && (fpcc->ccgn || fpcc->cc1b)) );
+	tn.M = (fpcc->ram > 0) ? (unsigned int)round(fpcc->ram/(2*dt)) : 0;
+	tn.fw[0] = tn.fw[1] = tn.fw[2] = 0;
+	tn.dt = dt;
+	if (fpcc->swhite[0] >= 0 && fpcc->swhite[1] > fpcc->swhite[0]) {
+		tn.fw[0] = fpcc->swhite[0];
+		tn.fw[1] = fpcc->swhite[1];
+		tn.fw[2] = (fpcc->swtaper > 0) ? fpcc->swtaper : 0.1*(fpcc->swhite[1] - fpcc->swhite[0]);
+	}
+	if (tn.M || tn.fw[1] > 0) pn = &tn;
+	
+	if (fpcc->awhite[0] > 0 && fpcc->awhite[1] > fpcc->awhite[0]) {
+		if (tn.fw[1] > 0) printf("PCCfullpair_main: Warning, awhite is ignored when the traces are spectrally whitened (swhite).\n");
+		else {
+			pw1 = CreateAveWhite (x1, N, Tr, fpcc->awhite, dt);
+			if (fpcc->acc && pw1 != NULL) {  /* x2 is x1: whitened twice, by the filter of x1 and then by the one of whitened x1. */
+				AveWhite_apply (x1, N, Tr, pw1, fpcc->cond.gaps);
+				DestroyAveWhite (pw1);
+				pw1 = CreateAveWhite (x1, N, Tr, fpcc->awhite, dt);
+			}
+			pw2 = (fpcc->acc) ? pw1 : CreateAveWhite (x2, N, Tr, fpcc->awhite, dt);
+			if (pw1 == NULL || pw2 == NULL) {
+				printf("PCCfullpair_main: Whitening filters failed, following without whitening.\n");
+				if (pw2 != pw1) { DestroyAveWhite (pw1); DestroyAveWhite (pw2); }
+				pw1 = pw2 = NULL;
+			}
+		}
+	}
+	
+	/* RAM, then the whitenings. The average whitening (awhite) is done on the traces, once for */
+	/* every method: cut back to N samples, it cannot be folded into the correlation spectra.   */
+	if (tdnorm || pw1 != NULL) {
+		if (pn != NULL) {
+			TraceNorm_apply (x1, N, Tr, pn);
+			if (fpcc->acc == 0) TraceNorm_apply (x2, N, Tr, pn);
+			pn = NULL;
+		}
+		if (pw1 != NULL) {
+			AveWhite_apply (x1, N, Tr, pw1, fpcc->cond.gaps);
+			if (fpcc->acc == 0) AveWhite_apply (x2, N, Tr, pw2, fpcc->cond.gaps);
+			DestroyAveWhite (pw1);
+			if (pw2 != pw1) DestroyAveWhite (pw2);
+			pw1 = pw2 = NULL;
+		}
+	}
+	
 	printf("Lag1 = %d, Lag2 = %d, L = %d, N = %d, Tr = %d, gcarc = %f\n", Lag1, Lag2, L, N, Tr, gcarc);
+	if (W) printf("%u windows of %u samples every %u samples per trace%s\n", W, Nw, Ns, (fpcc->stack) ? ", stacked" : "");
 	if (Tr <= fpcc->mincc) {
 		if (!Tr) printf("NO INTERSTATION CORRELATION TO BE COMPUTED.\n");
 		else printf("ONLY %d INTERSTATION CORRELATION COULD BE COMPUTED.\n", Tr); 
@@ -443,50 +616,152 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 		else if (fpcc->v==1) strcpy(nickpcc, "pcc1");
 		else sprintf(nickpcc, "pcc%.1f", fpcc->v);
 		
-		/* Output array memory */
-		if (NULL == (y = Create_FloatArrayList (L, Tr) )) {
-			printf ("PCCfullpair_main: Out of memory on the output array (%d x %d)\n", L, Tr);
-			nerr = 4;
-		} else {
-			/* The actual cross-correlations */
-			CorrectRevesedPolarity (x1, N, Tr, SacHeader1); /* Corrects for sign-flips on a component. */
-			if (fpcc->acc == 0) CorrectRevesedPolarity (x2, N, Tr, SacHeader2);
-			if (fpcc->pcc) {  /* PCCs: */
-				if (fpcc->v==2)      pcc2_set (y, x1, x2, N, Tr, Lag1, Lag2);
-				else if (fpcc->v==1) pcc1_set (y, x1, x2, N, Tr, Lag1, Lag2);
-				else pcc_set (y, x1, x2, N, Tr, fpcc->v, Lag1, Lag2);
-				if (fpcc->oformat==1) 
-					StoreInManySacs (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, nickpcc, fpcc->verbose);
-				else if (fpcc->oformat==2) 
-					StoreInManyBins (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, nickpcc, fpcc->obinprefix, fpcc->verbose);
+		cs.pn   = pn;
+		cs.Nseg = Nseg;
+		cs.pmin = pmin;
+		cs.pmax = pmax;
+		
+		/* One output per window unless they are stacked, dated at the beginning of the window */
+		Tro  = (W && !fpcc->stack) ? Tr*W : Tr;
+		phd1 = SacHeader1;
+		phd2 = SacHeader2;
+		if (Tro > Tr) {
+			hdrw1 = (t_HeaderInfo *)malloc(Tro*sizeof(t_HeaderInfo));
+			hdrw2 = (fpcc->acc) ? hdrw1 : (t_HeaderInfo *)malloc(Tro*sizeof(t_HeaderInfo));
+			if (hdrw1 == NULL || hdrw2 == NULL) {
+				printf ("PCCfullpair_main: Out of memory on the window headers (%u)\n", Tro);
+				if (hdrw2 != hdrw1) free(hdrw2);
+				free(hdrw1);
+				hdrw1 = hdrw2 = NULL;
+				Tro = 0;
+			} else {
+				for (tr=0; tr<Tr; tr++)
+					for (w=0; w<W; w++) {
+						hdrw1[tr*W + w] = SacHeader1[tr];
+						hdrw1[tr*W + w].npts = Nw;
+						ShiftHeaderTime (&hdrw1[tr*W + w], (double)w*Ns*dt);
+						if (hdrw2 == hdrw1) continue;
+						hdrw2[tr*W + w] = SacHeader2[tr];
+						hdrw2[tr*W + w].npts = Nw;
+						ShiftHeaderTime (&hdrw2[tr*W + w], (double)w*Ns*dt);
+					}
+				phd1 = hdrw1;
+				phd2 = hdrw2;
 			}
-			
-			if (fpcc->wpcc) {  /* Wavelet PCCs: */
-				tspcc2_set (y, x1, x2, N, Tr, Lag1, Lag2, pmin, pmax, fpcc->V, fpcc->type, fpcc->op1);
-				if (fpcc->oformat==1) 
-					StoreInManySacs (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, "wpcc2", fpcc->verbose);
-				else if (fpcc->oformat==2) 
-					StoreInManyBins (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, "wpcc2", fpcc->obinprefix, fpcc->verbose); 
-			}			
-
-			if (fpcc->ccgn) {  /* GNCCs */
-				ccgn_set (y, x1, x2, N, Tr, Lag1, Lag2);
-				if (fpcc->oformat==1) 
-					StoreInManySacs (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, "ccgn", fpcc->verbose);
-				else if (fpcc->oformat==2) 
-					StoreInManyBins (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, "ccgn", fpcc->obinprefix, fpcc->verbose);
+		}
+		
+		/* Output array memory. The sac & archive outputs are handed to the writer every WRBATCH  */
+		/* pairs, the bin ones (grouped by channels) once per method, into a second array when    */
+		/* possible.                                                                              */
+		Wo = (Tro > Tr) ? W : 1;  /* Outputs per pair */
+		nc = (Tr + WRBATCH-1)/WRBATCH;
+		ny = (fpcc->oformat == 2) ? 2 : 1;
+		narc = snprintf(arcname, sizeof(arcname), "%s.%s.%s.%s.%s.%s.arc", SacHeader1[0].net, SacHeader1[0].sta, 
+			SacHeader1[0].loc, SacHeader2[0].net, SacHeader2[0].sta, SacHeader2[0].loc);
+		wrt = (fpcc->oformat >= 1 && fpcc->oformat <= 3);
+		
+		/* Time slots of a new tensor: tgrid, or days (windows) from the first day of this run. The */
+		/* correlations are computed straight into the tensor, the scratch y[0] taking the others.  */
+		if (fpcc->oformat == 4 && Tro) {
+			if (fpcc->tslots) {
+				memset(&tm, 0, sizeof(struct tm));
+				tm.tm_year = fpcc->tgrid[0] - 1900;
+				tm.tm_mday = fpcc->tgrid[1];
+				t0    = my_timegm(&tm);
+				tstep = fpcc->tstep;
+				nslot = fpcc->tslots;
+			} else {
+				for (t0=phd1[0].t, tr=1; tr<Tro; tr++)  /* The traces need not be sorted */
+					if (t0 > phd1[tr].t) t0 = phd1[tr].t;
+				t0   -= t0 % 86400;
+				tstep = (Tro > Tr) ? Ns*dt : 86400;
+				for (tr=0; tr<Tro; tr++)
+					if (nslot < difftime(phd1[tr].t, (time_t)t0)/tstep + 1.5) nslot = difftime(phd1[tr].t, (time_t)t0)/tstep + 1.5;
 			}
+		}
+		
+		sq = (unsigned long *)calloc(2*nc, sizeof(unsigned long));
+		if (Tro == 0 || sq == NULL || NULL == (y[0] = Create_FloatArrayList (L, Tro) )) {
+			printf ("PCCfullpair_main: Out of memory on the output array (%d x %d)\n", L, Tro);
+			nerr = 4;
+		} else if (fpcc->oformat == 3 && fpcc->oarcname == NULL && (narc < 0 || (size_t)narc >= sizeof(arcname))) {
+			printf ("PCCfullpair_main: The archive name %s... is too long\n", arcname);
+			Destroy_FloatArrayList (y[0], Tro);
+			nerr = 2;
+		} else if (fpcc->oformat == 3 && NULL == (job.arc = CreateArchive ((fpcc->oarcname) ? fpcc->oarcname : arcname, L, dt, Lag1*dt, fpcc->oenc) )) {
+			Destroy_FloatArrayList (y[0], Tro);
+			nerr = 2;
+		} else if (fpcc->oformat == 4 && (NULL == (yt = (float **)malloc(Tro*sizeof(float *)) ) || 
+				NULL == (ten = OpenTensor ((fpcc->otensor) ? fpcc->otensor : "pcc.tensor", L, dt, Lag1*dt, t0, tstep, nslot) ))) {
+			Destroy_FloatArrayList (y[0], Tro);
+			nerr = 2;
+		} else {
+			if (ny == 2 && NULL == (y[1] = Create_FloatArrayList (L, Tro) )) ny = 1;
+			if (wrt) StartWriter (&wr, WRQUEUE, StoreJob);
+			job.L       = L;
+			job.Lag1    = Lag1;
+			job.dt      = dt;
+			job.oformat = fpcc->oformat;
+			job.prefix  = fpcc->obinprefix;
+			job.verbose = fpcc->verbose;
 			
-			if (fpcc->cc1b) {  /* 1-bit + GNCCs */
-				cc1b_set (y, x1, x2, N, Tr, Lag1, Lag2);
-				if (fpcc->oformat==1) 
-					StoreInManySacs (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, "cc1b", fpcc->verbose);
-				else if (fpcc->oformat==2) 
-					StoreInManyBins (y, L, Tr, Lag1, SacHeader1, SacHeader2, dt, "cc1b", fpcc->obinprefix, fpcc->verbose);
+			/* The actual cross-correlations: PCCs, wavelet PCCs, GNCCs and 1-bit + GNCCs */
+			for (k=0, m=CC_PCC; m<=CC_CC1B; m++) {
+				if (m == CC_PCC)  { if (!fpcc->pcc)  continue; pch = nickpcc; }
+				if (m == CC_WPCC) { if (!fpcc->wpcc) continue; pch = "wpcc2"; }
+				if (m == CC_CCGN) { if (!fpcc->ccgn) continue; pch = "ccgn"; }
+				if (m == CC_CC1B) { if (!fpcc->cc1b) continue; pch = "cc1b"; }
+				yb  = y[k % ny];
+				sqb = sq + (k % ny)*nc;
+				k++;
+				snprintf(job.ccname, 16, "%s", pch);
+				if (ten != NULL) {
+					yb = TensorRows (ten, yt, yb, phd1, phd2, Tro, pch, &c);
+					if (c) printf("PCCfullpair_main: %u %s correlations out of the time slots of the tensor or repeated are not saved\n", c, pch);
+				}
+				
+				nerr1 = 0;
+				for (c=0, tr0=0; tr0<Tr; c++, tr0+=B) {
+					B = (Tr - tr0 < WRBATCH) ? Tr - tr0 : WRBATCH;
+					if (wrt) WriterSync (&wr, sqb[c]);  /* Its rows are free once written. */
+					if (W) nerr2 = Correlate_windows (yb + tr0*Wo, x1 + tr0, x2 + tr0, Nw, Ns, W, B, fpcc->stack, L, Lag1, Lag2, m, fpcc, &cs);
+					else nerr2 = Correlate_set (yb + tr0, x1 + tr0, x2 + tr0, N, B, Lag1, Lag2, m, fpcc, &cs);
+					if (nerr2) {
+						nerr1 = nerr2;
+						if (ten != NULL) TensorRelease (ten, yb + tr0*Wo, phd1 + tr0*Wo, phd2 + tr0*Wo, B*Wo, pch);
+					} else if (fpcc->oformat == 1 || fpcc->oformat == 3) {  /* Not the rows of a failed batch */
+						job.y  = yb + tr0*Wo;
+						job.Tr = B*Wo;
+						job.h1 = phd1 + tr0*Wo;
+						job.h2 = phd2 + tr0*Wo;
+						sqb[c] = WriterSubmit (&wr, &job);
+					}
+				}
+				if (nerr1) printf("PCCfullpair_main: Something went wrong when computing the %s correlations! (nerr = %d)\n", pch, nerr1);
+				
+				if (fpcc->oformat == 2 && !nerr1) {
+					job.y  = yb;
+					job.Tr = Tro;
+					job.h1 = phd1;
+					job.h2 = phd2;
+					sqb[0] = WriterSubmit (&wr, &job);
+					for (c=1; c<nc; c++) sqb[c] = sqb[0];
+				}
 			}
+			if (wrt && (nerr1 = StopWriter (&wr) )) 
+				printf("PCCfullpair_main: %d outputs could not be written!\n", nerr1);
+			if (fpcc->oformat == 3 && CloseArchiveWriter (job.arc)) 
+				printf("PCCfullpair_main: The archive could not be closed!\n");
+			if (ten != NULL && CloseTensor (ten)) 
+				printf("PCCfullpair_main: The tensor could not be closed!\n");
 			
-			Destroy_FloatArrayList (y, Tr);
+			Destroy_FloatArrayList (y[0], Tro);
+			if (ny == 2) Destroy_FloatArrayList (y[1], Tro);
 		}
+		free(sq);
+		free(yt);
+		if (hdrw2 != hdrw1) free(hdrw2);
+		free(hdrw1);
 	}
 
 	Destroy_FloatArrayList (x1, Tr);
@@ -498,6 +773,80 @@ int PCCfullpair_main (t_PCCmatrix *fpcc) {
 	return 0;
 }
 
+/* One correlation method (CC_PCC, CC_WPCC, CC_CCGN or CC_CC1B) of the Tr pairs x1 & x2 of N samples. */
+int Correlate_set (float **y, float **x1, float **x2, unsigned int N, unsigned int Tr, int Lag1, int Lag2, int method, 
+		t_PCCmatrix *fpcc, t_CCsetup *ps) {
+	switch (method) {
+		case CC_PCC:
+			if (fpcc->v==2 && ps->Nseg) return pcc2_ols_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->Nseg);
+			if (fpcc->v==2) return pcc2_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->pn, fpcc->cond.gaps);
+			if (fpcc->v==1) return pcc1_set (y, x1, x2, N, Tr, Lag1, Lag2);
+			return pcc_set (y, x1, x2, N, Tr, fpcc->v, Lag1, Lag2);
+		case CC_WPCC:
+			if (fpcc->wpcc == 2) return tspcc2f_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->pmin, ps->pmax, fpcc->V, fpcc->type, fpcc->op1, fpcc->b0);
+			return tspcc2_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->pmin, ps->pmax, fpcc->V, fpcc->type, fpcc->op1, fpcc->b0);
+		case CC_CCGN:
+			if (ps->Nseg) return ccgn_ols_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->Nseg);
+			return ccgn_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->pn, fpcc->cond.gaps);
+		case CC_CC1B:
+			if (ps->Nseg) return cc1b_ols_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->Nseg);
+			return cc1b_set (y, x1, x2, N, Tr, Lag1, Lag2, ps->pn, fpcc->cond.gaps);
+	}
+	return -1;
+}
+
+/* Correlations of the W windows of Nw samples every Ns samples of the Tr pairs x1 & x2. The windows  */
+/* point into the traces and are correlated as one set of short traces, y having Tr*W traces (window  */
+/* w of pair tr at tr*W + w). stack: y has Tr traces, the mean of the windows of each pair that are   */
+/* not all zeros, computed in batches of about WINBATCH windows.                                     */
+int Correlate_windows (float **y, float **x1, float **x2, unsigned int Nw, unsigned int Ns, unsigned int W, unsigned int Tr, 
+		int stack, unsigned int L, int Lag1, int Lag2, int method, t_PCCmatrix *fpcc, t_CCsetup *ps) {
+	float **x1w, **x2w, **yw, *pf1, *pf2;
+	unsigned int B, b, tr0, w, n, nw;
+	int nerr = 0;
+	
+	B = (stack) ? (WINBATCH + W-1)/W : Tr;  /* Pairs per batch */
+	if (B > Tr) B = Tr;
+	x1w = (float **)malloc(B*W*sizeof(float *));
+	x2w = (float **)malloc(B*W*sizeof(float *));
+	yw  = (stack) ? Create_FloatArrayList (L, B*W) : y;
+	if (x1w == NULL || x2w == NULL || yw == NULL) {
+		printf("Correlate_windows: Out of memory\n");
+		nerr = 4;
+	}
+	
+	for (tr0=0; tr0<Tr && !nerr; tr0+=B) {
+		if (B > Tr-tr0) B = Tr-tr0;
+		for (b=0; b<B; b++)
+			for (w=0; w<W; w++) {
+				x1w[b*W + w] = x1[tr0+b] + w*Ns;
+				x2w[b*W + w] = x2[tr0+b] + w*Ns;
+			}
+		nerr = Correlate_set ((stack) ? yw : y + tr0*W, x1w, x2w, Nw, B*W, Lag1, Lag2, method, fpcc, ps);
+		if (!stack) continue;
+		
+		/* Stack of each pair */
+		for (b=0; b<B; b++) {
+			pf1 = y[tr0+b];
+			memset(pf1, 0, L*sizeof(float));
+			for (nw=0, w=0; w<W; w++) {
+				pf2 = yw[b*W + w];
+				for (n=0; n<L && pf2[n] == 0; n++);
+				if (n == L) continue;  /* All zeros, e.g., a window inside a gap. */
+				for (n=0; n<L; n++) pf1[n] += pf2[n];
+				nw++;
+			}
+			if (nw > 1) 
+				for (n=0; n<L; n++) pf1[n] /= nw;
+		}
+	}
+	
+	free(x1w);
+	free(x2w);
+	if (stack) Destroy_FloatArrayList (yw, B*W);
+	return nerr;
+}
+
 void infooo() {
 	puts("\nThis program computes the geometrically-normalized (CCGN), 1-bit correlation (1-bit CCGN), phase cross-correlations (PCC) and wavelet phase cross-correlation (WPCC) between seismograms from two stations.");
 	puts("I developed this program for Ventosa et al. (2017) and I further developed and presented it in Ventosa et al. (2019) and Ventosa & Schimmel (2003). Information on the PCC is published in Schimmel (1999).\n");
@@ -520,8 +869,8 @@ void usage() {
 	puts("  parameters: in arbitrary order without any blank around '='.");
 	puts("");
 	puts("The traces are paired automatically according to their date and time header information (nzxxx header ");
-	puts("variables) using each trace only in one pair. All traces must have the same begin time (b), number of");
-	puts("samples (nsmpl) and sampling interval.");
+	puts("variables) using each trace only in one pair. All traces must have the same begin time (b) and");
+	puts("sampling interval. Traces shorter than the first one (nsmpl) are zero-padded and masked (see gaps).");
 	puts("");
 	puts("Most commonly used parameters");
 	puts("  nl1=   : starting sample lag. nl1=0 by default.");
@@ -534,26 +883,79 @@ void usage() {
 	puts("  cc1b   : compute 1-bit amplitude normalization followed by ccgn. Not computed by default.");
 	puts("  pcc    : compute phase cross-correlation. Not computed by default.");
 	puts("  wpcc   : compute wavelet phase cross-correlation. Not computed by default.");
+	puts("  wpccf  : as wpcc but computed in single precision, faster and using half the memory.");
 	puts("  v      : pcc power, sum(|a+b|^v - |a+b|^v). Default is v=2");
 	puts("  verbose: ");
 	puts("  info   : write background and main references to screen.");
 	puts("           Just type: PCC_fullpair_1b info.");
 	puts("");
 	puts("Input/Output data format");
-	puts("  isac   : Input traces are in the SAC format (default)");
+	puts("  isac   : Input traces are in the SAC format (default). The filelists can also list miniSEED files (Steim-1,");
+	puts("           Steim-2, integer or float records), each one read as the daily segment of its first channel with the");
+	puts("           gaps as zeros (see gaps). It has no station location, mindist, maxdist & VR are then not used.");
 	puts("  imsacs : Input traces are garthered in two files, one per station, replacing filelist1 and filelist2");
 	puts("           above. Use the Filelist2msacs code to group the sac files in single msac file.");
+	puts("  inv=   : station inventory made by StationInventory from the filelists or msacs files. The locations used");
+	puts("           by mindist, maxdist & VR are then taken from it, and pairs without data at the same time are skipped,");
+	puts("           without opening any data file.");
+	puts("  ingest : Input sac files are read ahead in batches through io_uring, or a pool of pread threads when not");
+	puts("           available, keeping up to 64 files in flight. ingest=uring|pread[,qd] sets the backend and/or the");
+	puts("           queue depth qd. Hides the latency of opening thousands of small files on networked file systems.");
 	puts("  osac   : Output interstation correlations are saved in many files in the SAC format (default)");
 	puts("  obin   : Output interstation correlations are saved in one file to speed up data reading in");
 	puts("           the ts-PWS stacking code, https://github.com/sergiventosa/ts-PWS.  ");
+	puts("  oarc   : Output interstation correlations are appended to a single indexed archive (see ccarchive.h),");
+	puts("           net1.sta1.loc1.net2.sta2.loc2.arc by default, or to the one given by oarc=filename.");
+	puts("  oprec= : precision of the samples of oarc: f32 (default), f16, bf16 or i16 (scaled per correlation).");
+	puts("  otensor: Output interstation correlations are computed straight into a memory mapped network tensor of");
+	puts("           pairs x time slots x lags shared by all the runs, pcc.tensor by default or otensor=name, with the");
+	puts("           index of its pairs in name.idx and the slots written in name.msk (see tensor.h).");
+	puts("  tgrid=YYYY-DDD,step,T : T time slots of step seconds from day DDD of year YYYY of a new tensor (default");
+	puts("           one per day, or per window, from the first day of the run creating it).");
 	puts("");
 	puts("Additional functionalities");
 	puts("  clip   : clip input sequences before the correlations at 4*MAD/0.6745, about 4 sigmas.");
+	puts("  clip=hist : same, estimating the MAD from a histogram in one pass (faster on long traces).");
 	puts("  std=   : remove sequences whose samples have a standard deviation n times higher than average ");
 	puts("           standard deviation of all traces.");
 	puts("  awhite=f1,f2 : smooth spectral whitening in the frequency band f1 - f2 (f1 < f2) using a"); 
-	puts("                 Blackman window of 11 samples.");
+	puts("                 Blackman window of 11 samples. The filter is the inverse of the average spectrum");
+	puts("                 of each station.");
+	puts("  swhite=f1,f2 : spectral whitening of each trace in the band f1 - f2 (f1 < f2). Replaces awhite.");
+	puts("  swtaper=     : width in Hz of the cosine tapers at both sides of the swhite band (default 10% of the band).");
+	puts("  ram=   : running-absolute-mean normalization of each trace with a window of ram seconds, done before");
+	puts("           the whitenings.");
+	puts("  detrend: remove the linear trend of the input sequences.");
+	puts("  taper= : cosine tapers at both ends of the input sequences, as a fraction of their length.");
+	puts("  bp=f1,f2 : zero-phase Butterworth band-pass of the input sequences between f1 and f2 Hz (f1=0: low-pass).");
+	puts("  bporder= : order of the Butterworth filters (default 4).");
+	puts("  dec=   : decimate the input sequences by this factor with an anti-aliasing filter. nl1 & nl2 are then");
+	puts("           given at the decimated sampling. Done in memory after reading, before all the other steps.");
+	puts("  dt=    : resample all the traces to this sampling period (s) while reading them. By default, the");
+	puts("           traces are resampled to the sampling of the first trace of the first station.");
+	puts("  gaps[=n] : runs of n (default 4) or more zeros are taken as data gaps instead of data. They are kept");
+	puts("           as zeros by the conditioning, left out of the std & clip statistics and masked in ccgn, cc1b");
+	puts("           and pcc (v=2), each lag is then normalized on the valid samples that overlap. Gappy traces are");
+	puts("           kept without re-windowing. Not used by ols. Set when some traces are shorter than the others");
+	puts("           (e.g., partial days), which are zero-padded.");
+	puts("  stalta=sta,lta,on,off : mask the transients (e.g., earthquakes) found by a recursive STA/LTA of the");
+	puts("           energy, STA & LTA lengths in seconds, trigger when STA/LTA > on and end when < off (e.g.,");
+	puts("           stalta=2,60,5,1.5). They are zeroed with tapers after the conditioning and then taken as");
+	puts("           gaps (see gaps). The masked fraction of each trace is saved in user0 & user1.");
+	puts("  stalta_dw : down-weight the STA/LTA transients by sqrt(LTA/STA) instead of masking them.");
+	puts("  win=   : correlate windows of win seconds of each trace instead of the whole trace. The windows are");
+	puts("           cut in memory and correlated as one set of short traces. Each window is saved on its own,");
+	puts("           dated at its beginning, unless stack is set.");
+	puts("  step=  : step between the windows in seconds (default win/2).");
+	puts("  stack  : stack the correlations of the windows of each trace (the mean of the ones not all zeros).");
 	puts("  NoAutoPairing: Disables the automatic trace pairing. The traces are paired line per line.\n");
+	puts("  ols    : compute ccgn, cc1b and pcc (v=2) by overlap-save, accumulating the cross-spectra of short");
+	puts("           segments instead of transforming whole traces. Faster for long traces and short lag spans.");
+	puts("  Nseg=  : FFT length of the ols segments (at least twice the lag span). Implies ols. The default is");
+	puts("           about 4 times the lag span.");
+	puts("  b0=    : multirate wpcc, each scale is computed decimated by about b0 times the scale (a power of 2),");
+	puts("           transforming only the band of the wavelet. Faster for broad pmin-pmax ranges. b0=0.25 is");
+	puts("           close to the full rate result. The default is b0=0, all scales at the full rate.");
 	puts("");
 	puts("EXAMPLES");
 	puts("  Computes PCC of power 1 and CCGN between the traces listed in filelist1.txt and filelist2.txt");
@@ -807,6 +1209,21 @@ int StoreInManyBins (float **y, unsigned int L, unsigned int Tr, int Lag1, t_Hea
 	return nerr;
 }
 
+/* Writes the outputs of one job of the writer (see writer.h), from its thread. */
+int StoreJob (t_WriteJob *pj) {
+	unsigned int tr;
+	int nerr = 0, ia1;
+	
+	if (pj->oformat == 3) {
+		for (tr=0; tr<pj->Tr; tr++)
+			if ((ia1 = ArcAppend (pj->arc, pj->y[tr], pj->h1 + tr, pj->h2 + tr, pj->ccname))) nerr = ia1;
+		return nerr;
+	}
+	if (pj->oformat == 1) 
+		return StoreInManySacs (pj->y, pj->L, pj->Tr, pj->Lag1, pj->h1, pj->h2, pj->dt, pj->ccname, pj->verbose);
+	return StoreInManyBins (pj->y, pj->L, pj->Tr, pj->Lag1, pj->h1, pj->h2, pj->dt, pj->ccname, pj->prefix, pj->verbose);
+}
+
 int wrsac(char *filename, char *kinst, float beg, float dt, float *y, int nsamp, t_HeaderInfo *ptr1, t_HeaderInfo *ptr2) {
 	float dummy[nsamp], lag0;
 	int nerr, lcalda=1;
@@ -836,6 +1253,8 @@ int wrsac(char *filename, char *kinst, float beg, float dt, float *y, int nsamp,
 		setkhv ("kevnm",   ptr1->sta,   &nerr, strlen("kevnm"),  (strlen(ptr1->sta) < 8) ? strlen(ptr1->sta) : 8 );
 		setkhv ("kuser1",  ptr1->loc,   &nerr, strlen("kuser1"), (strlen(ptr1->loc) < 8) ? strlen(ptr1->loc) : 8 );
 		setkhv ("kuser2",  ptr1->chn,   &nerr, strlen("kuser2"), (strlen(ptr1->chn) < 8) ? strlen(ptr1->chn) : 8 );
+		setfhv ("user0",  &ptr1->masked, &nerr, strlen("user0"));  /* Fractions masked as transients */
+		setfhv ("user1",  &ptr2->masked, &nerr, strlen("user1"));
 	}
 	setlhv ("lcalda", &lcalda,      &nerr, strlen("lcalda"));
 	setnhv ("nzyear", &ptr1->year,  &nerr, strlen("nzyear"));
@@ -857,52 +1276,6 @@ int wrsac(char *filename, char *kinst, float beg, float dt, float *y, int nsamp,
 	return nerr;
 }
 
-void clipping (float *x, unsigned int N) {
-	float fa1, fa2;
-	unsigned int n;
-	
-	fa1 = 4*qabsmedian(x, N) / 0.6745;
-	for (n=0; n<N; n++) {
-		fa2 = x[n];
-		if (fabsf(fa2) > fa1) 
-			x[n] = (fa2 > fa1) ? fa1 : -fa1;
-	}
-}
-
-int RemoveOutlierTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *Tr0, float *std, float nstd) {
-	unsigned int tr, Tr=*Tr0;
-	float **x = *xOut;
-	float fa1;
-	t_HeaderInfo *phd = *SacHeader;
-	
-	if (std == NULL || xOut == NULL || SacHeader == NULL || Tr0 == NULL) {
-		printf("RemoveOutlierTraces: One required variable is NULL.\n");
-		return 1;
-	}
-	
-	unsigned int nskip;
-	
-	fa1 = qmedian(std, Tr);
-	if (fa1==0) printf("RemoveOutlierTraces: 0 average std!\n");
-	
-	nskip = 0;
-	for (tr=0; tr<Tr; tr++) {
-		if (std[tr] > nstd * fa1) {
-			nskip++;
-			fftw_free(x[tr]); x[tr] = NULL;
-			printf("RemoveOutlierTraces: Skipping %s.%s.%s.%s, the std is %f times the average std!\n", 
-				phd[tr].net, phd[tr].sta, phd[tr].loc, phd[tr].chn, std[tr]/fa1);
-		} else if (nskip > 0) {
-			memcpy (&phd[tr-nskip], &phd[tr], sizeof(t_HeaderInfo));
-			x[tr-nskip] = x[tr];
-		}
-	}
-	Tr -= nskip;
-	*Tr0 = Tr;
-	
-	return 0;
-}
-
 /* Note that considers ms but works at seconds precision. */
 int swap_t_elem(const void *x1, const void *x2) {
 	t_elem *t1 = (t_elem *)x1, *t2 = (t_elem *)x2;
@@ -1041,192 +1414,6 @@ int CheckPairs (t_HeaderInfo *hdr1, unsigned int Tr1, t_HeaderInfo *hdr2, unsign
 	return nerr;
 }
 
-int AveWhite (float **x0, unsigned int N, unsigned int Tr, double freq[2], double dt) {
-	fftw_plan pxX, pXx;
-	double *x, *H, *HS, da1, mn, mx, win[11];
-	float *pf1;
-	fftw_complex *X;
-	unsigned int Nz, Nh, tr, m, M, n, n1, n2;
-	int nerr;
-	
-	Nz = 1 << (unsigned int)ceil(log2(N));
-	Nh = Nz/2 + 1;  /* Number of complex used in r2c & c2r ffts. */
-	x = (double *)fftw_malloc(Nz*sizeof(double));
-	H = (double *)fftw_malloc(Nh*sizeof(double));
-	HS = (double *)fftw_malloc(Nh*sizeof(double));
-	X = (fftw_complex *)fftw_malloc(Nh*sizeof(fftw_complex));
-	if (x != NULL && H != NULL && HS != NULL && X != NULL) {
-		// fftw_init_threads();
-		// fftw_plan_with_nthreads(omp_get_max_threads());
-		
-		pxX  = fftw_plan_dft_r2c_1d(Nz, x, X, FFTW_ESTIMATE); /* The FFT plan  */
-		
-		/** Average absolute spectrum **/
-		for (tr=0; tr<Tr; tr++) {
-			pf1 = x0[tr];
-			for (n=0; n<N;  n++) x[n] = (double)pf1[n];
-			for (n=N; n<Nz; n++) x[n] = 0;
-			fftw_execute(pxX);
-			
-			for (n=0; n<Nh; n++) H[n] += cabs(X[n]);
-		}
-		da1 = 1./(double)Tr;
-		for (n=0; n<Nh; n++) H[n] *= da1;
-		
-		/** Whitening filter **/
-		n1 = freq[0]*dt*(double)Nz;
-		n2 = freq[1]*dt*(double)Nz;
-		da1 = 1./H[n1];
-		for (n=0; n<n1; n++) H[n] = da1;
-		for (   ; n<n2; n++) H[n] = 1./H[n];
-		da1 = 1./H[n2];
-		for (   ; n<Nh; n++) H[n] = da1;
-		
-		/* Max amplification of 100 times of the minimum value. */
-		mn = mx = H[n1];
-		for (n=n1+1; n<n2; n++) {
-			da1 = H[n];
-			if (da1 > mx) mx = da1;
-			else if (da1 < mn) mn = da1;
-		}
-		if (mx > 100*mn) mx = 100*mn;
-		for (n=0; n<Nh; n++)
-			if (H[n] > mx) H[n] = mx;
-		da1 = 1/(mn * (double)Nz); /* 1/mn so min gain is 1, and 1/Nz to normalize the ifft */
-		for (n=0; n<Nh; n++) H[n] *= da1;
-		
-		/* Sprectrum smoothing using the blackman window. */
-		for (m=0; m<11; m++) {
-			da1 = 2*PI*m/(N-1);
-			win[m] = 0.42 - 0.5*cos(da1) + 0.08*cos(2*da1);
-		}
-		da1 = 0;
-		for (m=0; m<11; m++) da1 += win[m];
-		da1 = 1/da1;
-		for (m=0; m<11; m++) win[m] *= da1;
-		
-		/* Convolution with mirroring (DC and Nyquist samples are considered only once) */
-		for (n=5; n<10; n++) {
-			da1 = 0;
-			for (m=0; m<=n; m++) da1 += win[m]*H[n-m];
-			for (   ; m<11; m++) da1 += win[m]*H[m-n];
-			HS[n-5] = da1;
-		}
-		for (n=11; n<Nh; n++) {
-			da1 = 0;
-			for (m=0; m<11; m++) da1 += win[m]*H[n-m];
-			HS[n-5] = da1;
-		}
-		for (n=Nh; n<Nh+5; n++) {
-			da1 = 0;
-			M = n-(Nh-1);
-			for (m=0; m<M;  m++) da1 += win[m]*H[Nh-1+m-M];
-			for (   ; m<11; m++) da1 += win[m]*H[n-m];
-			HS[n-5] = da1;
-		}
-		
-		/** Do the whitening **/
-		pXx = fftw_plan_dft_c2r_1d(Nz, X, x, FFTW_ESTIMATE); /* The IFFT plan */
-		for (tr=0; tr<Tr; tr++) {
-			pf1 = x0[tr];
-			for (n=0; n<N;  n++) x[n] = (double)pf1[n];
-			for (n=N; n<Nz; n++) x[n] = 0;
-			fftw_execute(pxX);
-			for (n=0; n<Nh; n++) X[n] *= HS[n];
-			fftw_execute(pXx);
-			for (n=0; n<N; n++) pf1[n] = (float)x[n];
-		}
-		
-		fftw_destroy_plan(pxX);
-		fftw_destroy_plan(pXx);
-		
-		// fftw_cleanup_threads();
-
-	} 
-	else nerr = -1;
-	
-	fftw_free(X);
-	fftw_free(HS);
-	fftw_free(H);
-	fftw_free(x);
-	
-	return nerr;
-}
-
-float qabsmedian(float input[], int n) {
-	register int i,j,l,m;
-	register float x, t, out, *a;
-	int k = n/2;
-	
-	if (NULL == (a = (float *)malloc(n * sizeof(float)) )) return 0;
-	for (i=0; i<n; i++) a[i] = fabsf(input[i]);
-	
-	l = 0; m = n-1;
-	while (l <m) {
-		x = a[k];
-		i = l; j = m;
-		do {
-			while (a[i] < x) i++;
-			while (x < a[j]) j--;
-			if ( i<=j) {
-				t = a[i]; 
-				a[i] = a[j]; 
-				a[j] = t;
-				i++; j--;
-			}
-		} while (i <= j);
-		if (j < k) l = i;
-		if (k < i) m = j;
-	}
-
-	if (n % 2) out = a[k];
-	else {
-		t = -FLT_MAX;
-		for (i=0; i<k ; i++)
-			if (a[i] <= a[k] && t < a[i]) t = a[i];
-		out = (a[k] + t)/2;
-	}
-	free(a);
-	return out;
-}
-
-float qmedian(float input[], int n) {
-	register int i,j,l,m;
-	register float x, t, out, *a;
-	int k = n/2;
-	
-	if (NULL == (a = (float *)malloc(n * sizeof(float)) )) return 0;
-	for (i=0; i<n; i++) a[i] = input[i];
-	
-	l = 0; m = n-1;
-	while (l <m) {
-		x = a[k];
-		i = l; j = m;
-		do {
-			while (a[i] < x) i++;
-			while (x < a[j]) j--;
-			if ( i<=j) {
-				t = a[i]; 
-				a[i] = a[j]; 
-				a[j] = t;
-				i++; j--;
-			}
-		} while (i <= j);
-		if (j < k) l = i;
-		if (k < i) m = j;
-	}
-
-	if (n % 2) out = a[k];
-	else {
-		t = -FLT_MAX;
-		for (i=0; i<k ; i++)
-			if (a[i] <= a[k] && t < a[i]) t = a[i];
-		out = (a[k] + t)/2;
-	}
-	free(a);
-	return out;
-}
-
 int RDint (int * const x, const char *str) {
 	char *pstr;
 	
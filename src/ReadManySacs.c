@@ -9,17 +9,23 @@
 /*    sample N.                                                              */
 /* Abr13 (1c) The ReadManySacs() now reads only metada when *xOut == NULL    */
 /*****************************************************************************/
+#define _POSIX_C_SOURCE 200809L  /* fseeko & ftruncate */
 
 #include <complex.h>  /* When done before fftw3.h, makes fftw3.h use C99 complex types. */
 #include <fftw3.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <time.h>
 #include <sacio.h>
 #include <string.h>
 #include <math.h>
 #include "ReadManySacs.h"
+#include "resample.h"
+#include "quantize.h"
+#include "ingest.h"
+#include "mseed.h"
 /*
 char *set_utc () {
 	char *tz;
@@ -158,18 +164,82 @@ int ReadLocation (double *lat, double *lon, char *fin) {
 	return nerr;
 }
 
-int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenamesOut[], unsigned int *TrOut, unsigned int *NOut, float *dtOut, char *fin) {
-	t_HeaderInfo *SacHeader=NULL, *phdr1;
-	float **x = NULL, *sig=NULL;
-	float beg, beg1, dt, dt1;
-	unsigned int tr, Tr, N, nskip, npts;
-	int nerr, Nmax, ia1;
-	char **filenames=NULL, *filename=NULL, *pch;
-	/* time_t t1; */
+/* Fills hdr with the fields of the header loaded by rsach or rsac1, but npts, dt & b. */
+int SacioHeader (t_HeaderInfo * const phdr1) {
 	struct tm tm;
+	char *pch;
+	int nerr;
+	
+	/* Get a few more sac header fields */
+	getnhv ("nzyear", &phdr1->year, &nerr, strlen("nzyear"));
+	getnhv ("nzjday", &phdr1->yday, &nerr, strlen("nzjday"));
+	getnhv ("nzhour", &phdr1->hour, &nerr, strlen("nzhour"));
+	getnhv ("nzmin",  &phdr1->min,  &nerr, strlen("nzmin"));
+	getnhv ("nzsec",  &phdr1->sec,  &nerr, strlen("nzsec"));
+	getnhv ("nzmsec", &phdr1->msec, &nerr, strlen("nzmsec"));
+	getkhv ("knetwk",  phdr1->net,  &nerr, strlen("knetwk"), 8); if (nerr) { phdr1->net[0] = '\0'; nerr = 0; }
+	getkhv ("kstnm",   phdr1->sta,  &nerr, strlen("kstnm"),  8); if (nerr) { phdr1->sta[0] = '\0'; nerr = 0; }
+	getkhv ("kcmpnm",  phdr1->chn,  &nerr, strlen("kcmpnm"), 8); if (nerr) { phdr1->chn[0] = '\0'; nerr = 0; }
+	getkhv ("khole",   phdr1->loc,  &nerr, strlen("khole"),  8); if (nerr) { phdr1->loc[0] = '\0'; nerr = 0; }
+	getfhv ("stla",   &phdr1->stla, &nerr, strlen("stla")); if (nerr) { phdr1->nostloc = 1; nerr = 0; }
+	getfhv ("stlo",   &phdr1->stlo, &nerr, strlen("stlo")); if (nerr) { phdr1->nostloc = 1; nerr = 0; }
+	getfhv ("stel",   &phdr1->stel, &nerr, strlen("stel")); if (nerr) { phdr1->stel = 0; nerr = 0; }
+	getfhv ("stdp",   &phdr1->stdp, &nerr, strlen("stdp")); if (nerr) { phdr1->stdp = 0; nerr = 0; }
+	getfhv ("cmpaz",  &phdr1->cmpaz,  &nerr, strlen("cmpaz"));  if (nerr) { phdr1->nocmp = 1; nerr = 0; }
+	getfhv ("cmpinc", &phdr1->cmpinc, &nerr, strlen("cmpinc")); if (nerr) { phdr1->nocmp = 1; nerr = 0; }
+	if ( (pch = memchr(phdr1->net, ' ', 8)) ) pch[0] = '\0';
+	if ( (pch = memchr(phdr1->sta, ' ', 8)) ) pch[0] = '\0';
+	if ( (pch = memchr(phdr1->chn, ' ', 8)) ) pch[0] = '\0';
+	if ( (pch = memchr(phdr1->loc, ' ', 8)) ) pch[0] = '\0';
+	if ( !strncmp(phdr1->loc, SAC_CHAR_UNDEFINED, 6) ) phdr1->loc[0] = '\0';
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year  = phdr1->year-1900;
+	tm.tm_mon   = 0;
+	tm.tm_mday  = phdr1->yday;
+	tm.tm_hour  = phdr1->hour;
+	tm.tm_min   = phdr1->min;
+	tm.tm_sec   = phdr1->sec;
+	tm.tm_isdst = 0;
+	/* phdr1->t    = utc_mktime(&tm); */
+	phdr1->t    = my_timegm(&tm);
+	return nerr;
+}
+
+/* Reads filename with the sac library, its header into hdr and up to Nsig samples into sig  */
+/* (the header only when sig is NULL), or as a miniSEED file when it is not a sac file.      */
+int SacioRead (t_HeaderInfo * const hdr, float * const sig, int Nsig, char *filename) {
+	float beg, dt;
+	int npts, nerr, merr;
+	
+	memset(hdr, 0, sizeof(t_HeaderInfo));
+	if (sig != NULL) rsac1(filename, sig, &npts, &beg, &dt, &Nsig, &nerr, strlen(filename));
+	else {
+		rsach (filename, &nerr, strlen(filename));
+		if (!nerr) getnhv ("npts",  &npts, &nerr, strlen("npts"));
+		if (!nerr) getfhv ("delta", &dt,   &nerr, strlen("delta"));
+		if (!nerr) getfhv ("b",     &beg,  &nerr, strlen("b"));
+	}
+	if (nerr > 0) {  /* < 0: warnings, e.g., the sequence is cut */
+		if ( !(merr = ReadMseed (hdr, sig, Nsig, filename)) ) return 0;
+		if (merr > 1) printf ("ReadManySacs: cannot decode the miniSEED file %s (MseedParse error = %d)\n", filename, merr);
+		return nerr;
+	}
+	hdr->npts = npts;
+	hdr->dt   = dt;
+	hdr->b    = beg;
+	return SacioHeader (hdr);
+}
+
+/* *dtOut: on input, sampling period the traces are resampled to when > 0, otherwise the one */
+/* of the first file. *NOut: on input, number of samples at that sampling (0: first file).   */
+/* Shorter traces are zero-padded, their npts header being the number of valid samples.      */
+int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenamesOut[], unsigned int *TrOut, unsigned int *NOut, float *dtOut, char *fin) {
+	char **filenames=NULL;
+	unsigned int Tr;
+	int nerr;
 	
 	*TrOut = 0;
-	// *xOut  = NULL;
 	*SacHeaderOut = NULL;
 	
 	if (fin == NULL) {printf("ReadManySacs: NULL filename\n"); return -1;}
@@ -185,21 +255,49 @@ int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames
 		return -2;
 	}
 	
-	if (NULL == (SacHeader = (t_HeaderInfo *)calloc(Tr, sizeof(t_HeaderInfo)) )) {
-		DestroyFilelist(filenames);
-		return 4;
-	}
+	nerr = ReadSacFiles (xOut, SacHeaderOut, filenames, Tr, TrOut, NOut, dtOut);
+	if (filenamesOut != NULL && !nerr) *filenamesOut = filenames;
+	else DestroyFilelist(filenames);
+	return nerr;
+}
+
+/* ReadManySacs of the Tr files filenames[]. */
+int ReadSacFiles (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames, unsigned int Tr, unsigned int *TrOut, unsigned int *NOut, float *dtOut) {
+	t_HeaderInfo *SacHeader=NULL, *phdr1, hdr0;
+	t_Resampler *pr = NULL;
+	t_Ingest *pin = NULL;
+	float **x = NULL, *sig=NULL, *pf1;
+	float beg, beg1, dt, dt1, dtT;
+	unsigned int tr, N, nskip, npts, Nin, p, q;
+	int nerr = 0, Nmax, Nsig, ia1;
+	char *filename=NULL;
+	
+	*TrOut = 0;
+	*SacHeaderOut = NULL;
+	
+	if (NULL == (SacHeader = (t_HeaderInfo *)calloc(Tr, sizeof(t_HeaderInfo)) )) return 4;
+	
+	/* Read ahead the files in batches when set by SetIngest (NULL: one by one with the sac library). */
+	pin = StartIngest (filenames, Tr, xOut == NULL);
 	
 	/* Read the header of the first file. */
 	filename = filenames[0];
-	rsach (filename, &nerr,  strlen(filename));       if (nerr) return nerr_print (filename, nerr);
-	getnhv ("npts",  &Nmax,   &nerr, strlen("npts")); if (nerr) return nerr_print (filename, nerr);
-	N = (*NOut == 0) ? (unsigned)Nmax : *NOut;
-	getfhv ("delta", &dt1,   &nerr, strlen("delta")); if (nerr) return nerr_print (filename, nerr);
-	getfhv ("b",     &beg1,  &nerr, strlen("b"));     if (nerr) return nerr_print (filename, nerr);
+	if (pin != NULL) {
+		if (IngestSac (pin, 0, &hdr0, NULL, 0)) { StopIngest(pin); return 2; }
+		Nmax = hdr0.npts;
+		dt1  = hdr0.dt;
+		beg1 = hdr0.b;
+	} else {
+		if ( (nerr = SacioRead (&hdr0, NULL, 0, filename)) ) return nerr_print (filename, nerr);
+		Nmax = hdr0.npts;
+		dt1  = hdr0.dt;
+		beg1 = hdr0.b;
+	}
+	dtT = (*dtOut > 0) ? *dtOut : dt1;  /* Target sampling period */
+	N = (*NOut == 0) ? (unsigned)floor(Nmax*(double)dt1/dtT + 1e-3) : *NOut;
 	
 	/* Allocate memory for the input traces */
-	Nmax = N;
+	Nsig = N;
 	if (xOut != NULL) {
 		if (NULL == (x = Create_FloatArrayList (N, Tr) )) nerr = 4;
 		if (NULL == (sig = (float *)calloc(N, sizeof(float)) )) nerr = 4;
@@ -207,7 +305,7 @@ int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames
 			Destroy_FloatArrayList(x, Tr);
 			free(sig);
 			free(SacHeader);
-			DestroyFilelist(filenames);
+			StopIngest(pin);
 			return nerr_OutOfMem_print (filename, N);
 		}
 	}
@@ -218,79 +316,49 @@ int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames
 	nskip = 0;
 	for (tr=0; tr<Tr; tr++) {
 		filename = filenames[tr];
+		phdr1 = &SacHeader[tr-nskip];
 		// Not supported from v102.0
 		// sac_warning_off ();
 
-		if (xOut != NULL)
-			rsac1(filename, sig, &ia1, &beg, &dt, &Nmax, &nerr, strlen(filename));
-		else {
-			rsach (filename, &nerr, strlen(filename));       if (nerr) return nerr_print (filename, nerr);
-			getnhv ("npts",  &ia1,  &nerr, strlen("npts"));  if (nerr) return nerr_print (filename, nerr);
-			getfhv ("delta", &dt,   &nerr, strlen("delta")); if (nerr) return nerr_print (filename, nerr);
-			getfhv ("b",     &beg,  &nerr, strlen("b"));     if (nerr) return nerr_print (filename, nerr);
-		}
-		
-		npts = (unsigned)ia1;
-		phdr1 = &SacHeader[tr-nskip];
-		phdr1->b     = beg;
-		phdr1->dt    = dt;
-		phdr1->npts  = ia1;
-
-		/* Get a few more sac header fields */
-		getnhv ("nzyear", &phdr1->year, &nerr, strlen("nzyear"));
-		getnhv ("nzjday", &phdr1->yday, &nerr, strlen("nzjday"));
-		getnhv ("nzhour", &phdr1->hour, &nerr, strlen("nzhour"));
-		getnhv ("nzmin",  &phdr1->min,  &nerr, strlen("nzmin"));
-		getnhv ("nzsec",  &phdr1->sec,  &nerr, strlen("nzsec"));
-		getnhv ("nzmsec", &phdr1->msec, &nerr, strlen("nzmsec"));
-		getkhv ("knetwk",  phdr1->net,  &nerr, strlen("knetwk"), 8); if (nerr) { phdr1->net[0] = '\0'; nerr = 0; }
-		getkhv ("kstnm",   phdr1->sta,  &nerr, strlen("kstnm"),  8); if (nerr) { phdr1->sta[0] = '\0'; nerr = 0; }
-		getkhv ("kcmpnm",  phdr1->chn,  &nerr, strlen("kcmpnm"), 8); if (nerr) { phdr1->chn[0] = '\0'; nerr = 0; }
-		getkhv ("khole",   phdr1->loc,  &nerr, strlen("khole"),  8); if (nerr) { phdr1->loc[0] = '\0'; nerr = 0; }
-		getfhv ("stla",   &phdr1->stla, &nerr, strlen("stla")); if (nerr) { phdr1->nostloc = 1; nerr = 0; }
-		getfhv ("stlo",   &phdr1->stlo, &nerr, strlen("stlo")); if (nerr) { phdr1->nostloc = 1; nerr = 0; }
-		getfhv ("stel",   &phdr1->stel, &nerr, strlen("stel")); if (nerr) { phdr1->stel = 0; nerr = 0; }
-		getfhv ("stdp",   &phdr1->stdp, &nerr, strlen("stdp")); if (nerr) { phdr1->stdp = 0; nerr = 0; }
-		getfhv ("cmpaz",  &phdr1->cmpaz,  &nerr, strlen("cmpaz"));  if (nerr) { phdr1->nocmp = 1; nerr = 0; }
-		getfhv ("cmpinc", &phdr1->cmpinc, &nerr, strlen("cmpinc")); if (nerr) { phdr1->nocmp = 1; nerr = 0; }
-		if ( (pch = memchr(phdr1->net, ' ', 8)) ) pch[0] = '\0';
-		if ( (pch = memchr(phdr1->sta, ' ', 8)) ) pch[0] = '\0';
-		if ( (pch = memchr(phdr1->chn, ' ', 8)) ) pch[0] = '\0';
-		if ( (pch = memchr(phdr1->loc, ' ', 8)) ) pch[0] = '\0';
-		if ( !strncmp(phdr1->loc, SAC_CHAR_UNDEFINED, 6) ) phdr1->loc[0] = '\0';
-		
-		memset(&tm, 0, sizeof(tm));
-		tm.tm_year  = phdr1->year-1900;
-		tm.tm_mon   = 0;
-		tm.tm_mday  = phdr1->yday;
-		tm.tm_hour  = phdr1->hour;
-		tm.tm_min   = phdr1->min;
-		tm.tm_sec   = phdr1->sec;
-		tm.tm_isdst = 0;
-		/* phdr1->t    = utc_mktime(&tm); */
-		phdr1->t    = my_timegm(&tm);
-		
-		if (nerr) {
+		if (pin != NULL) {
+			if (IngestSac (pin, tr, phdr1, (x != NULL) ? sig : NULL, Nsig)) { StopIngest(pin); return -2; }
+		} else if ( (nerr = SacioRead (phdr1, (x != NULL) ? sig : NULL, Nsig, filename)) ) {
 			printf ("ReadManySacs: ERROR reading the %s file (rsac1, nerr=%d)\n", filename, nerr);
 			return -2;
 		}
+		ia1 = phdr1->npts;
+		beg = phdr1->b;
+		dt  = phdr1->dt;
+		
+		npts = (unsigned)ia1;
+		phdr1->dt    = dtT;
 
-		if (npts < N) {
-			printf ("ReadManySacs: Files having too short sequences are not supported yet (%d:%d, %s)\n", N, npts, filename);
-			printf ("ReadManySacs: Skipping trace %u\n", tr);
-			nskip += 1;
-			continue;
-		} else if (npts > N) {
-			printf ("ReadManySacs: WARNING: Files having too long sequences are cut (%d:%d, %s)\n", N, npts, filename);
-			phdr1->npts = N;
+		/* Sampling rate */
+		pr  = NULL;
+		Nin = N;  /* Samples needed at the sampling of the file */
+		if (fabs(dt-dtT) > dtT*0.001) {
+			if (Resampling_ratio (&p, &q, dt, dtT) || NULL == (pr = GetResampler (p, q) )) {
+				printf ("ReadManySacs: Different sampling rate that cannot be resampled!!! (%f:%f, %s)\n", dtT, dt, filename);
+				printf ("ReadManySacs: Skipping trace %u\n", tr);
+				nskip += 1;
+				continue;
+			}
+			Nin = (unsigned int)(((unsigned long)N*q + p-1)/p);
 		}
 		
-		if (fabs(dt-dt1) > dt1*0.001) {
-			printf ("ReadManySacs: Different sampling rate!!! (%f:%f, %s)\n", dt1, dt, filename);
-			printf ("ReadManySacs: Skipping trace %u\n", tr);
+		if (npts == 0) {
+			printf ("ReadManySacs: Empty file, skipping trace %u (%s)\n", tr, filename);
 			nskip += 1;
 			continue;
+		} else if (npts < Nin) {
+			printf ("ReadManySacs: WARNING: Files having too short sequences are zero-padded (%d:%d, %s)\n", Nin, npts, filename);
+		} else if (npts > Nin) {
+			printf ("ReadManySacs: WARNING: Files having too long sequences are cut (%d:%d, %s)\n", Nin, npts, filename);
 		}
+		/* Valid samples, the ones after them are zeros (see ShortTraces) */
+		if (npts >= Nin) phdr1->npts = N;
+		else phdr1->npts = (pr != NULL) ? (unsigned int)((unsigned long)npts*p/q) : npts;
+		
 		if (fabs(beg1-beg) > dt1) {
 			printf ("ReadManySacs: Different beginning time!!! (%f:%f, %s)\n", beg1, beg, filename);
 			printf ("ReadManySacs: Skipping trace %u\n", tr);
@@ -298,10 +366,30 @@ int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames
 			continue;
 		}
 		
-		/* Copy the data */
-		if (x != NULL && sig != NULL) memcpy(x[tr-nskip], sig, N*sizeof(float));
+		/* Copy the data, resampled when needed. Reread when sig was too short. */
+		if (x != NULL && sig != NULL) {
+			if (Nin > (unsigned)Nsig) {
+				if (NULL == (pf1 = (float *)realloc(sig, Nin*sizeof(float)) )) {
+					printf ("ReadManySacs: Out of memory, skipping trace %u\n", tr);
+					nskip += 1;
+					continue;
+				}
+				sig  = pf1;
+				Nsig = Nin;
+				if (pin != NULL) nerr = IngestSac (pin, tr, &hdr0, sig, Nsig);
+				else nerr = SacioRead (&hdr0, sig, Nsig, filename);
+				if (nerr > 0) {  /* < 0: warnings, e.g., the sequence is cut */
+					printf ("ReadManySacs: ERROR reading the %s file (rsac1, nerr=%d)\n", filename, nerr);
+					return -2;
+				}
+			}
+			if (npts < Nin) memset(sig + npts, 0, (Nin - npts)*sizeof(float));
+			if (pr != NULL) Resample (x[tr-nskip], N, sig, Nin, pr);
+			else memcpy(x[tr-nskip], sig, N*sizeof(float));
+		}
 	}
 	Tr -= nskip;
+	StopIngest(pin);
 	
 	/* Clean up */
 	if (x != NULL) {
@@ -311,18 +399,37 @@ int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames
 		}
 	}
 	if (sig != NULL) free(sig);
-	if (filenamesOut != NULL) *filenamesOut = filenames;
-	else DestroyFilelist(filenames);
 	
 	*TrOut = Tr;
 	*NOut  = N;
-	*dtOut = dt1;
+	*dtOut = dtT;
 	if (xOut != NULL) *xOut  = x;
 	*SacHeaderOut = SacHeader;
 	
 	return 0;
 }
 
+/* Headers of the Tr files filenames[], read ahead in batches when set by SetIngest. The ones */
+/* that cannot be read get npts = 0. Returns their number.                                    */
+unsigned int ReadSacHeaders (t_HeaderInfo * const hdr, char **filenames, const unsigned int Tr) {
+	t_Ingest *pin;
+	unsigned int tr, nbad = 0;
+	int nerr;
+	
+	pin = StartIngest (filenames, Tr, 1);
+	for (tr=0; tr<Tr; tr++) {
+		memset(&hdr[tr], 0, sizeof(t_HeaderInfo));
+		if (pin != NULL) nerr = IngestSac (pin, tr, &hdr[tr], NULL, 0);
+		else if ( (nerr = SacioRead (&hdr[tr], NULL, 0, filenames[tr])) ) nerr_print (filenames[tr], nerr);
+		if (nerr) {
+			hdr[tr].npts = 0;
+			nbad++;
+		}
+	}
+	StopIngest(pin);
+	return nbad;
+}
+
 int ReadManySacs_WithDiffLength (float **xOut[], t_HeaderInfo *SacHeaderOut[], unsigned int *TrOut, char *fin) {
 	t_HeaderInfo *SacHeader=NULL, *phdr1;
 	float **x = NULL, *sig=NULL;
@@ -526,6 +633,22 @@ int CreateFilelist (char **filename[], unsigned int *Tr, char *filelist) {
 	return er;
 }
 
+/* Moves the reference time of a header s >= 0 seconds forward: t, msec and the date fields. */
+void ShiftHeaderTime (t_HeaderInfo * const hdr, const double s) {
+	struct tm *ptm;
+	long ms;
+	
+	ms = hdr->msec + lround(1000*s);
+	hdr->t   += ms/1000;
+	hdr->msec = ms%1000;
+	if (NULL == (ptm = gmtime(&hdr->t) )) return;
+	hdr->year = ptm->tm_year + 1900;
+	hdr->yday = ptm->tm_yday + 1;
+	hdr->hour = ptm->tm_hour;
+	hdr->min  = ptm->tm_min;
+	hdr->sec  = ptm->tm_sec;
+}
+
 int RemoveZeroTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *pTr, unsigned int N) {
 	unsigned int tr, n, nskip;
 	int ia1;
@@ -558,10 +681,74 @@ int RemoveZeroTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *p
 	return 0;
 }
 
+/* Number of the Tr traces of N samples having less valid samples (npts), zero-padded. */
+unsigned int ShortTraces (const t_HeaderInfo * const hdr, const unsigned int Tr, const unsigned int N) {
+	unsigned int tr, n = 0;
+	
+	for (tr=0; tr<Tr; tr++) if ((unsigned)hdr[tr].npts < N) n++;
+	return n;
+}
+
+/* Reads the headers of the msacs file fid (MSACS1 or MSACS2, ehdr->enc being ENC_F32 for MSACS1) */
+/* and returns the offsets of its nseq sequences, read from the index when their lengths differ   */
+/* (npts = 0). *pend: end of the sequences, where the appended ones start. NULL on error.         */
+int64_t *ManySacsLayout (FILE *fid, t_HeaderManySacsBinary *mhdr, t_HeaderManySacsEnc *ehdr, int64_t *pend, char *infile) {
+	int64_t *offset, off, rec;
+	unsigned int tr, Tr;
+	
+	ehdr->enc = ENC_F32;
+	ehdr->reserved = 0;
+	if (1 != fread(mhdr, sizeof(t_HeaderManySacsBinary), 1, fid)) {
+		printf("ReadManySacsFile: cannot read %s file.\n", infile);
+		return NULL;
+	}
+	off = sizeof(t_HeaderManySacsBinary);
+	if (!strcmp(mhdr->FormatID, "MSACS2")) {
+		if (1 != fread(ehdr, sizeof(t_HeaderManySacsEnc), 1, fid) || ehdr->enc < ENC_F32 || ehdr->enc > ENC_I16) {
+			printf("ReadManySacsFile: %s has an unknown encoding.\n", infile);
+			return NULL;
+		}
+		off += sizeof(t_HeaderManySacsEnc);
+	} else if (strcmp(mhdr->FormatID, "MSACS1")) {
+		printf("ReadManySacsFile: %s is not in MSACS1 or MSACS2 format.\n", infile);
+		return NULL;
+	}
+	if (mhdr->nseq < 0 || mhdr->npts < 0) {
+		printf("ReadManySacsFile: %s has a wrong header.\n", infile);
+		return NULL;
+	}
+	Tr = mhdr->nseq;
+	if (NULL == (offset = (int64_t *)malloc((Tr+1)*sizeof(int64_t)) )) {
+		printf("ReadManySacsFile: Out of memory when reading %s.\n", infile);
+		return NULL;
+	}
+	
+	if (mhdr->npts) {
+		rec = sizeof(t_HeaderInfo) + ((ehdr->enc != ENC_F32) ? sizeof(float) : 0) + (int64_t)mhdr->npts*EncSize(ehdr->enc);
+		for (tr=0; tr<Tr; tr++) offset[tr] = off + tr*rec;
+		*pend = off + Tr*rec;
+	} else {  /* The index is at the end of the file */
+		if (fseeko(fid, 0, SEEK_END) || (*pend = (int64_t)ftello(fid) - Tr*(int64_t)sizeof(int64_t)) < off ||
+				fseeko(fid, (off_t)*pend, SEEK_SET) || Tr != fread(offset, sizeof(int64_t), Tr, fid)) {
+			printf("ReadManySacsFile: Unexpected end of %s.\n", infile);
+			free(offset);
+			return NULL;
+		}
+	}
+	return offset;
+}
+
+/* *dtOut: on input, sampling period the traces are resampled to when > 0. The traces of */
+/* files with different lengths are zero-padded to the longest one, their npts header    */
+/* being the number of valid samples.                                                    */
 int Read_ManySacsFile (float **xOut[], t_HeaderInfo *SacHeaderOut[], unsigned int *TrOut, unsigned int *NOut, float *dtOut, char *infile) {
 	t_HeaderManySacsBinary mhdr;
+	t_HeaderManySacsEnc ehdr;
 	t_HeaderInfo *SacHeader = NULL;
-	float **x = NULL;
+	float **x = NULL, scale;
+	float dtT = *dtOut;
+	void *q = NULL;
+	int64_t *offset, end;
 	unsigned int tr, Tr, N, npts;
 	size_t nitems;
 	int nerr = 0;
@@ -571,53 +758,65 @@ int Read_ManySacsFile (float **xOut[], t_HeaderInfo *SacHeaderOut[], unsigned in
 		printf("ReadManySacsFile: cannot open %s file\n", infile);
 		return -2;
 	}
-	
-	nitems = fread(&mhdr, sizeof(t_HeaderManySacsBinary), 1, fid);
-	if (nitems != 1) {
-		printf("ReadManySacsFile: cannot read %s file.\n", infile);
-		return -2;
-	}
-	
-	if (mhdr.npts == 0) {
-		printf("ReadManySacsFile: %s has traces with different lengths, to be eventually done.\n", infile);
-		return -2;
-	}
-	if (strcmp(mhdr.FormatID, "MSACS1")) {
-		printf("ReadManySacsFile: %s is not in MSACS1 format.\n", infile);
+	if (NULL == (offset = ManySacsLayout (fid, &mhdr, &ehdr, &end, infile) )) {
+		fclose(fid);
 		return -2;
 	}
 	Tr = mhdr.nseq;
 	N  = mhdr.npts;
 	
 	if (NULL == (SacHeader = (t_HeaderInfo *)calloc(Tr, sizeof(t_HeaderInfo)) )) nerr = 4;
-	if (NULL == (x = Create_FloatArrayList (N, Tr) )) nerr = 4;
+	else if (N == 0) {  /* Different lengths: the headers first, to get the longest one. */
+		for (tr=0; tr<Tr; tr++) {
+			if (fseeko(fid, (off_t)offset[tr], SEEK_SET) || 1 != fread(&SacHeader[tr], sizeof(t_HeaderInfo), 1, fid)) {
+				printf("ReadManySacsFile: Unexpected end of %s.\n", infile);
+				nerr = 5; break;
+			}
+			if (N < (unsigned)SacHeader[tr].npts) N = SacHeader[tr].npts;
+		}
+	}
+	if (!nerr && NULL == (x = Create_FloatArrayList (N, Tr) )) nerr = 4;
+	if (!nerr && ehdr.enc != ENC_F32 && NULL == (q = malloc(N*EncSize(ehdr.enc)) )) nerr = 4;
 	
 	if (nerr == 4) {
 		printf("ReadManySacsFile: Out of memory when reading %s.\n", infile);
-	} else {
+	} else if (!nerr) {
 		for (tr=0; tr<Tr; tr++) {
-			nitems = fread(&SacHeader[tr], sizeof(t_HeaderInfo), 1, fid);
+			if (fseeko(fid, (off_t)offset[tr], SEEK_SET)) nitems = 0;
+			else nitems = fread(&SacHeader[tr], sizeof(t_HeaderInfo), 1, fid);
 			if (nitems != 1) { 
 				printf("ReadManySacsFile: Unexpected end of %s.\n", infile);
 				nerr = 5; break;
 			}
+			SacHeader[tr].masked = 0;  /* Padding in the files written before it existed */
 			npts = SacHeader[tr].npts;
 			if (N < npts) npts = N;
-			nitems = fread(x[tr], sizeof(float), npts, fid);
+			if (ehdr.enc == ENC_F32) nitems = fread(x[tr], sizeof(float), npts, fid);
+			else if (1 == fread(&scale, sizeof(float), 1, fid)) {
+				nitems = fread(q, EncSize(ehdr.enc), npts, fid);
+				DecodeSamples (x[tr], q, nitems, ehdr.enc, scale);
+			} else nitems = 0;
 			if (nitems != npts) { 
 				printf("ReadManySacsFile: Unexpected end of %s.\n", infile);
 				nerr = 5; break;
 			}
+			if (npts < N) memset(x[tr] + npts, 0, (N - npts)*sizeof(float));
 		}
 	}
 	
+	fclose(fid);
+	free(offset);
+	free(q);
+	
+	if (!nerr && dtT > 0 && fabs(SacHeader[0].dt - dtT) > dtT*0.001) 
+		nerr = Resample_FloatArrayList (&x, SacHeader, Tr, &N, dtT);
+	
 	if (nerr) {
 		free(SacHeader);
 		Destroy_FloatArrayList (x, Tr);
+		return nerr;
 	}
 	
-	fclose(fid);
-	
 	*TrOut = Tr;
 	*NOut  = N;
 	*dtOut = SacHeader[0].dt;
@@ -627,27 +826,250 @@ int Read_ManySacsFile (float **xOut[], t_HeaderInfo *SacHeaderOut[], unsigned in
 	return nerr;
 }
 
-int Write_ManySacsFile (float *x[], t_HeaderInfo *hdr, unsigned int Tr, unsigned int N, char *outfile) {
+/* Headers of the msacs file infile, their longest npts in *NOut & the encoding in *enc. */
+/* Returns -1 when infile cannot be opened, e.g., it does not exist yet.                */
+int Read_ManySacsHeaders (t_HeaderInfo *SacHeaderOut[], unsigned int *TrOut, unsigned int *NOut, int *enc, char *infile) {
+	t_HeaderManySacsBinary mhdr;
+	t_HeaderManySacsEnc ehdr;
+	t_HeaderInfo *SacHeader;
+	int64_t *offset, end;
+	unsigned int tr, N;
+	int nerr = 0;
+	FILE *fid;
+	
+	*SacHeaderOut = NULL;
+	*TrOut = 0;
+	if (NULL == (fid = fopen(infile, "r"))) return -1;
+	if (NULL == (offset = ManySacsLayout (fid, &mhdr, &ehdr, &end, infile) )) {
+		fclose(fid);
+		return -2;
+	}
+	N = mhdr.npts;
+	if (NULL == (SacHeader = (t_HeaderInfo *)calloc(mhdr.nseq + 1, sizeof(t_HeaderInfo)) )) {
+		printf("ReadManySacsFile: Out of memory when reading %s.\n", infile);
+		nerr = 4;
+	} else {
+		for (tr=0; tr<(unsigned)mhdr.nseq; tr++) {
+			if (fseeko(fid, (off_t)offset[tr], SEEK_SET) || 1 != fread(&SacHeader[tr], sizeof(t_HeaderInfo), 1, fid)) {
+				printf("ReadManySacsFile: Unexpected end of %s.\n", infile);
+				nerr = 5; break;
+			}
+			SacHeader[tr].masked = 0;
+			if (N < (unsigned)SacHeader[tr].npts) N = SacHeader[tr].npts;
+		}
+	}
+	fclose(fid);
+	free(offset);
+	if (nerr) {
+		free(SacHeader);
+		return nerr;
+	}
+	*SacHeaderOut = SacHeader;
+	*TrOut = mhdr.nseq;
+	*NOut  = N;
+	*enc   = ehdr.enc;
+	return 0;
+}
+
+/* Resamples the Tr traces of N samples sampled at hdr[0].dt to dtT, in parallel. Updates N & hdr. */
+int Resample_FloatArrayList (float **xOut[], t_HeaderInfo *hdr, unsigned int Tr, unsigned int *pN, float dtT) {
+	t_Resampler *pr;
+	float **x = *xOut, **y;
+	unsigned int p, q, tr, N = *pN, Ny;
+	int itr;
+	
+	if (Resampling_ratio (&p, &q, hdr[0].dt, dtT)) {
+		printf("Resample_FloatArrayList: Cannot resample from %f to %f\n", hdr[0].dt, dtT);
+		return -2;
+	}
+	if (NULL == (pr = GetResampler (p, q) )) return 4;
+	Ny = (unsigned int)((unsigned long)N*p/q);
+	if (NULL == (y = Create_FloatArrayList (Ny, Tr) )) return 4;
+	
+	#pragma omp parallel for schedule(static)
+	for (itr=0; itr<Tr; itr++) 
+		Resample (y[itr], Ny, x[itr], N, pr);
+	
+	for (tr=0; tr<Tr; tr++) {
+		hdr[tr].dt   = dtT;
+		hdr[tr].npts = (hdr[tr].npts < N) ? (unsigned int)((unsigned long)hdr[tr].npts*p/q) : Ny;
+	}
+	Destroy_FloatArrayList (x, Tr);
+	*xOut = y;
+	*pN   = Ny;
+	return 0;
+}
+
+/* Writes the Tr traces of N samples in the MSACS1 format (enc = ENC_F32) or in the MSACS2 */
+/* format with the samples encoded by enc (see quantize.h), reporting the error. Only the  */
+/* hdr[tr].npts valid samples of the shorter traces are written, with an offset index.    */
+int Write_ManySacsFile (float *x[], t_HeaderInfo *hdr, unsigned int Tr, unsigned int N, char *outfile, int enc) {
 	t_HeaderManySacsBinary mhdr = {"MSACS1", Tr, N, 1};
-	unsigned int tr;
+	t_HeaderManySacsEnc ehdr = {enc, 0};
+	unsigned int tr, n;
+	double err, emean = 0, emax = 0;
+	float scale;
+	void *q = NULL;
+	int64_t *offset = NULL, off;
 	FILE *fid;
 	
+	for (tr=0; tr<Tr; tr++) if ((unsigned)hdr[tr].npts < N) break;
+	if (tr < Tr) {  /* Different lengths */
+		if (NULL == (offset = (int64_t *)malloc(Tr*sizeof(int64_t)) )) {
+			printf("WriteManySacsFile: Out of memory\n");
+			return 4;
+		}
+		mhdr.npts = 0;
+		off = sizeof(t_HeaderManySacsBinary) + ((enc != ENC_F32) ? sizeof(t_HeaderManySacsEnc) : 0);
+		for (tr=0; tr<Tr; tr++) {
+			offset[tr] = off;
+			n = ((unsigned)hdr[tr].npts < N) ? (unsigned)hdr[tr].npts : N;
+			off += sizeof(t_HeaderInfo) + ((enc != ENC_F32) ? sizeof(float) : 0) + (int64_t)n*EncSize(enc);
+		}
+	}
+	if (enc != ENC_F32) {
+		strcpy(mhdr.FormatID, "MSACS2");
+		if (NULL == (q = malloc(N*EncSize(enc)) )) {
+			printf("WriteManySacsFile: Out of memory\n");
+			free(offset);
+			return 4;
+		}
+	}
 	if (NULL == (fid = fopen(outfile, "w"))) {
 		printf("WriteManySacsFile: cannot create %s file\n", outfile);
+		free(offset);
+		free(q);
 		return -2;
 	}
 	
 	fwrite(&mhdr, sizeof(t_HeaderManySacsBinary), 1, fid);
+	if (enc != ENC_F32) fwrite(&ehdr, sizeof(t_HeaderManySacsEnc), 1, fid);
 	for (tr=0; tr<Tr; tr++) {
+		n = (offset != NULL && (unsigned)hdr[tr].npts < N) ? (unsigned)hdr[tr].npts : N;
 		fwrite(&hdr[tr], sizeof(t_HeaderInfo), 1, fid);
-		fwrite(x[tr], sizeof(float), N, fid);
+		if (enc == ENC_F32) fwrite(x[tr], sizeof(float), n, fid);
+		else {
+			scale = EncodeSamples (q, x[tr], n, enc, &err);
+			fwrite(&scale, sizeof(float), 1, fid);
+			fwrite(q, EncSize(enc), n, fid);
+			emean += err;
+			if (emax < err) emax = err;
+		}
 	}
+	if (offset != NULL) fwrite(offset, sizeof(int64_t), Tr, fid);
 	
 	fclose(fid);
+	free(offset);
+	free(q);
+	if (enc != ENC_F32 && Tr) 
+		printf("WriteManySacsFile: %s relative rms error %.2e on average, %.2e at most\n", EncName(enc), emean/Tr, emax);
 	
 	return 0;
 }
 
+/* Appends the Tr traces of N samples to the msacs file outfile, or writes it when it does not */
+/* exist. The new sequences are written in the encoding of the file after its last bytes (the  */
+/* index of a file of different lengths, which is left unused), then the new index and the     */
+/* header last. The file is truncated back to its former size on errors. The file turns into   */
+/* one of different lengths (see ReadManySacs.h) when the new sequences are not as long as the */
+/* ones in the file. The traces must have the sampling of the file.                            */
+int Append_ManySacsFile (float *x[], t_HeaderInfo *hdr, unsigned int Tr, unsigned int N, char *outfile, int enc) {
+	t_HeaderManySacsBinary mhdr;
+	t_HeaderManySacsEnc ehdr;
+	t_HeaderInfo h;
+	int64_t *offset, *pi64, end, size = -1;
+	unsigned int tr, Tr0, N0, n;
+	double err;
+	float scale;
+	void *q = NULL;
+	int var, nerr = 0;
+	FILE *fid;
+	
+	if (NULL == (fid = fopen(outfile, "r+"))) return Write_ManySacsFile (x, hdr, Tr, N, outfile, enc);
+	if (NULL == (offset = ManySacsLayout (fid, &mhdr, &ehdr, &end, outfile) )) {
+		fclose(fid);
+		return -2;
+	}
+	if (ehdr.enc != enc) printf("AppendManySacsFile: %s is in %s, the new sequences too.\n", outfile, EncName(ehdr.enc));
+	enc = ehdr.enc;
+	Tr0 = mhdr.nseq;
+	N0  = mhdr.npts;
+	var = (N0 == 0);
+	for (tr=0; tr<Tr && !var; tr++) 
+		if ((((unsigned)hdr[tr].npts < N) ? (unsigned)hdr[tr].npts : N) != N0) var = 1;
+	
+	/* Same sampling as the first sequence of the file */
+	if (Tr0 && (fseeko(fid, (off_t)offset[0], SEEK_SET) || 1 != fread(&h, sizeof(t_HeaderInfo), 1, fid))) nerr = 5;
+	for (tr=0; tr<Tr && Tr0 && !nerr; tr++) 
+		if (fabs(h.dt - hdr[tr].dt) > h.dt*0.001) {
+			printf("AppendManySacsFile: Different sampling rate (%f:%f) than the one of %s\n", hdr[tr].dt, h.dt, outfile);
+			nerr = 3;
+		}
+	if (nerr) {
+		if (nerr == 5) printf("AppendManySacsFile: Cannot read %s\n", outfile);
+		fclose(fid);
+		free(offset);
+		return nerr;
+	}
+	
+	if (NULL == (pi64 = (int64_t *)realloc(offset, (Tr0+Tr+1)*sizeof(int64_t)) )) nerr = 4;
+	else offset = pi64;
+	if (enc != ENC_F32 && NULL == (q = malloc(N*EncSize(enc)) )) nerr = 4;
+	if (nerr) {
+		printf("AppendManySacsFile: Out of memory\n");
+		fclose(fid);
+		free(offset);
+		free(q);
+		return nerr;
+	}
+	
+	/* New sequences at the end of the file (of the sequences when they are equal), then the index */
+	if (fseeko(fid, 0, SEEK_END) || (size = (int64_t)ftello(fid)) < end) nerr = 5;
+	if (var) end = size;
+	if (!nerr && fseeko(fid, (off_t)end, SEEK_SET)) nerr = 5;
+	for (tr=0; tr<Tr && !nerr; tr++) {
+		n = ((unsigned)hdr[tr].npts < N) ? (unsigned)hdr[tr].npts : N;
+		h = hdr[tr];
+		h.npts = n;
+		offset[Tr0+tr] = end;
+		if (1 != fwrite(&h, sizeof(t_HeaderInfo), 1, fid)) nerr = 5;
+		else if (enc == ENC_F32) { if (n != fwrite(x[tr], sizeof(float), n, fid)) nerr = 5; }
+		else {
+			scale = EncodeSamples (q, x[tr], n, enc, &err);
+			if (1 != fwrite(&scale, sizeof(float), 1, fid) || n != fwrite(q, EncSize(enc), n, fid)) nerr = 5;
+		}
+		end += sizeof(t_HeaderInfo) + ((enc != ENC_F32) ? sizeof(float) : 0) + (int64_t)n*EncSize(enc);
+	}
+	if (!nerr && var && Tr0+Tr != fwrite(offset, sizeof(int64_t), Tr0+Tr, fid)) nerr = 5;
+	if (!nerr && fflush(fid)) nerr = 5;
+	
+	/* From equal to different lengths: each sequence then has the length of its header. */
+	if (var && N0) 
+		for (tr=0; tr<Tr0 && !nerr; tr++) {
+			if (fseeko(fid, (off_t)offset[tr], SEEK_SET) || 1 != fread(&h, sizeof(t_HeaderInfo), 1, fid)) nerr = 5;
+			else if ((unsigned)h.npts != N0) {
+				h.npts = N0;
+				if (fseeko(fid, (off_t)offset[tr], SEEK_SET) || 1 != fwrite(&h, sizeof(t_HeaderInfo), 1, fid)) nerr = 5;
+			}
+		}
+	
+	/* The header last */
+	if (!nerr) {
+		mhdr.nseq = Tr0 + Tr;
+		mhdr.npts = (var) ? 0 : N0;
+		if (fseeko(fid, 0, SEEK_SET) || 1 != fwrite(&mhdr, sizeof(t_HeaderManySacsBinary), 1, fid)) nerr = 5;
+	}
+	if (fflush(fid) || ferror(fid)) nerr = 5;
+	if (nerr && size >= 0 && ftruncate(fileno(fid), (off_t)size)) 
+		printf("AppendManySacsFile: Cannot truncate %s back to %lld bytes\n", outfile, (long long)size);
+	if (fclose(fid)) nerr = 5;
+	if (nerr) printf("AppendManySacsFile: Error when appending to %s\n", outfile);
+	free(offset);
+	free(q);
+	
+	return nerr;
+}
+
 int ReadLocation_ManySacsFile (double *stlat, double *stlon, char *infile) {
 	t_HeaderManySacsBinary mhdr;
 	t_HeaderInfo SacHeader;
@@ -666,8 +1088,9 @@ int ReadLocation_ManySacsFile (double *stlat, double *stlon, char *infile) {
 		return -2;
 	}
 	
-	if (strcmp(mhdr.FormatID, "MSACS1")) {
-		printf("ReadLocation_ManySacsFile: %s is not in MSACS1 format.\n", infile);
+	if (!strcmp(mhdr.FormatID, "MSACS2")) fseek(fid, sizeof(t_HeaderManySacsEnc), SEEK_CUR);
+	else if (strcmp(mhdr.FormatID, "MSACS1")) {
+		printf("ReadLocation_ManySacsFile: %s is not in MSACS1 or MSACS2 format.\n", infile);
 		return -2;
 	}
 	
@@ -27,29 +27,48 @@ typedef struct {
 	char     loc[9];  /* Location/hole         */
 	int32_t  nostloc;
 	int32_t  nocmp;
+	float    masked;  /* Fraction of the samples masked as transients (STA/LTA). */
 } t_HeaderInfo;
 
 typedef struct {
-	char     FormatID[8];   /* FormatID: MSACS1                         */
+	char     FormatID[8];   /* FormatID: MSACS1 or MSACS2               */
 	int32_t  nseq;          /* Number of sequences in the file.         */
 	int32_t  npts;          /* Length of the sequences (0 if different) */
 	int32_t  SingleChannel; /* 0 (different) / 1 (equal) channels    */ 
 } t_HeaderManySacsBinary;
 
+/* MSACS2: t_HeaderManySacsBinary, t_HeaderManySacsEnc & the sequences, each one being its */
+/* t_HeaderInfo, its float scale factor and npts samples encoded by enc (see quantize.h).  */
+/* Sequences with different lengths (npts = 0 in MSACS1 or MSACS2): each one has its own npts */
+/* samples and the file ends with an int64_t index of the byte offsets of the nseq sequences, */
+/* rewritten after the new ones when appending (see Append_ManySacsFile).                     */
+typedef struct {
+	int32_t  enc;           /* Encoding of the samples                  */
+	int32_t  reserved;
+} t_HeaderManySacsEnc;
+
 time_t my_timegm (struct tm *tm);
 float **Destroy_FloatArrayList (float **x, unsigned int Tr);
 float **Create_FloatArrayList (unsigned int N, unsigned int Tr);
 float **Copy_FloatArrayList (float **x, unsigned int N, unsigned int Tr);
 int ReadLocation (double *stlat, double *stlon, char *fin);
 int ReadManySacs (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenamesOut[], unsigned int *TrOut, unsigned int *NOut, float *dtOut, char *fin);
+int ReadSacFiles (float **xOut[], t_HeaderInfo *SacHeaderOut[], char **filenames, unsigned int Tr, unsigned int *TrOut, unsigned int *NOut, float *dtOut);
+unsigned int ReadSacHeaders (t_HeaderInfo * const hdr, char **filenames, const unsigned int Tr);
+int SacioRead (t_HeaderInfo * const hdr, float * const sig, int Nsig, char *filename);
 int ReadManySacs_WithDiffLength (float **xOut[], t_HeaderInfo *SacHeaderOut[], unsigned int *TrOut, char *fin);
 void DestroyFilelist (char *p[]);
 int CreateFilelist (char **filename[], unsigned int *Tr, char *filelist);
 
+unsigned int ShortTraces (const t_HeaderInfo * const hdr, const unsigned int Tr, const unsigned int N);
 int RemoveZeroTraces (float **x[], t_HeaderInfo *SacHeader[], unsigned int *Tr, unsigned int N);
+void ShiftHeaderTime (t_HeaderInfo * const hdr, const double s);
 
 int Read_ManySacsFile (float **xOut[], t_HeaderInfo *SacHeaderOut[], unsigned int *TrOut, unsigned int *NOut, float *dtOut, char *fin);
-int Write_ManySacsFile (float *x[], t_HeaderInfo *SacHeader, unsigned int Tr, unsigned int N, char *fout);
+int Read_ManySacsHeaders (t_HeaderInfo *SacHeaderOut[], unsigned int *TrOut, unsigned int *NOut, int *enc, char *infile);
+int Write_ManySacsFile (float *x[], t_HeaderInfo *SacHeader, unsigned int Tr, unsigned int N, char *fout, int enc);
+int Append_ManySacsFile (float *x[], t_HeaderInfo *hdr, unsigned int Tr, unsigned int N, char *outfile, int enc);
+int Resample_FloatArrayList (float **xOut[], t_HeaderInfo *hdr, unsigned int Tr, unsigned int *pN, float dtT);
 int ReadLocation_ManySacsFile (double *stlat, double *stlon, char *fin);
 
 #endif
@@ -0,0 +1,128 @@
+/***********************************************************************/
+/* Builds or updates the station inventory of the inputs (filelists or */
+/* msacs files) of PCC_fullpair_1b reading only the headers, and lists */
+/* the stations or the pairs of stations worth correlating: within a   */
+/* distance range and having enough data at the same time. The list of */
+/* pairs is meant to drive PCC_fullpair_1b with the inv option.        */
+/***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "inventory.h"
+#include "ingest.h"
+
+void ListStations (const t_Inventory * const pinv);
+unsigned int ListPairs (const t_Inventory * const pinv, const double mindist, const double maxdist, const double minover);
+void usage ();
+int RDdouble (double * const x, const char *str);
+
+int main(int argc, char *argv[]) {
+	t_Inventory *pinv;
+	char *invfile;
+	double mindist = 0, maxdist = 0, minover = 0;
+	int i, iformat = 1, list = 0, pairs = 0, nadd = 0, nerr = 0;
+	
+	if (argc < 3) {
+		usage();
+		return 0;
+	}
+	invfile = argv[1];
+	SetIngest(INGEST_URING, 0);  /* Parallel reading of the headers by default */
+	if (NULL == (pinv = ReadInventory (invfile) )) {
+		if (NULL == (pinv = (t_Inventory *)calloc(1, sizeof(t_Inventory)) )) return 4;
+		memcpy(pinv->hdr.magic, INVMAGIC, 8);
+	}
+	
+	for (i=2; i<argc; i++) {
+		if (!strcmp(argv[i], "isac")) iformat = 1;
+		else if (!strcmp(argv[i], "imsacs")) iformat = 2;
+		else if (!strcmp(argv[i], "ingest") || !strncmp(argv[i], "ingest=", 7)) {
+			if ( IngestParse((argv[i][6] == '=') ? argv[i] + 7 : "") ) {
+				puts("Error when reading ingest.\n"); SetIngest(INGEST_SACIO, 0);
+			}
+		}
+		else if (!strcmp(argv[i], "list"))  list  = 1;
+		else if (!strcmp(argv[i], "pairs")) pairs = 1;
+		else if (!strncmp(argv[i], "mindist=", 8)) nerr += RDdouble(&mindist, argv[i] + 8);
+		else if (!strncmp(argv[i], "maxdist=", 8)) nerr += RDdouble(&maxdist, argv[i] + 8);
+		else if (!strncmp(argv[i], "mindays=", 8)) nerr += RDdouble(&minover, argv[i] + 8);
+		else if (!InventoryAdd (pinv, argv[i], iformat)) nadd++;
+	}
+	if (nerr) puts("Error when reading mindist, maxdist or mindays.\n");
+	
+	if (nadd) {
+		if (WriteInventory (pinv, invfile)) nerr = -2;
+		else fprintf(stderr, "%d stations added to %s (%u stations).\n", nadd, invfile, pinv->hdr.nsta);
+	}
+	if (list)  ListStations (pinv);
+	if (pairs) ListPairs (pinv, mindist, maxdist, 86400*minover);
+	
+	DestroyInventory (pinv);
+	return nerr;
+}
+
+void ListStations (const t_Inventory * const pinv) {
+	const t_InvStation *ps;
+	char t0[24], t1[24];
+	unsigned int n;
+	time_t t;
+	
+	for (n=0; n<pinv->hdr.nsta; n++) {
+		ps = &pinv->sta[n];
+		t = (time_t)ps->t0;
+		strftime(t0, sizeof(t0), "%Y-%j %H:%M:%S", gmtime(&t));
+		t = (time_t)ps->t1;
+		strftime(t1, sizeof(t1), "%Y-%j %H:%M:%S", gmtime(&t));
+		printf("%s %s.%s.%s %s ", ps->name, ps->net, ps->sta, ps->loc, ps->chn[0] ? ps->chn : "-");
+		if (ps->nostloc) printf("nan nan ");
+		else printf("%.5f %.5f ", ps->lat, ps->lon);
+		printf("%g %g %u %u %s %s\n", ps->dtmin, ps->dtmax, ps->ntr, ps->nspan, t0, t1);
+	}
+}
+
+/* Prints the pairs of stations between mindist and maxdist degrees (0: no limit) having at least */
+/* minover seconds of data at the same time: name1 name2 distance days. Returns how many.         */
+unsigned int ListPairs (const t_Inventory * const pinv, const double mindist, const double maxdist, const double minover) {
+	const t_InvStation *ps1, *ps2;
+	unsigned int n1, n2, np = 0;
+	double gcarc, over;
+	
+	for (n1=0; n1<pinv->hdr.nsta; n1++) {
+		ps1 = &pinv->sta[n1];
+		for (n2=n1+1; n2<pinv->hdr.nsta; n2++) {
+			ps2 = &pinv->sta[n2];
+			if (ps1->t1 <= ps2->t0 || ps2->t1 <= ps1->t0) continue;
+			gcarc = InventoryDistance (ps1, ps2);
+			if (gcarc >= 0 && ((mindist > 0 && gcarc < mindist) || (maxdist > 0 && gcarc > maxdist))) continue;
+			over = InventoryOverlap (pinv, ps1, ps2);
+			if (over <= 0 || over < minover) continue;
+			printf("%s %s %.4f %.3f\n", ps1->name, ps2->name, gcarc, over/86400.);
+			np++;
+		}
+	}
+	return np;
+}
+
+void usage () {
+	puts("\nUSAGE: StationInventory \"Inventory file\" [isac|imsacs] [ingest[=uring|pread|sacio][,qd]] files... [list]");
+	puts("       [pairs [mindist=\"degrees\"] [maxdist=\"degrees\"] [mindays=\"days of common data\"]]");
+	puts("  files  : filelists of sac files (isac, default) or msacs files (imsacs) added to the inventory, or updated");
+	puts("           when already in it, reading only the headers. Each one is a station of PCC_fullpair_1b.");
+	puts("  list   : prints the stations: name net.sta.loc channels lat lon dtmin dtmax traces spans begin end");
+	puts("  pairs  : prints the pairs of stations within mindist and maxdist having data at the same time (at least");
+	puts("           mindays): name1 name2 distance days. The distance is -1 when a location is not known.");
+	puts("");
+	puts("  Example:");
+	puts("     StationInventory net.inv sta*.txt");
+	puts("     StationInventory net.inv pairs maxdist=10 mindays=30 | while read f1 f2 d n; do");
+	puts("        PCC_fullpair_1b $f1 $f2 inv=net.inv tl1=-1000 tl2=1000 pcc; done");
+}
+
+int RDdouble (double * const x, const char *str) {
+	char *pstr;
+	
+	*x = strtod(str, &pstr);
+	return (str == pstr) ? 1 : 0;
+}
@@ -0,0 +1,354 @@
+/*****************************************************************************/
+/* Single-file archive of correlations, instead of one sac file for each of  */
+/* them: fixed-size records appended in the order they are computed and a    */
+/* trailing index sorted by (pair, channels, method, time), written when the */
+/* archive is closed. The header points to the index, 0 meaning that the    */
+/* archive was not closed: readers and appenders then scan the records,     */
+/* which are found from their fixed size.                                    */
+/*                                                                           */
+/* The reader maps the file, so that the correlations are read as slices of */
+/* the map, the ones of a pair being consecutive in the index. The samples  */
+/* can be stored in reduced precision (see quantize.h), ArcRead decoding    */
+/* them.                                                                    */
+/*****************************************************************************/
+#define _POSIX_C_SOURCE 200809L  /* fileno, ftruncate, fseeko & mmap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ccarchive.h"
+#include "quantize.h"
+
+int cmp_ArcIndex (const void *a, const void *b) {
+	const t_ArcIndex *p1 = (const t_ArcIndex *)a, *p2 = (const t_ArcIndex *)b;
+	int n;
+	
+	if ((n = memcmp(p1->key, p2->key, ARCKEY))) return n;
+	if (p1->t != p2->t) return (p1->t < p2->t) ? -1 : 1;
+	return (p1->msec > p2->msec) - (p1->msec < p2->msec);
+}
+
+/* Copies the name s into the 8 chars of d, padded with zeros. */
+void ArcName (char * const d, const char * const s) {
+	unsigned int k;
+	
+	for (k=0; k<8 && s[k]; k++) d[k] = s[k];
+	for (; k<8; k++) d[k] = 0;
+}
+
+/* Key (ARCKEY bytes, as the beginning of t_ArcRecord) of the correlation of the sequences */
+/* with headers h1 & h2 by method.                                                         */
+void ArcKey (char * const key, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, const char * const method) {
+	ArcName (key,      h1->net);
+	ArcName (key +  8, h1->sta);
+	ArcName (key + 16, h1->loc);
+	ArcName (key + 24, h2->net);
+	ArcName (key + 32, h2->sta);
+	ArcName (key + 40, h2->loc);
+	ArcName (key + 48, h1->chn);
+	ArcName (key + 56, h2->chn);
+	ArcName (key + 64, method);
+}
+
+/* Index entry of the record rec at offset off. */
+void ArcIndexEntry (t_ArcIndex * const pi, const t_ArcRecord * const rec, const uint64_t off) {
+	memcpy(pi->key, rec, ARCKEY);
+	pi->t      = rec->t;
+	pi->msec   = rec->msec;
+	pi->pad    = 0;
+	pi->offset = off;
+}
+
+/* Index of the records of an archive that was not closed, read from fid. */
+t_ArcIndex *ArcScan (FILE *fid, const t_ArcHeader * const hdr) {
+	t_ArcIndex *idx;
+	t_ArcRecord rec;
+	uint64_t r, off;
+	
+	if (NULL == (idx = (t_ArcIndex *)malloc((hdr->nrec + 1)*sizeof(t_ArcIndex)) )) return NULL;
+	for (r=0; r<hdr->nrec; r++) {
+		off = sizeof(t_ArcHeader) + r*hdr->recsize;
+		if (fseeko(fid, off, SEEK_SET) || 1 != fread(&rec, sizeof(t_ArcRecord), 1, fid)) break;
+		ArcIndexEntry (idx + r, &rec, off);
+	}
+	if (r < hdr->nrec) {
+		free(idx);
+		return NULL;
+	}
+	return idx;
+}
+
+/* Write lock of the whole archive fd, waiting for the run that holds it if any. Released */
+/* when the archive is closed. Returns 0 on success.                                     */
+int ArcLock (const int fd, const char *filename) {
+	struct flock fl;
+	
+	memset(&fl, 0, sizeof(struct flock));
+	fl.l_type   = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(fd, F_SETLK, &fl) == 0) return 0;
+	if (errno != EACCES && errno != EAGAIN) return -1;
+	printf("CreateArchive: Waiting for another run writing %s\n", filename);
+	return fcntl(fd, F_SETLKW, &fl);
+}
+
+/* Opens filename for appending correlations of L lags from lag1, sampled at dt, encoded by */
+/* enc. A new archive is created when it does not exist. The archive is locked until it is */
+/* closed, so that runs sharing it append one after another. Returns NULL on errors.       */
+t_ArcWriter *CreateArchive (const char *filename, const unsigned int L, const float dt, const float lag1, const int enc) {
+	t_ArcWriter *pa;
+	t_ArcHeader *hdr;
+	struct stat st;
+	int fd;
+	
+	if (NULL == (pa = (t_ArcWriter *)calloc(1, sizeof(t_ArcWriter)) ) || NULL == (pa->q = malloc(L*sizeof(float)) )) {
+		printf("CreateArchive: Out of memory\n");
+		free(pa);
+		return NULL;
+	}
+	hdr = &pa->hdr;
+	if (-1 == (fd = open(filename, O_RDWR | O_CREAT, 0644)) || NULL == (pa->fid = fdopen(fd, "r+b")) || 
+			ArcLock(fd, filename) || fstat(fd, &st)) {
+		printf("CreateArchive: Cannot open %s\n", filename);
+		if (pa->fid != NULL) fclose(pa->fid);
+		else if (fd != -1) close(fd);
+		free(pa->q);
+		free(pa);
+		return NULL;
+	}
+	if (st.st_size > 0) {
+		if (1 != fread(hdr, sizeof(t_ArcHeader), 1, pa->fid) || strncmp(hdr->magic, ARCMAGIC, 8) || 
+				hdr->L != L || hdr->dt != dt || hdr->lag1 != lag1 || hdr->enc != enc) {
+			printf("CreateArchive: %s is not an archive of %u lags from %g s at %g s in %s\n", filename, L, lag1, dt, EncName(enc));
+			fclose(pa->fid);
+			free(pa->q);
+			free(pa);
+			return NULL;
+		}
+		if (hdr->index == 0) {  /* Not closed: every complete record is kept. */
+			hdr->nrec = (st.st_size - sizeof(t_ArcHeader)) / hdr->recsize;
+			pa->idx = ArcScan (pa->fid, hdr);
+		} else if (NULL != (pa->idx = (t_ArcIndex *)malloc((hdr->nrec + 1)*sizeof(t_ArcIndex)) )) {
+			if (fseeko(pa->fid, hdr->index, SEEK_SET) || hdr->nrec != fread(pa->idx, sizeof(t_ArcIndex), hdr->nrec, pa->fid)) {
+				free(pa->idx);
+				pa->idx = ArcScan (pa->fid, hdr);
+			}
+		}
+		if (pa->idx == NULL) {
+			printf("CreateArchive: Cannot read the index of %s\n", filename);
+			fclose(pa->fid);
+			free(pa->q);
+			free(pa);
+			return NULL;
+		}
+		pa->nalloc = hdr->nrec + 1;
+	} else {
+		memcpy(hdr->magic, ARCMAGIC, 8);
+		hdr->L       = L;
+		hdr->dt      = dt;
+		hdr->lag1    = lag1;
+		hdr->enc     = enc;
+		hdr->recsize = sizeof(t_ArcRecord) + ((L*EncSize(enc) + 7) & ~(size_t)7);
+	}
+	
+	/* Open (index = 0) until closed. The old index, or the partial record of an archive not  */
+	/* closed, is cut off first, so that a run dying before closing leaves only records.     */
+	hdr->index = 0;
+	if (ftruncate(fd, sizeof(t_ArcHeader) + hdr->nrec*hdr->recsize) || fseeko(pa->fid, 0, SEEK_SET) || 
+			1 != fwrite(hdr, sizeof(t_ArcHeader), 1, pa->fid) || 
+			fseeko(pa->fid, sizeof(t_ArcHeader) + hdr->nrec*hdr->recsize, SEEK_SET)) {
+		printf("CreateArchive: Cannot write %s\n", filename);
+		fclose(pa->fid);
+		free(pa->idx);
+		free(pa->q);
+		free(pa);
+		return NULL;
+	}
+	return pa;
+}
+
+/* Appends the correlation y, of L lags, of the sequences with headers h1 & h2 by method. */
+int ArcAppend (t_ArcWriter * const pa, const float * const y, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, 
+		const char * const method) {
+	t_ArcHeader *hdr = &pa->hdr;
+	t_ArcRecord rec;
+	t_ArcIndex *pi;
+	char pad[8] = {0};
+	uint64_t off;
+	size_t nb = hdr->L*EncSize(hdr->enc);
+	double err;
+	
+	if (hdr->nrec >= pa->nalloc) {
+		pa->nalloc = (pa->nalloc) ? 2*pa->nalloc : 1024;
+		if (NULL == (pi = (t_ArcIndex *)realloc(pa->idx, pa->nalloc*sizeof(t_ArcIndex)) )) {
+			printf("ArcAppend: Out of memory\n");
+			pa->nalloc = hdr->nrec;
+			return 4;
+		}
+		pa->idx = pi;
+	}
+	
+	memset(&rec, 0, sizeof(t_ArcRecord));
+	ArcKey (rec.net1, h1, h2, method);
+	rec.t       = h1->t;
+	rec.msec    = h1->msec;
+	rec.lag0    = difftime(h1->t, h2->t) + (double)(h1->msec - h2->msec)/1000 + (h1->b - h2->b);
+	rec.stlat1  = h1->stla;
+	rec.stlon1  = h1->stlo;
+	rec.stel1   = h1->stel;
+	rec.stlat2  = h2->stla;
+	rec.stlon2  = h2->stlo;
+	rec.stel2   = h2->stel;
+	rec.masked1 = h1->masked;
+	rec.masked2 = h2->masked;
+	rec.scale   = EncodeSamples (pa->q, y, hdr->L, hdr->enc, &err);
+	
+	off = sizeof(t_ArcHeader) + hdr->nrec*hdr->recsize;
+	if (1 != fwrite(&rec, sizeof(t_ArcRecord), 1, pa->fid) || 1 != fwrite(pa->q, nb, 1, pa->fid) || 
+			(nb % 8 && 1 != fwrite(pad, 8 - nb % 8, 1, pa->fid))) {
+		printf("ArcAppend: Error writing the archive\n");
+		fseeko(pa->fid, off, SEEK_SET);
+		return 2;
+	}
+	ArcIndexEntry (pa->idx + hdr->nrec, &rec, off);
+	hdr->nrec++;
+	pa->emean += err;
+	if (pa->emax < err) pa->emax = err;
+	return 0;
+}
+
+/* Writes the sorted index & the header and closes the archive. */
+int CloseArchiveWriter (t_ArcWriter *pa) {
+	t_ArcHeader *hdr;
+	int nerr = 0;
+	
+	if (pa == NULL) return 0;
+	hdr = &pa->hdr;
+	if (hdr->nrec) qsort(pa->idx, hdr->nrec, sizeof(t_ArcIndex), cmp_ArcIndex);
+	hdr->index = sizeof(t_ArcHeader) + hdr->nrec*hdr->recsize;
+	if (fseeko(pa->fid, hdr->index, SEEK_SET) || hdr->nrec != fwrite(pa->idx, sizeof(t_ArcIndex), hdr->nrec, pa->fid) || 
+			fflush(pa->fid) || ftruncate(fileno(pa->fid), hdr->index + hdr->nrec*sizeof(t_ArcIndex)) || 
+			fseeko(pa->fid, 0, SEEK_SET) || 1 != fwrite(hdr, sizeof(t_ArcHeader), 1, pa->fid)) {
+		printf("CloseArchiveWriter: Error writing the index\n");
+		nerr = 2;
+	}
+	if (fclose(pa->fid)) nerr = 2;
+	if (hdr->enc != ENC_F32 && hdr->nrec) 
+		printf("CloseArchiveWriter: %s relative rms error %.2e on average, %.2e at most (this run)\n", EncName(hdr->enc), 
+			pa->emean/hdr->nrec, pa->emax);
+	free(pa->idx);
+	free(pa->q);
+	free(pa);
+	return nerr;
+}
+
+/* Maps the archive filename for reading. Returns NULL on errors. */
+t_Archive *OpenArchive (const char *filename) {
+	t_Archive *pa;
+	struct stat st;
+	FILE *fid;
+	
+	if (NULL == (pa = (t_Archive *)calloc(1, sizeof(t_Archive)) )) {
+		printf("OpenArchive: Out of memory\n");
+		return NULL;
+	}
+	if (-1 == (pa->fd = open(filename, O_RDONLY)) || fstat(pa->fd, &st) || (size_t)st.st_size < sizeof(t_ArcHeader) || 
+			MAP_FAILED == (pa->map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, pa->fd, 0)) ) {
+		printf("OpenArchive: Cannot map %s\n", filename);
+		if (pa->fd != -1) close(pa->fd);
+		free(pa);
+		return NULL;
+	}
+	pa->size = st.st_size;
+	memcpy(&pa->hdr, pa->map, sizeof(t_ArcHeader));
+	if (strncmp(pa->hdr.magic, ARCMAGIC, 8) || pa->hdr.enc < ENC_F32 || pa->hdr.enc > ENC_I16 || 
+			pa->hdr.recsize < sizeof(t_ArcRecord) + pa->hdr.L*EncSize(pa->hdr.enc)) {
+		printf("OpenArchive: %s is not an archive\n", filename);
+		CloseArchive (pa);
+		return NULL;
+	}
+	
+	if (pa->hdr.index && pa->hdr.index + pa->hdr.nrec*sizeof(t_ArcIndex) <= pa->size) 
+		pa->idx = (t_ArcIndex *)(pa->map + pa->hdr.index);
+	else {  /* Not closed: the complete records are indexed here. */
+		pa->hdr.nrec = (pa->size - sizeof(t_ArcHeader)) / pa->hdr.recsize;
+		pa->ownidx = 1;
+		if (NULL == (fid = fopen(filename, "rb")) || NULL == (pa->idx = ArcScan (fid, &pa->hdr) )) {
+			printf("OpenArchive: Cannot index %s\n", filename);
+			if (fid != NULL) fclose(fid);
+			CloseArchive (pa);
+			return NULL;
+		}
+		fclose(fid);
+		if (pa->hdr.nrec) qsort(pa->idx, pa->hdr.nrec, sizeof(t_ArcIndex), cmp_ArcIndex);
+	}
+	return pa;
+}
+
+void CloseArchive (t_Archive *pa) {
+	if (pa == NULL) return;
+	if (pa->ownidx) free(pa->idx);
+	munmap(pa->map, pa->size);
+	close(pa->fd);
+	free(pa);
+}
+
+/* Number of correlations with the given key, the first one being index *first. The key */
+/* ends at the first NULL field (e.g., method NULL: all the methods of the channels).    */
+uint64_t ArcFind (const t_Archive * const pa, uint64_t * const first, const char *net1, const char *sta1, const char *loc1, 
+		const char *net2, const char *sta2, const char *loc2, const char *chn1, const char *chn2, const char *method) {
+	const char *f[9] = {net1, sta1, loc1, net2, sta2, loc2, chn1, chn2, method};
+	char key[ARCKEY];
+	uint64_t lo, hi, mid, i0;
+	size_t K;
+	
+	memset(key, 0, ARCKEY);
+	for (K=0; K<9 && f[K] != NULL; K++) ArcName (key + 8*K, f[K]);
+	K *= 8;
+	
+	/* First entry >= key & first one > key over the K bytes */
+	lo = 0; hi = pa->hdr.nrec;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if (memcmp(pa->idx[mid].key, key, K) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	i0 = lo;
+	hi = pa->hdr.nrec;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if (memcmp(pa->idx[mid].key, key, K) <= 0) lo = mid + 1;
+		else hi = mid;
+	}
+	if (first != NULL) *first = i0;
+	return lo - i0;
+}
+
+/* Data (L lags) of the i-th correlation of the index, its record in *prec when not NULL. */
+/* Only for float32 archives (NULL otherwise, see ArcRead).                               */
+const float *ArcData (const t_Archive * const pa, const uint64_t i, const t_ArcRecord ** const prec) {
+	const char *p;
+	
+	if (pa->hdr.enc != ENC_F32 || i >= pa->hdr.nrec || pa->idx[i].offset + pa->hdr.recsize > pa->size) return NULL;
+	p = pa->map + pa->idx[i].offset;
+	if (prec != NULL) *prec = (const t_ArcRecord *)p;
+	return (const float *)(p + sizeof(t_ArcRecord));
+}
+
+/* Decodes the i-th correlation of the index into y (L lags), its record in *prec when not */
+/* NULL. Returns 0 on success.                                                             */
+int ArcRead (const t_Archive * const pa, const uint64_t i, float * const y, const t_ArcRecord ** const prec) {
+	const t_ArcRecord *rec;
+	
+	if (i >= pa->hdr.nrec || pa->idx[i].offset + pa->hdr.recsize > pa->size) return 1;
+	rec = (const t_ArcRecord *)(pa->map + pa->idx[i].offset);
+	DecodeSamples (y, rec + 1, pa->hdr.L, pa->hdr.enc, rec->scale);
+	if (prec != NULL) *prec = rec;
+	return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef CCARCHIVE_H
+#define CCARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ReadManySacs.h"
+
+/* Archive of correlations: a header, fixed-size records (t_ArcRecord followed by L samples */
+/* encoded by enc, see quantize.h, padded to 8 bytes) in the order they were appended, and  */
+/* an index sorted by key & time.                                                           */
+#define ARCMAGIC "PCCARC2"
+#define ARCKEY   72  /* Bytes of the key: pair, channels & method */
+
+typedef struct {
+	char     magic[8];  /* ARCMAGIC                  */
+	uint32_t L;         /* Number of lags.           */
+	float    dt;        /* Sampling period (s).      */
+	float    lag1;      /* Lowest lag time (s).      */
+	uint32_t recsize;   /* Bytes per record.         */
+	uint64_t nrec;      /* Number of records.        */
+	uint64_t index;     /* Offset of the index (0: not closed, the records must be scanned). */
+	int32_t  enc;       /* Encoding of the samples.  */
+	int32_t  reserved;
+} t_ArcHeader;
+
+typedef struct {
+	char     net1[8];   /* Net 1 name.               */
+	char     sta1[8];   /* Station 1 name.           */
+	char     loc1[8];   /* Location/hole 1 id.       */
+	char     net2[8];   /* Net 2 name.               */
+	char     sta2[8];   /* Station 2 name.           */
+	char     loc2[8];   /* Location/hole 2 id.       */
+	char     chn1[8];   /* Channel 1 id.             */
+	char     chn2[8];   /* Channel 2 id.             */
+	char     method[8]; /* Cross-correlation method. */
+	int64_t  t;         /* Beginning of the sequences of st. 1 (time_t). */
+	int32_t  msec;      /* Milliseconds of t.        */
+	float    lag0;      /* Time of the 0 lag (s), as o of the sac outputs. */
+	float    stlat1;    /* Latitud of st. 1.         */
+	float    stlon1;    /* Longitud of st. 1.        */
+	float    stel1;     /* Elevation of st. 1.       */
+	float    stlat2;    /* Latitud of st. 2.         */
+	float    stlon2;    /* Longitud of st. 2.        */
+	float    stel2;     /* Elevation of st. 2.       */
+	float    masked1;   /* Fractions of st. 1 & 2 masked as transients. */
+	float    masked2;
+	float    scale;     /* Scale factor of the samples. */
+	int32_t  reserved;
+} t_ArcRecord;
+
+typedef struct {
+	char     key[ARCKEY];  /* The first ARCKEY bytes of the record */
+	int64_t  t;
+	int32_t  msec;
+	uint32_t pad;
+	uint64_t offset;       /* Of the record */
+} t_ArcIndex;
+
+/* Writing (appending when the file is an archive of the same L, dt & lag1) */
+typedef struct {
+	FILE *fid;
+	t_ArcHeader hdr;
+	t_ArcIndex *idx;
+	uint64_t nalloc;
+	void *q;            /* Encoded samples */
+	double emean, emax; /* Relative rms errors of the encoding */
+} t_ArcWriter;
+
+void ArcKey (char * const key, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, const char * const method);
+t_ArcWriter *CreateArchive (const char *filename, const unsigned int L, const float dt, const float lag1, const int enc);
+int ArcAppend (t_ArcWriter * const pa, const float * const y, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, 
+	const char * const method);
+int CloseArchiveWriter (t_ArcWriter *pa);
+
+/* Reading by mmap */
+typedef struct {
+	int fd;
+	size_t size;
+	char *map;
+	t_ArcHeader hdr;
+	t_ArcIndex *idx;  /* Into map, or allocated (ownidx) when the archive was not closed */
+	int ownidx;
+} t_Archive;
+
+t_Archive *OpenArchive (const char *filename);
+void CloseArchive (t_Archive *pa);
+uint64_t ArcFind (const t_Archive * const pa, uint64_t * const first, const char *net1, const char *sta1, const char *loc1, 
+	const char *net2, const char *sta2, const char *loc2, const char *chn1, const char *chn2, const char *method);
+const float *ArcData (const t_Archive * const pa, const uint64_t i, const t_ArcRecord ** const prec);
+int ArcRead (const t_Archive * const pa, const uint64_t i, float * const y, const t_ArcRecord ** const prec);
+
+#endif
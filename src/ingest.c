@@ -0,0 +1,608 @@
+/*****************************************************************************/
+/* Batched reading of many small files (e.g., daily sac files) for           */
+/* ReadManySacs. Opening and reading the files one after the other costs a   */
+/* few round trips of latency per file, which dominate the reading time on   */
+/* networked file systems. Here the files of the filelist are read ahead     */
+/* into memory by a background backend keeping up to qd files in flight:    */
+/*  - io_uring: a single thread submits the openat and statx of each file,   */
+/*    then its read, in batches through an io_uring (plain syscalls, no      */
+/*    liburing). Define NO_IO_URING to build without it.                     */
+/*  - pread: a pool of threads doing open, fstat and pread. It is used when  */
+/*    io_uring is not available (old kernels, seccomp filters, ...).         */
+/* The binary sac files are then parsed from memory by SacParse, and the    */
+/* miniSEED files by MseedParse (see mseed.h).                               */
+/*****************************************************************************/
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ingest.h"
+#include "mseed.h"
+
+#ifndef NO_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#endif
+
+static int IngestBackend = INGEST_SACIO;
+static unsigned int IngestQD = INGEST_QD;
+
+/* Sets the backend and the queue depth used by the next calls to ReadManySacs. */
+void SetIngest (const int backend, const unsigned int qd) {
+	IngestBackend = backend;
+	IngestQD = (qd == 0) ? INGEST_QD : (qd > INGEST_MAXQD) ? INGEST_MAXQD : qd;
+}
+
+/* Reads the ingest options: "uring", "pread" or "sacio" optionally followed by ",qd", or only qd. */
+int IngestParse (const char *str) {
+	int backend = INGEST_URING;
+	long qd = 0;
+	char *pstr;
+	
+	if      (!strncmp(str, "uring", 5)) str += 5;
+	else if (!strncmp(str, "pread", 5)) { backend = INGEST_PREAD; str += 5; }
+	else if (!strncmp(str, "sacio", 5)) { backend = INGEST_SACIO; str += 5; }
+	if (*str == ',') str++;
+	if (*str != '\0') {
+		qd = strtol(str, &pstr, 10);
+		if (pstr == str || *pstr != '\0' || qd < 1) {
+			printf("IngestParse: Unknown ingest option %s\n", str);
+			return 1;
+		}
+	}
+	SetIngest(backend, (unsigned int)qd);
+	return 0;
+}
+
+/* Stores the contents of file tr and wakes up the consumer. Called with mtx locked. */
+static void IngestPublish (t_Ingest * const pi, const unsigned int tr, char *buf, const size_t size, const int err) {
+	pi->buf[tr]   = buf;
+	pi->size[tr]  = size;
+	pi->err[tr]   = err;
+	pi->ready[tr] = 1;
+	pthread_cond_broadcast(&pi->cready);
+}
+
+/********************/
+/* pread backend    */
+/********************/
+
+/* Reads the whole file name (the header only when hdronly) into a new buffer. Returns errno. */
+static int ReadWholeFile (const char *name, const int hdronly, char **pbuf, size_t *psize) {
+	struct stat st;
+	size_t n = 0, len;
+	ssize_t r;
+	char *buf;
+	int fd, err = 0;
+	
+	*pbuf  = NULL;
+	*psize = 0;
+	if (0 > (fd = open(name, O_RDONLY))) return errno;
+	if (fstat(fd, &st)) err = errno;
+	else {
+		len = (size_t)st.st_size;
+		if (hdronly && len > SACHDRSIZE) len = SACHDRSIZE;
+		if (NULL == (buf = (char *)malloc(len + 1))) err = ENOMEM;
+		else {
+			while (n < len) {
+				if (0 > (r = pread(fd, buf + n, len - n, (off_t)n))) {
+					if (errno == EINTR) continue;
+					err = errno;
+					break;
+				}
+				if (r == 0) break;  /* Truncated while being read */
+				n += (size_t)r;
+			}
+			if (err) free(buf);
+			else {
+				*pbuf  = buf;
+				*psize = n;
+			}
+		}
+	}
+	close(fd);
+	return err;
+}
+
+static void *PreadThread (void *arg) {
+	t_Ingest *pi = (t_Ingest *)arg;
+	unsigned int tr;
+	size_t size;
+	char *buf;
+	int err;
+	
+	pthread_mutex_lock(&pi->mtx);
+	while (1) {
+		while (!pi->stop && pi->next < pi->Tr && pi->next >= pi->cons + pi->qd) pthread_cond_wait(&pi->cwin, &pi->mtx);
+		if (pi->stop || pi->next >= pi->Tr) break;
+		tr = pi->next++;
+		pthread_mutex_unlock(&pi->mtx);
+		
+		err = ReadWholeFile(pi->names[tr], pi->hdronly, &buf, &size);
+		
+		pthread_mutex_lock(&pi->mtx);
+		IngestPublish(pi, tr, buf, size, err);
+	}
+	pthread_mutex_unlock(&pi->mtx);
+	return NULL;
+}
+
+/********************/
+/* io_uring backend */
+/********************/
+#ifndef NO_IO_URING
+
+#define OP_OPEN  0
+#define OP_STATX 1
+#define OP_READ  2
+
+/* A file in flight. */
+typedef struct {
+	unsigned int tr;
+	int fd, pending, err;
+	size_t off, len;
+	char *buf;
+	struct statx stx;
+} t_RingSlot;
+
+typedef struct {
+	int fd;
+	unsigned int sqmask, cqmask, nsq;  /* nsq: sqes queued and not submitted yet */
+	unsigned int *sqhead, *sqtail, *sqarray, *cqhead, *cqtail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqlen, cqlen, sqelen;
+	t_RingSlot *slot;
+	unsigned int *freeslot, nfree, qd;
+} t_Ring;
+
+static void DestroyRing (t_Ring *pr) {
+	if (pr == NULL) return;
+	if (pr->sqes != NULL) munmap(pr->sqes, pr->sqelen);
+	if (pr->cqmap != NULL && pr->cqmap != pr->sqmap) munmap(pr->cqmap, pr->cqlen);
+	if (pr->sqmap != NULL) munmap(pr->sqmap, pr->sqlen);
+	if (pr->fd >= 0) close(pr->fd);
+	free(pr->slot);
+	free(pr->freeslot);
+	free(pr);
+}
+
+/* Sets up an io_uring for qd files in flight. Returns NULL when io_uring or one of the */
+/* operations is not supported, the caller falls back to the pread threads then.        */
+static t_Ring *CreateRing (const unsigned int qd) {
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	t_Ring *pr;
+	unsigned int n, entries = 1, ok;
+	void *map;
+	
+	while (entries < 2*qd) entries <<= 1;  /* Up to 2 operations per file */
+	if (NULL == (pr = (t_Ring *)calloc(1, sizeof(t_Ring)) )) return NULL;
+	pr->fd = -1;
+	pr->qd = qd;
+	if (NULL == (pr->slot = (t_RingSlot *)calloc(qd, sizeof(t_RingSlot)) ) ||
+		NULL == (pr->freeslot = (unsigned int *)malloc(qd*sizeof(unsigned int)) )) {
+		DestroyRing(pr);
+		return NULL;
+	}
+	for (n=0; n<qd; n++) pr->freeslot[n] = qd-1-n;
+	pr->nfree = qd;
+	
+	memset(&p, 0, sizeof(p));
+	if (0 > (pr->fd = (int)syscall(__NR_io_uring_setup, entries, &p))) {
+		DestroyRing(pr);
+		return NULL;
+	}
+	
+	/* openat, statx & read are available from Linux 5.6, as the probe. */
+	ok = 0;
+	n  = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+	if (NULL != (probe = (struct io_uring_probe *)calloc(1, n) )) {
+		if (!syscall(__NR_io_uring_register, pr->fd, IORING_REGISTER_PROBE, probe, 256))
+			ok = probe->last_op >= IORING_OP_READ &&
+				(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+				(probe->ops[IORING_OP_STATX].flags  & IO_URING_OP_SUPPORTED) &&
+				(probe->ops[IORING_OP_READ].flags   & IO_URING_OP_SUPPORTED);
+		free(probe);
+	}
+	if (!ok) {
+		DestroyRing(pr);
+		return NULL;
+	}
+	
+	pr->sqlen  = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+	pr->cqlen  = p.cq_off.cqes  + p.cq_entries*sizeof(struct io_uring_cqe);
+	pr->sqelen = p.sq_entries*sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (pr->cqlen > pr->sqlen) pr->sqlen = pr->cqlen;
+		pr->cqlen = pr->sqlen;
+	}
+	map = mmap(NULL, pr->sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, pr->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED) { DestroyRing(pr); return NULL; }
+	pr->sqmap = map;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) pr->cqmap = map;
+	else {
+		map = mmap(NULL, pr->cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, pr->fd, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED) { DestroyRing(pr); return NULL; }
+		pr->cqmap = map;
+	}
+	map = mmap(NULL, pr->sqelen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, pr->fd, IORING_OFF_SQES);
+	if (map == MAP_FAILED) { DestroyRing(pr); return NULL; }
+	pr->sqes = (struct io_uring_sqe *)map;
+	
+	pr->sqhead  = (unsigned int *)((char *)pr->sqmap + p.sq_off.head);
+	pr->sqtail  = (unsigned int *)((char *)pr->sqmap + p.sq_off.tail);
+	pr->sqmask  = *(unsigned int *)((char *)pr->sqmap + p.sq_off.ring_mask);
+	pr->sqarray = (unsigned int *)((char *)pr->sqmap + p.sq_off.array);
+	pr->cqhead  = (unsigned int *)((char *)pr->cqmap + p.cq_off.head);
+	pr->cqtail  = (unsigned int *)((char *)pr->cqmap + p.cq_off.tail);
+	pr->cqmask  = *(unsigned int *)((char *)pr->cqmap + p.cq_off.ring_mask);
+	pr->cqes    = (struct io_uring_cqe *)((char *)pr->cqmap + p.cq_off.cqes);
+	return pr;
+}
+
+/* Queues a new sqe. There is always room, because at most 2 operations per file are in flight. */
+static struct io_uring_sqe *RingSqe (t_Ring * const pr, const unsigned int s, const int op) {
+	unsigned int tail = *pr->sqtail, idx = tail & pr->sqmask;
+	struct io_uring_sqe *sqe = &pr->sqes[idx];
+	
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = ((uint64_t)s << 2) | (uint64_t)op;
+	pr->sqarray[idx] = idx;
+	__atomic_store_n(pr->sqtail, tail + 1, __ATOMIC_RELEASE);
+	pr->nsq++;
+	return sqe;
+}
+
+static void RingRead (t_Ring * const pr, const unsigned int s) {
+	t_RingSlot *ps = &pr->slot[s];
+	struct io_uring_sqe *sqe = RingSqe(pr, s, OP_READ);
+	
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd     = ps->fd;
+	sqe->addr   = (uint64_t)(uintptr_t)(ps->buf + ps->off);
+	sqe->len    = (uint32_t)(ps->len - ps->off);
+	sqe->off    = (uint64_t)ps->off;
+	ps->pending = 1;
+}
+
+/* Starts reading file tr: its openat and, unless only the header is read, its statx. */
+static void RingIssue (t_Ring * const pr, const t_Ingest * const pi, const unsigned int tr) {
+	unsigned int s = pr->freeslot[--pr->nfree];
+	t_RingSlot *ps = &pr->slot[s];
+	struct io_uring_sqe *sqe;
+	
+	ps->tr  = tr;
+	ps->fd  = -1;
+	ps->err = 0;
+	ps->off = 0;
+	ps->len = SACHDRSIZE;
+	ps->buf = NULL;
+	sqe = RingSqe(pr, s, OP_OPEN);
+	sqe->opcode     = IORING_OP_OPENAT;
+	sqe->fd         = AT_FDCWD;
+	sqe->addr       = (uint64_t)(uintptr_t)pi->names[tr];
+	sqe->open_flags = O_RDONLY;
+	ps->pending = 1;
+	if (!pi->hdronly) {
+		sqe = RingSqe(pr, s, OP_STATX);
+		sqe->opcode      = IORING_OP_STATX;
+		sqe->fd          = AT_FDCWD;
+		sqe->addr        = (uint64_t)(uintptr_t)pi->names[tr];
+		sqe->len         = STATX_SIZE;
+		sqe->off         = (uint64_t)(uintptr_t)&ps->stx;
+		ps->pending = 2;
+	}
+}
+
+/* Processes a completion. Returns 1 when its file is finished. */
+static int RingComplete (t_Ring * const pr, const struct io_uring_cqe * const cqe) {
+	unsigned int s = (unsigned int)(cqe->user_data >> 2);
+	int op = (int)(cqe->user_data & 3), res = cqe->res;
+	t_RingSlot *ps = &pr->slot[s];
+	
+	ps->pending--;
+	if (op == OP_OPEN) {
+		if (res < 0) ps->err = -res;
+		else ps->fd = res;
+	} else if (op == OP_STATX) {
+		if (res < 0) ps->err = -res;
+		else ps->len = (size_t)ps->stx.stx_size;
+	} else {
+		if (res < 0) {
+			if (res == -EINTR || res == -EAGAIN) { RingRead(pr, s); return 0; }
+			ps->err = -res;
+		} else if (res == 0) ps->len = ps->off;  /* Truncated while being read */
+		else {
+			ps->off += (size_t)res;
+			if (ps->off < ps->len) { RingRead(pr, s); return 0; }  /* Short read */
+		}
+		return 1;
+	}
+	if (ps->pending) return 0;
+	
+	/* Opened and sized: read it all */
+	if (ps->err) return 1;
+	if (NULL == (ps->buf = (char *)malloc(ps->len + 1) )) { ps->err = ENOMEM; return 1; }
+	if (ps->len == 0) return 1;
+	RingRead(pr, s);
+	return 0;
+}
+
+static void *RingThread (void *arg) {
+	t_Ingest *pi = (t_Ingest *)arg;
+	t_Ring *pr = (t_Ring *)pi->ring;
+	t_RingSlot *ps;
+	unsigned int head, tail, s, nin = 0;
+	int r, fatal = 0;
+	
+	pthread_mutex_lock(&pi->mtx);
+	while (1) {
+		while (!pi->stop && !fatal && pi->next < pi->Tr && pi->next < pi->cons + pi->qd) {
+			RingIssue(pr, pi, pi->next++);
+			nin++;
+		}
+		if (nin == 0 && (pi->stop || fatal || pi->next >= pi->Tr)) break;
+		if (nin == 0) { pthread_cond_wait(&pi->cwin, &pi->mtx); continue; }
+		pthread_mutex_unlock(&pi->mtx);
+		
+		r = (int)syscall(__NR_io_uring_enter, pr->fd, pr->nsq, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r >= 0) pr->nsq -= (unsigned)r;
+		else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			/* The operations in flight are lost with their buffers. */
+			printf("RingThread: io_uring_enter error (%s)\n", strerror(errno));
+			pthread_mutex_lock(&pi->mtx);
+			for (s=pi->cons; s<pi->Tr; s++) if (!pi->ready[s]) IngestPublish(pi, s, NULL, 0, EIO);
+			pi->next = pi->Tr;
+			fatal = 1;
+			nin = 0;
+			continue;
+		}
+		
+		head = *pr->cqhead;
+		tail = __atomic_load_n(pr->cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			if (!RingComplete(pr, &pr->cqes[head & pr->cqmask])) continue;
+			s  = (unsigned int)(pr->cqes[head & pr->cqmask].user_data >> 2);
+			ps = &pr->slot[s];
+			if (ps->fd >= 0) close(ps->fd);
+			if (ps->err) { free(ps->buf); ps->buf = NULL; }
+			pthread_mutex_lock(&pi->mtx);
+			IngestPublish(pi, ps->tr, ps->buf, ps->off, ps->err);
+			pthread_mutex_unlock(&pi->mtx);
+			pr->freeslot[pr->nfree++] = s;
+			nin--;
+		}
+		__atomic_store_n(pr->cqhead, head, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&pi->mtx);
+	}
+	pthread_mutex_unlock(&pi->mtx);
+	return NULL;
+}
+#endif
+
+/********************/
+/* Interface        */
+/********************/
+
+/* Starts reading ahead the files names[0...Tr-1] with the backend and queue depth set by */
+/* SetIngest. Returns NULL when they are to be read one by one with the sac library.      */
+t_Ingest *StartIngest (char **names, const unsigned int Tr, const int hdronly) {
+	t_Ingest *pi;
+	unsigned int n;
+	
+	if (IngestBackend == INGEST_SACIO || Tr == 0) return NULL;
+	if (NULL == (pi = (t_Ingest *)calloc(1, sizeof(t_Ingest)) )) return NULL;
+	pi->names   = names;
+	pi->Tr      = Tr;
+	pi->qd      = IngestQD;
+	pi->hdronly = hdronly;
+	pi->backend = IngestBackend;
+	if (NULL == (pi->buf   = (char **)calloc(Tr, sizeof(char *)) ) ||
+		NULL == (pi->size  = (size_t *)calloc(Tr, sizeof(size_t)) ) ||
+		NULL == (pi->err   = (int *)calloc(Tr, sizeof(int)) ) ||
+		NULL == (pi->ready = (int *)calloc(Tr, sizeof(int)) )) {
+		free(pi->buf); free(pi->size); free(pi->err); free(pi->ready); free(pi);
+		return NULL;
+	}
+	pthread_mutex_init(&pi->mtx, NULL);
+	pthread_cond_init(&pi->cready, NULL);
+	pthread_cond_init(&pi->cwin, NULL);
+
+#ifndef NO_IO_URING
+	if (pi->backend == INGEST_URING) {
+		static int warned = 0;
+		
+		if (NULL != (pi->ring = CreateRing(pi->qd) )) {
+			if (!pthread_create(&pi->th[0], NULL, RingThread, pi)) pi->nth = 1;
+			else {
+				DestroyRing((t_Ring *)pi->ring);
+				pi->ring = NULL;
+			}
+		}
+		if (pi->ring == NULL) {
+			if (!warned) printf("StartIngest: io_uring is not available, using %u pread threads\n", (pi->qd < INGEST_MAXTH) ? pi->qd : INGEST_MAXTH);
+			warned = 1;
+			pi->backend = INGEST_PREAD;
+		}
+	}
+#else
+	pi->backend = INGEST_PREAD;
+#endif
+	if (pi->backend == INGEST_PREAD)
+		for (n=0; n<pi->qd && n<INGEST_MAXTH; n++) {
+			if (pthread_create(&pi->th[n], NULL, PreadThread, pi)) break;
+			pi->nth++;
+		}
+	if (pi->nth == 0) {
+		printf("StartIngest: Create thread error, the files are read one by one\n");
+		StopIngest(pi);
+		return NULL;
+	}
+	return pi;
+}
+
+/* Waits until file tr is read and returns its contents in buf & size, or its errno. Files are */
+/* used in order: the ones before tr are released and the read ahead moves on.                 */
+int IngestGet (t_Ingest * const pi, const unsigned int tr, const char **buf, size_t *size) {
+	unsigned int n;
+	int err;
+	
+	pthread_mutex_lock(&pi->mtx);
+	if (tr > pi->cons) {
+		for (n=pi->cons; n<tr; n++) if (pi->ready[n]) { free(pi->buf[n]); pi->buf[n] = NULL; }
+		pi->cons = tr;
+		pthread_cond_broadcast(&pi->cwin);
+	}
+	while (!pi->ready[tr]) pthread_cond_wait(&pi->cready, &pi->mtx);
+	*buf  = pi->buf[tr];
+	*size = pi->size[tr];
+	err   = pi->err[tr];
+	pthread_mutex_unlock(&pi->mtx);
+	return err;
+}
+
+/* Reads the header of the sac file tr into hdr and up to Nsig samples into sig (when not NULL). */
+int IngestSac (t_Ingest * const pi, const unsigned int tr, t_HeaderInfo * const hdr, float * const sig, const int Nsig) {
+	const char *buf;
+	size_t size;
+	int err;
+	
+	if ( (err = IngestGet(pi, tr, &buf, &size)) ) {
+		printf("IngestSac: cannot read %s (%s)\n", pi->names[tr], strerror(err));
+		return 2;
+	}
+	if (IsMseed(buf, size)) {  /* Read whole when only its beginning was read ahead */
+		if ( (err = (pi->hdronly) ? ReadMseed(hdr, sig, Nsig, pi->names[tr]) : MseedParse(hdr, sig, Nsig, buf, size, pi->names[tr])) ) {
+			printf("IngestSac: cannot decode the miniSEED file %s (MseedParse error = %d)\n", pi->names[tr], err);
+			return 2;
+		}
+		return 0;
+	}
+	if ( (err = SacParse(hdr, sig, Nsig, buf, size)) ) {
+		printf("IngestSac: %s is not an evenly spaced binary sac file (SacParse error = %d)\n", pi->names[tr], err);
+		return 2;
+	}
+	return 0;
+}
+
+void StopIngest (t_Ingest * const pi) {
+	unsigned int n;
+	
+	if (pi == NULL) return;
+	pthread_mutex_lock(&pi->mtx);
+	pi->stop = 1;
+	pthread_cond_broadcast(&pi->cwin);
+	pthread_mutex_unlock(&pi->mtx);
+	for (n=0; n<pi->nth; n++) pthread_join(pi->th[n], NULL);
+#ifndef NO_IO_URING
+	DestroyRing((t_Ring *)pi->ring);
+#endif
+	for (n=0; n<pi->Tr; n++) free(pi->buf[n]);
+	pthread_cond_destroy(&pi->cwin);
+	pthread_cond_destroy(&pi->cready);
+	pthread_mutex_destroy(&pi->mtx);
+	free(pi->buf);
+	free(pi->size);
+	free(pi->err);
+	free(pi->ready);
+	free(pi);
+}
+
+/********************/
+/* Binary sac files */
+/********************/
+#define SAC_FUNDEF  -12345.
+#define SAC_NUNDEF  -12345
+
+static void swap4 (char * const p, const unsigned int n) {
+	unsigned int i;
+	char c;
+	
+	for (i=0; i<4*n; i+=4) {
+		c = p[i];   p[i]   = p[i+3]; p[i+3] = c;
+		c = p[i+1]; p[i+1] = p[i+2]; p[i+2] = c;
+	}
+}
+
+/* Copies the 8 chars of the k-th sac string header field as a C string. */
+static void sacstr (char * const s, const char * const buf, const unsigned int k) {
+	char *pch;
+	
+	memcpy(s, buf + 440 + 8*k + ((k > 0) ? 8 : 0), 8);  /* kevnm (k = 1) is 16 chars long */
+	s[8] = '\0';
+	if ( (pch = memchr(s, ' ', 8)) ) pch[0] = '\0';
+	if ( !strncmp(s, "-12345", 6) ) s[0] = '\0';
+}
+
+/* Parses the binary sac file buf of size bytes as ReadManySacs does with the sac library: */
+/* the header into hdr and up to Nsig samples into sig (when not NULL). Both byte orders   */
+/* are accepted. Returns 1 if it is not a sac file, 2 if it is not evenly spaced and 3 if  */
+/* it is truncated.                                                                        */
+int SacParse (t_HeaderInfo * const hdr, float * const sig, const int Nsig, const char * const buf, const size_t size) {
+	float  fh[70];
+	int32_t nh[40];
+	struct tm tm;
+	int swap = 0, n;
+	
+	if (size < SACHDRSIZE) return 1;
+	memcpy(fh, buf, sizeof(fh));
+	memcpy(nh, buf + 280, sizeof(nh));
+	if (nh[6] < 1 || nh[6] > 7) {  /* nvhdr */
+		swap4((char *)nh, 40);
+		if (nh[6] < 1 || nh[6] > 7) return 1;
+		swap4((char *)fh, 70);
+		swap = 1;
+	}
+	if (nh[35] != 1 || nh[9] < 0) return 2;  /* leven & npts */
+	
+	memset(hdr, 0, sizeof(t_HeaderInfo));
+	hdr->npts   = nh[9];
+	hdr->dt     = fh[0];
+	hdr->b      = fh[5];
+	hdr->year   = nh[0];
+	hdr->yday   = nh[1];
+	hdr->hour   = nh[2];
+	hdr->min    = nh[3];
+	hdr->sec    = nh[4];
+	hdr->msec   = nh[5];
+	hdr->stla   = fh[31];
+	hdr->stlo   = fh[32];
+	hdr->stel   = (fh[33] == SAC_FUNDEF) ? 0 : fh[33];
+	hdr->stdp   = (fh[34] == SAC_FUNDEF) ? 0 : fh[34];
+	hdr->cmpaz  = fh[57];
+	hdr->cmpinc = fh[58];
+	hdr->nostloc = (fh[31] == SAC_FUNDEF || fh[32] == SAC_FUNDEF);
+	hdr->nocmp   = (fh[57] == SAC_FUNDEF || fh[58] == SAC_FUNDEF);
+	sacstr(hdr->sta, buf, 0);   /* kstnm  */
+	sacstr(hdr->loc, buf, 2);   /* khole  */
+	sacstr(hdr->chn, buf, 19);  /* kcmpnm */
+	sacstr(hdr->net, buf, 20);  /* knetwk */
+	
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year  = hdr->year-1900;
+	tm.tm_mon   = 0;
+	tm.tm_mday  = hdr->yday;
+	tm.tm_hour  = hdr->hour;
+	tm.tm_min   = hdr->min;
+	tm.tm_sec   = hdr->sec;
+	tm.tm_isdst = 0;
+	hdr->t      = my_timegm(&tm);
+	
+	if (sig != NULL) {
+		n = (hdr->npts < Nsig) ? hdr->npts : Nsig;
+		if ((size - SACHDRSIZE)/sizeof(float) < (size_t)n) return 3;
+		memcpy(sig, buf + SACHDRSIZE, n*sizeof(float));
+		if (swap) swap4((char *)sig, n);
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "ReadManySacs.h"
+
+#define INGEST_SACIO 0  /* One file after the other with the sac library */
+#define INGEST_URING 1  /* Batches of open/statx/read submitted through io_uring */
+#define INGEST_PREAD 2  /* Pool of threads doing open/pread */
+
+#define INGEST_QD     64    /* Default queue depth: files being read or read and not used yet at most */
+#define INGEST_MAXQD  4096
+#define INGEST_MAXTH  32    /* Threads of the pread pool at most */
+#define SACHDRSIZE    632   /* Bytes of the binary sac header */
+
+/* Files names[0...Tr-1] read ahead into memory by a background backend, at most qd files ahead */
+/* of the one being used (cons). Only the headers are read when hdronly.                         */
+typedef struct {
+	char **names;
+	unsigned int Tr, qd, hdronly;
+	int backend;
+	char **buf;                /* Contents of the files, NULL when not read yet. */
+	size_t *size;
+	int *err, *ready;          /* errno of the read & read flag of each file */
+	unsigned int next, cons;   /* Next file to be read & file being used */
+	int stop;
+	pthread_mutex_t mtx;
+	pthread_cond_t cready, cwin;
+	pthread_t th[INGEST_MAXTH];
+	unsigned int nth;
+	void *ring;
+} t_Ingest;
+
+void SetIngest (const int backend, const unsigned int qd);
+int IngestParse (const char *str);
+t_Ingest *StartIngest (char **names, const unsigned int Tr, const int hdronly);
+int IngestGet (t_Ingest * const pi, const unsigned int tr, const char **buf, size_t *size);
+int IngestSac (t_Ingest * const pi, const unsigned int tr, t_HeaderInfo * const hdr, float * const sig, const int Nsig);
+int SacParse (t_HeaderInfo * const hdr, float * const sig, const int Nsig, const char * const buf, const size_t size);
+void StopIngest (t_Ingest * const pi);
+
+#endif
@@ -0,0 +1,245 @@
+/*****************************************************************************/
+/* Station inventory: the location, channels, sampling and time spans of    */
+/* the data of each input of PCC_fullpair_1b, read once from the headers.  */
+/* The pairs of stations can then be screened by distance and by common    */
+/* time without opening any data file (see StationInventory.c).            */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "inventory.h"
+#include "ReadManySacs.h"
+#include "sph.h"
+
+t_Inventory *ReadInventory (const char *filename) {
+	t_Inventory *pinv;
+	FILE *fid;
+	int nerr = 0;
+	
+	if (NULL == (fid = fopen(filename, "rb"))) return NULL;
+	if (NULL == (pinv = (t_Inventory *)calloc(1, sizeof(t_Inventory)) )) {
+		printf("ReadInventory: Out of memory when reading %s\n", filename);
+		fclose(fid);
+		return NULL;
+	}
+	if (1 != fread(&pinv->hdr, sizeof(t_InvHeader), 1, fid) || memcmp(pinv->hdr.magic, INVMAGIC, 8)) {
+		printf("ReadInventory: %s is not a station inventory.\n", filename);
+		nerr = 2;
+	} else if (NULL == (pinv->sta  = (t_InvStation *)malloc((pinv->hdr.nsta + 1)*sizeof(t_InvStation)) ) ||
+		NULL == (pinv->span = (t_InvSpan *)malloc((pinv->hdr.nspan + 1)*sizeof(t_InvSpan)) )) {
+		printf("ReadInventory: Out of memory when reading %s\n", filename);
+		nerr = 4;
+	} else if (pinv->hdr.nsta  != fread(pinv->sta,  sizeof(t_InvStation), pinv->hdr.nsta,  fid) ||
+		pinv->hdr.nspan != fread(pinv->span, sizeof(t_InvSpan), pinv->hdr.nspan, fid)) {
+		printf("ReadInventory: Unexpected end of %s.\n", filename);
+		nerr = 2;
+	}
+	fclose(fid);
+	if (nerr) {
+		DestroyInventory(pinv);
+		return NULL;
+	}
+	return pinv;
+}
+
+int WriteInventory (const t_Inventory * const pinv, const char *filename) {
+	FILE *fid;
+	int nerr = 0;
+	
+	if (NULL == (fid = fopen(filename, "wb"))) {
+		printf("WriteInventory: cannot create %s\n", filename);
+		return -2;
+	}
+	if (1 != fwrite(&pinv->hdr, sizeof(t_InvHeader), 1, fid) ||
+		pinv->hdr.nsta  != fwrite(pinv->sta,  sizeof(t_InvStation), pinv->hdr.nsta,  fid) ||
+		pinv->hdr.nspan != fwrite(pinv->span, sizeof(t_InvSpan), pinv->hdr.nspan, fid)) {
+		printf("WriteInventory: cannot write %s\n", filename);
+		nerr = -2;
+	}
+	if (fclose(fid)) nerr = -2;
+	return nerr;
+}
+
+void DestroyInventory (t_Inventory *pinv) {
+	if (pinv == NULL) return;
+	free(pinv->sta);
+	free(pinv->span);
+	free(pinv);
+}
+
+const t_InvStation *InventoryFind (const t_Inventory * const pinv, const char *fin) {
+	unsigned int n;
+	
+	if (pinv == NULL || fin == NULL) return NULL;
+	for (n=0; n<pinv->hdr.nsta; n++)
+		if (!strncmp(pinv->sta[n].name, fin, INVNAME)) return &pinv->sta[n];
+	return NULL;
+}
+
+int cmp_InvSpan (const void *a, const void *b) {
+	const t_InvSpan *p1 = (const t_InvSpan *)a, *p2 = (const t_InvSpan *)b;
+	
+	return (p1->t0 > p2->t0) - (p1->t0 < p2->t0);
+}
+
+/* 1 when chn is one of the comma separated channels of list. */
+int InvChannel (const char *list, const char *chn) {
+	size_t len = strlen(chn);
+	const char *p;
+	
+	for (p = list; *p; p += (*p == ',')) {
+		if (!strncmp(p, chn, len) && (p[len] == ',' || p[len] == '\0')) return 1;
+		while (*p && *p != ',') p++;
+	}
+	return 0;
+}
+
+/* Removes station n and its spans. */
+void InventoryRemove (t_Inventory * const pinv, const unsigned int n) {
+	unsigned int k, s0 = pinv->sta[n].span0, ns = pinv->sta[n].nspan;
+	
+	memmove(pinv->span + s0, pinv->span + s0 + ns, (pinv->hdr.nspan - s0 - ns)*sizeof(t_InvSpan));
+	pinv->hdr.nspan -= ns;
+	memmove(pinv->sta + n, pinv->sta + n + 1, (pinv->hdr.nsta - n - 1)*sizeof(t_InvStation));
+	pinv->hdr.nsta--;
+	for (k=0; k<pinv->hdr.nsta; k++)
+		if (pinv->sta[k].span0 > s0) pinv->sta[k].span0 -= ns;
+}
+
+/* Adds the station of fin (iformat 1: filelist of sac files, 2: msacs file) reading only */
+/* the headers, replacing the one having the same name if any.                            */
+int InventoryAdd (t_Inventory * const pinv, char *fin, const int iformat) {
+	t_HeaderInfo *hdr = NULL, *h;
+	t_InvStation st, *pst;
+	t_InvSpan *span, *pspan;
+	char **filenames = NULL;
+	unsigned int tr, Tr = 0, N, ns = 0, k;
+	size_t len;
+	int nerr = 0, enc;
+	
+	if (pinv == NULL || fin == NULL) return -1;
+	if (strlen(fin) >= INVNAME) {
+		printf("InventoryAdd: %s is too long a name (up to %d characters).\n", fin, INVNAME-1);
+		return -1;
+	}
+	
+	/* Headers */
+	if (iformat == 2) {
+		if (Read_ManySacsHeaders (&hdr, &Tr, &N, &enc, fin)) {
+			printf("InventoryAdd: cannot read %s\n", fin);
+			return -2;
+		}
+	} else {
+		if ( (nerr = CreateFilelist (&filenames, &Tr, fin)) ) {
+			printf("InventoryAdd: cannot read %s (CreateFileList error = %d)\n", fin, nerr);
+			return -2;
+		}
+		if (Tr && NULL == (hdr = (t_HeaderInfo *)malloc(Tr*sizeof(t_HeaderInfo)) )) {
+			DestroyFilelist(filenames);
+			return 4;
+		}
+		if (Tr) ReadSacHeaders (hdr, filenames, Tr);
+		DestroyFilelist(filenames);
+	}
+	
+	/* The station & its spans */
+	memset(&st, 0, sizeof(t_InvStation));
+	strcpy(st.name, fin);
+	st.iformat = (iformat == 2) ? 2 : 1;
+	st.nostloc = 1;
+	if (NULL == (span = (t_InvSpan *)malloc((Tr + 1)*sizeof(t_InvSpan)) )) {
+		free(hdr);
+		return 4;
+	}
+	for (tr=0; tr<Tr; tr++) {
+		h = &hdr[tr];
+		if (h->npts <= 0 || !(h->dt > 0)) continue;
+		if (st.ntr == 0) {
+			snprintf(st.net, sizeof(st.net), "%.8s", h->net);
+			snprintf(st.sta, sizeof(st.sta), "%.8s", h->sta);
+			snprintf(st.loc, sizeof(st.loc), "%.8s", h->loc);
+			st.dtmin = st.dtmax = h->dt;
+		}
+		if (st.nostloc && !h->nostloc) {
+			st.lat = h->stla;
+			st.lon = h->stlo;
+			st.nostloc = 0;
+		}
+		if (h->dt < st.dtmin) st.dtmin = h->dt;
+		if (h->dt > st.dtmax) st.dtmax = h->dt;
+		if (h->chn[0] && !InvChannel (st.chn, h->chn)) {  /* New channel */
+			len = strlen(st.chn);
+			if (len + strlen(h->chn) + 1 < sizeof(st.chn)) sprintf(st.chn + len, "%s%.8s", len ? "," : "", h->chn);
+		}
+		span[ns].t0 = (double)h->t + 0.001*h->msec + h->b;
+		span[ns].t1 = span[ns].t0 + h->npts*(double)h->dt;
+		ns++;
+		st.ntr++;
+	}
+	free(hdr);
+	if (st.ntr == 0) {
+		printf("InventoryAdd: no trace found in %s\n", fin);
+		free(span);
+		return 1;
+	}
+	
+	/* Contiguous traces (up to 1.5 samples apart) in one span */
+	qsort(span, ns, sizeof(t_InvSpan), cmp_InvSpan);
+	for (k=0, tr=1; tr<ns; tr++) {
+		if (span[tr].t0 <= span[k].t1 + 1.5*st.dtmax) {
+			if (span[tr].t1 > span[k].t1) span[k].t1 = span[tr].t1;
+		} else span[++k] = span[tr];
+	}
+	ns = k + 1;
+	st.t0 = (int64_t)floor(span[0].t0);
+	st.t1 = (int64_t)ceil(span[ns-1].t1);
+	
+	/* Replaces the one having the same name */
+	for (k=0; k<pinv->hdr.nsta; k++)
+		if (!strncmp(pinv->sta[k].name, fin, INVNAME)) { InventoryRemove (pinv, k); break; }
+	
+	if (NULL == (pst = (t_InvStation *)realloc(pinv->sta, (pinv->hdr.nsta + 1)*sizeof(t_InvStation)) )) nerr = 4;
+	else {
+		pinv->sta = pst;
+		if (NULL == (pspan = (t_InvSpan *)realloc(pinv->span, (pinv->hdr.nspan + ns)*sizeof(t_InvSpan)) )) nerr = 4;
+		else {
+			pinv->span = pspan;
+			st.span0 = pinv->hdr.nspan;
+			st.nspan = ns;
+			memcpy(pinv->span + st.span0, span, ns*sizeof(t_InvSpan));
+			pinv->hdr.nspan += ns;
+			pinv->sta[pinv->hdr.nsta++] = st;
+		}
+	}
+	if (nerr) printf("InventoryAdd: Out of memory when adding %s\n", fin);
+	free(span);
+	return nerr;
+}
+
+/* Interstation distance in degrees, -1 when a location is not known. */
+double InventoryDistance (const t_InvStation * const ps1, const t_InvStation * const ps2) {
+	double gcarc, lat2, lon2;
+	
+	if (ps1->nostloc || ps2->nostloc) return -1;
+	lat2 = ps2->lat * DEG2RAD;
+	lon2 = ps2->lon * DEG2RAD;
+	sph_gcarc (&gcarc, ps1->lat * DEG2RAD, ps1->lon * DEG2RAD, &lat2, &lon2, 1);
+	return gcarc * RAD2DEG;
+}
+
+/* Seconds of data recorded at both stations. */
+double InventoryOverlap (const t_Inventory * const pinv, const t_InvStation * const ps1, const t_InvStation * const ps2) {
+	const t_InvSpan *s1 = pinv->span + ps1->span0, *s2 = pinv->span + ps2->span0;
+	unsigned int i = 0, j = 0;
+	double a, b, sum = 0;
+	
+	while (i < ps1->nspan && j < ps2->nspan) {
+		a = (s1[i].t0 > s2[j].t0) ? s1[i].t0 : s2[j].t0;
+		b = (s1[i].t1 < s2[j].t1) ? s1[i].t1 : s2[j].t1;
+		if (b > a) sum += b - a;
+		if (s1[i].t1 < s2[j].t1) i++;
+		else j++;
+	}
+	return sum;
+}
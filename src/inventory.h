@@ -0,0 +1,57 @@
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stdint.h>
+#include "ReadManySacs.h"
+
+/* Station inventory: t_InvHeader, nsta t_InvStation & nspan t_InvSpan. Each station is one */
+/* input of PCC_fullpair_1b (a filelist or a msacs file) found by its name, its time spans   */
+/* being span[span0 ... span0+nspan-1], sorted and merged when contiguous.                   */
+#define INVMAGIC "PCCINV1"
+#define INVNAME  256
+
+typedef struct {
+	char     magic[8];  /* INVMAGIC               */
+	uint32_t nsta;      /* Number of stations.    */
+	uint32_t nspan;     /* Number of time spans.  */
+} t_InvHeader;
+
+typedef struct {
+	char     name[INVNAME];  /* Filelist or msacs file, as given to PCC_fullpair_1b */
+	char     net[9];
+	char     sta[9];
+	char     loc[9];
+	char     chn[37];   /* Channels, comma separated.          */
+	int32_t  iformat;   /* 1: filelist of sac files, 2: msacs. */
+	int32_t  nostloc;   /* 1: no location.                     */
+	double   lat;
+	double   lon;
+	float    dtmin;     /* Sampling periods found (s).         */
+	float    dtmax;
+	uint32_t ntr;       /* Number of traces.                   */
+	uint32_t span0;
+	uint32_t nspan;
+	int64_t  t0;        /* Beginning of the first trace & end of the last one (time_t). */
+	int64_t  t1;
+} t_InvStation;
+
+typedef struct {
+	double t0;  /* Beginning & end of the data (s since 1970). */
+	double t1;
+} t_InvSpan;
+
+typedef struct {
+	t_InvHeader  hdr;
+	t_InvStation *sta;
+	t_InvSpan    *span;
+} t_Inventory;
+
+t_Inventory *ReadInventory (const char *filename);
+int WriteInventory (const t_Inventory * const pinv, const char *filename);
+void DestroyInventory (t_Inventory *pinv);
+int InventoryAdd (t_Inventory * const pinv, char *fin, const int iformat);
+const t_InvStation *InventoryFind (const t_Inventory * const pinv, const char *fin);
+double InventoryDistance (const t_InvStation * const ps1, const t_InvStation * const ps2);
+double InventoryOverlap (const t_Inventory * const pinv, const t_InvStation * const ps1, const t_InvStation * const ps2);
+
+#endif
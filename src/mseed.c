@@ -0,0 +1,386 @@
+/*****************************************************************************/
+/* miniSEED reader (SEED 2.4 data records), so that the filelists of         */
+/* ReadManySacs can list miniSEED files, e.g., the daily files of an SDS     */
+/* archive, without converting them to sac. The records of the first        */
+/* channel found are decoded in parallel, one record per iteration, into    */
+/* the daily segment of the file: the day holding the middle of the data,   */
+/* sampled on the grid of the first record from the first sample after      */
+/* midnight. The gaps and the samples missing at both ends are zeros (see   */
+/* the gaps option of PCC_fullpair_1b).                                     */
+/*                                                                           */
+/* Steim-1 and Steim-2 records are decoded in two passes: the differences  */
+/* of all the frames, each word unpacked on its own at an offset known from */
+/* the control words (no dependency between frames), and then their running */
+/* sum from the first sample (X0), checked against the last one (Xn).       */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "mseed.h"
+#include "ReadManySacs.h"
+
+#define SEXT(v, b) ((int32_t)((uint32_t)(v) << (32-(b))) >> (32-(b)))  /* Sign extension of b bits */
+
+/* Big endian (or little endian when le) 16 & 32 bits words. */
+uint16_t ms_u16 (const unsigned char * const p, const int le) {
+	return (le) ? (uint16_t)(p[0] | p[1] << 8) : (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t ms_u32 (const unsigned char * const p, const int le) {
+	return (le) ? ((uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0]) :
+		((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+}
+
+/* Copies the n chars of s into d without the trailing blanks. */
+void ms_str (char * const d, const unsigned char * const s, const unsigned int n) {
+	unsigned int k;
+	
+	for (k=0; k<n && s[k] && s[k] != ' '; k++) d[k] = s[k];
+	d[k] = '\0';
+}
+
+/* 1 when buf begins with the fixed header of a data record. */
+int IsMseed (const char * const buf, const size_t size) {
+	const unsigned char *p = (const unsigned char *)buf;
+	unsigned int k, year, day;
+	
+	if (size < MS_FIXHDR) return 0;
+	for (k=0; k<6; k++) if ((p[k] < '0' || p[k] > '9') && p[k] != ' ') return 0;
+	if (!strchr("DRQM", p[6]) || p[6] == '\0' || (p[7] != ' ' && p[7] != '\0')) return 0;
+	year = ms_u16(p + 20, 0);
+	day  = ms_u16(p + 22, 0);
+	if (year >= 1900 && year <= 2500 && day >= 1 && day <= 366) return 1;
+	year = ms_u16(p + 20, 1);
+	day  = ms_u16(p + 22, 1);
+	return (year >= 1900 && year <= 2500 && day >= 1 && day <= 366);
+}
+
+/* Parses the header of the record at p, size bytes being available, and the network, station, */
+/* location & channel codes into id. Returns 1 if it is not a data record and 2 if it has no    */
+/* blockette 1000 or an unknown encoding (pr->reclen = 0 when not known).                      */
+int MsHeader (t_MsRecord * const pr, char id[4][8], const unsigned char * const p, const size_t size) {
+	struct tm tm;
+	unsigned int boff, next, type, k, le;
+	int16_t fact, mult;
+	int32_t corr;
+	double rate = 0;
+	float frate;
+	int usec = 0, enc = -1;
+	uint32_t u;
+	
+	memset(pr, 0, sizeof(t_MsRecord));
+	if (!IsMseed ((const char *)p, size)) return 1;
+	le = (ms_u16(p + 20, 0) < 1900 || ms_u16(p + 20, 0) > 2500 || ms_u16(p + 22, 0) < 1 || ms_u16(p + 22, 0) > 366);
+	
+	pr->nsamp   = ms_u16(p + 30, le);
+	fact        = (int16_t)ms_u16(p + 32, le);
+	mult        = (int16_t)ms_u16(p + 34, le);
+	corr        = (int32_t)ms_u32(p + 40, le);
+	pr->dataoff = ms_u16(p + 44, le);
+	if      (fact > 0 && mult > 0) rate = (double)fact * mult;
+	else if (fact > 0 && mult < 0) rate = -(double)fact / mult;
+	else if (fact < 0 && mult > 0) rate = -(double)mult / fact;
+	else if (fact < 0 && mult < 0) rate = 1/((double)fact * mult);
+	
+	/* Blockettes 1000 (encoding, word order & record length), 100 (sampling rate) & 1001 (usec) */
+	boff = ms_u16(p + 46, le);
+	for (k=0; k<32 && boff >= MS_FIXHDR && boff + 8 <= size; k++) {
+		type = ms_u16(p + boff, le);
+		next = ms_u16(p + boff + 2, le);
+		if (type == 1000) {
+			enc = p[boff + 4];
+			pr->wswap = (p[boff + 5] == 0);
+			if (p[boff + 6] >= 7 && p[boff + 6] <= 20) pr->reclen = 1u << p[boff + 6];
+		} else if (type == 100) {
+			u = ms_u32(p + boff + 4, le);
+			memcpy(&frate, &u, sizeof(float));
+			if (frate > 0) rate = frate;
+		} else if (type == 1001) usec = (int8_t)p[boff + 5];
+		if (next <= boff) break;
+		boff = next;
+	}
+	ms_str(id[0], p + 18, 2);  /* Network  */
+	ms_str(id[1], p + 8,  5);  /* Station  */
+	ms_str(id[2], p + 13, 2);  /* Location */
+	ms_str(id[3], p + 15, 3);  /* Channel  */
+	
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year  = ms_u16(p + 20, le) - 1900;
+	tm.tm_mday  = ms_u16(p + 22, le);
+	tm.tm_hour  = p[24];
+	tm.tm_min   = p[25];
+	tm.tm_sec   = p[26];
+	pr->t  = (double)my_timegm(&tm) + 1e-4*ms_u16(p + 28, le) + 1e-6*usec;
+	if (!(p[36] & 0x02)) pr->t += 1e-4*corr;  /* Time correction not applied yet */
+	pr->dt = (rate > 0) ? 1/rate : 0;
+	pr->enc = enc;
+	
+	if (pr->reclen == 0 || pr->dataoff < MS_FIXHDR || pr->dataoff >= pr->reclen) return 2;
+	if (enc != MS_INT16 && enc != MS_INT32 && enc != MS_FLOAT32 && enc != MS_FLOAT64 &&
+		enc != MS_STEIM1 && enc != MS_STEIM2) return 2;
+	return 0;
+}
+
+/* Number of differences of the Steim word w of nibble nib, -1 when not valid, and their bits b. */
+int SteimCount (const uint32_t w, const unsigned int nib, const int steim, int * const b) {
+	static const int c1[4] = {0, 4, 2, 1}, b1[4] = {0, 8, 16, 32};
+	static const int c2[4] = {-1, 1, 2, 3}, b2[4] = {0, 30, 15, 10};  /* nib 2 by dnib */
+	static const int c3[4] = {5, 6, 7, -1}, b3[4] = {6, 5, 4, 0};     /* nib 3 by dnib */
+	
+	if (steim == 1 || nib < 2) {
+		*b = b1[nib];
+		return c1[nib];
+	} else if (nib == 2) {
+		*b = b2[w >> 30];
+		return c2[w >> 30];
+	}
+	*b = b3[w >> 30];
+	return c3[w >> 30];
+}
+
+/* Differences of the nframes Steim-1 (steim = 1) or Steim-2 (steim = 2) frames at p, of big   */
+/* endian words (little endian when wswap), into d, having room for nframes*105 of them. fo:   */
+/* room for nframes+1 offsets. Returns how many, -1 when not valid, X0 & Xn into x0 & xn.     */
+int SteimDiffs (int32_t * const d, uint32_t * const fo, const unsigned char * const p, const unsigned int nframes,
+		const int steim, const int wswap, int32_t * const x0, int32_t * const xn) {
+	const unsigned char *pf;
+	int32_t *pd;
+	uint32_t ctrl, w;
+	unsigned int f, i, nib, bad = 0;
+	int c, b, j, k;
+	
+	if (nframes == 0) return -1;
+	*x0 = (int32_t)ms_u32(p + 4, wswap);
+	*xn = (int32_t)ms_u32(p + 8, wswap);
+	
+	/* Offset of the differences of each frame */
+	fo[0] = 0;
+	for (f=0; f<nframes; f++) {
+		pf   = p + f*MS_FRAME;
+		ctrl = ms_u32(pf, wswap);
+		fo[f+1] = fo[f];
+		for (i=1; i<16; i++) {
+			nib = (ctrl >> (30 - 2*i)) & 3;
+			if (f == 0 && i < 3) continue;  /* X0 & Xn */
+			c = SteimCount (ms_u32(pf + 4*i, wswap), nib, steim, &b);
+			if (c < 0) bad = 1;
+			else fo[f+1] += c;
+		}
+	}
+	if (bad) return -1;
+	
+	/* Unpacked frame by frame, word by word */
+	for (f=0; f<nframes; f++) {
+		pf   = p + f*MS_FRAME;
+		ctrl = ms_u32(pf, wswap);
+		c = 0;
+		for (i=(f == 0) ? 3 : 1; i<16; i++) {
+			nib = (ctrl >> (30 - 2*i)) & 3;
+			w   = ms_u32(pf + 4*i, wswap);
+			j   = SteimCount (w, nib, steim, &b);
+			pd  = d + fo[f] + c;
+			for (k=0; k<j; k++) pd[k] = SEXT(w >> (j-1-k)*b, b);
+			c += j;
+		}
+	}
+	return fo[nframes];
+}
+
+/* The n samples of the record rec into y. work: room for the Steim differences & frame offsets. */
+/* Returns 1 when the record cannot be decoded and 2 when the last sample is not Xn.              */
+int MsDecode (float * const y, const unsigned int n, const unsigned char * const rec, const t_MsRecord * const pr, int32_t * const work) {
+	const unsigned char *p = rec + pr->dataoff;
+	unsigned int i, nbytes = pr->reclen - pr->dataoff, nframes = nbytes/MS_FRAME;
+	int32_t x0, xn;
+	uint32_t x;
+	uint64_t v;
+	double dd;
+	float ff;
+	int m;
+	
+	if (pr->enc == MS_STEIM1 || pr->enc == MS_STEIM2) {
+		m = SteimDiffs (work, (uint32_t *)work + nframes*105, p, nframes, pr->enc - MS_STEIM1 + 1, pr->wswap, &x0, &xn);
+		if (m < (int)n) return 1;
+		x = (uint32_t)x0;
+		y[0] = (float)x0;
+		for (i=1; i<n; i++) {
+			x += (uint32_t)work[i];
+			y[i] = (float)(int32_t)x;
+		}
+		return (n && (int32_t)x != xn) ? 2 : 0;
+	} else if (pr->enc == MS_INT16) {
+		if (nbytes < 2*n) return 1;
+		for (i=0; i<n; i++) y[i] = (float)(int16_t)ms_u16(p + 2*i, pr->wswap);
+	} else if (pr->enc == MS_INT32) {
+		if (nbytes < 4*n) return 1;
+		for (i=0; i<n; i++) y[i] = (float)(int32_t)ms_u32(p + 4*i, pr->wswap);
+	} else if (pr->enc == MS_FLOAT32) {
+		if (nbytes < 4*n) return 1;
+		for (i=0; i<n; i++) {
+			x = ms_u32(p + 4*i, pr->wswap);
+			memcpy(&ff, &x, sizeof(float));
+			y[i] = ff;
+		}
+	} else if (pr->enc == MS_FLOAT64) {
+		if (nbytes < 8*n) return 1;
+		for (i=0; i<n; i++) {
+			v = (pr->wswap) ? (uint64_t)ms_u32(p + 8*i + 4, 1) << 32 | ms_u32(p + 8*i, 1) :
+				(uint64_t)ms_u32(p + 8*i, 0) << 32 | ms_u32(p + 8*i + 4, 0);
+			memcpy(&dd, &v, sizeof(double));
+			y[i] = (float)dd;
+		}
+	} else return 1;
+	return 0;
+}
+
+int cmp_MsRecord (const void *a, const void *b) {
+	const t_MsRecord *p1 = (const t_MsRecord *)a, *p2 = (const t_MsRecord *)b;
+	
+	if (p1->t != p2->t) return (p1->t < p2->t) ? -1 : 1;
+	return (p1->off > p2->off) - (p1->off < p2->off);
+}
+
+/* Parses the miniSEED file of size bytes at buf (name used in the messages): the header of its */
+/* daily segment into hdr and up to Nsig of its samples into sig (when not NULL). Returns 1 if  */
+/* it is not a miniSEED file, 2 if it has no data record that can be decoded and 4 when out of  */
+/* memory.                                                                                      */
+int MseedParse (t_HeaderInfo * const hdr, float * const sig, const int Nsig, const char * const buf, const size_t size, const char *name) {
+	const unsigned char *p = (const unsigned char *)buf;
+	t_MsRecord r, *rec = NULL, *pr;
+	char id[4][8], id0[4][8];
+	unsigned int k, K = 0, Kmax = 0, nunsup = 0, nother = 0, ntrunc = 0, ndt = 0, nbad = 0, nxn = 0, maxn = 0, maxw = 0, N, L;
+	size_t off;
+	double dt, tend, day, t0;
+	int64_t lo, hi;
+	struct tm *ptm;
+	time_t t;
+	int err, nerr = 0;
+	
+	if (!IsMseed (buf, size)) return 1;
+	
+	/* Data records of the first channel found */
+	for (off=0; off + MS_FIXHDR <= size; ) {
+		err = MsHeader (&r, id, p + off, size - off);
+		if (err == 1) { off += MS_FRAME; continue; }  /* Records are multiples of 64 bytes. */
+		if (err == 2) { nunsup++; off += (r.reclen) ? r.reclen : MS_FRAME; continue; }
+		if (off + r.reclen > size) { ntrunc++; break; }
+		r.off = off;
+		off += r.reclen;
+		if (r.nsamp == 0 || !(r.dt > 0)) continue;  /* No samples (log, timing, ... records) */
+		if (K == 0) memcpy(id0, id, sizeof(id0));
+		else if (memcmp(id, id0, sizeof(id0))) { nother++; continue; }
+		if (K == Kmax) {
+			Kmax = 2*Kmax + 64;
+			if (NULL == (pr = (t_MsRecord *)realloc(rec, Kmax*sizeof(t_MsRecord)) )) { free(rec); return 4; }
+			rec = pr;
+		}
+		rec[K++] = r;
+	}
+	if (nunsup) printf("MseedParse: %u records of %s without blockette 1000 or of an unknown encoding are skipped.\n", nunsup, name);
+	if (nother) printf("MseedParse: %u records of %s of other channels than %s.%s.%s.%s are skipped.\n", nother, name, id0[0], id0[1], id0[2], id0[3]);
+	if (ntrunc) printf("MseedParse: %s is truncated, its last record is skipped.\n", name);
+	if (K == 0) {
+		free(rec);
+		return 2;
+	}
+	
+	/* Daily segment on the sampling grid of the first record */
+	qsort(rec, K, sizeof(t_MsRecord), cmp_MsRecord);
+	dt = rec[0].dt;
+	for (k=0, pr=rec; k<K; k++) {
+		if (fabs(rec[k].dt - dt) > 1e-4*dt) { ndt++; continue; }
+		*pr++ = rec[k];
+	}
+	if (ndt) printf("MseedParse: %u records of %s having another sampling rate are skipped.\n", ndt, name);
+	K = pr - rec;
+	for (k=0, tend=rec[0].t; k<K; k++)
+		if (rec[k].t + rec[k].nsamp*dt > tend) tend = rec[k].t + rec[k].nsamp*dt;
+	day = 86400*floor(0.5*(rec[0].t + tend)/86400);
+	t0  = rec[0].t + ceil((day - rec[0].t)/dt - 1e-6)*dt;
+	N   = (unsigned int)ceil((day + 86400 - t0)/dt - 1e-6);
+	L   = (sig != NULL && Nsig < (int)N) ? (unsigned int)Nsig : N;
+	
+	/* Samples of each record copied to the segment, the ones of the next record prevailing */
+	for (k=0; k<K; k++)
+		rec[k].pos = (int64_t)floor((rec[k].t - t0)/dt + 0.5);
+	for (k=0; k<K; k++) {
+		lo = (rec[k].pos < 0) ? -rec[k].pos : 0;
+		hi = rec[k].nsamp;
+		if (rec[k].pos + hi > L) hi = L - rec[k].pos;
+		if (k+1 < K && rec[k].pos + hi > rec[k+1].pos) hi = rec[k+1].pos - rec[k].pos;
+		rec[k].n = (hi > lo) ? (uint32_t)(hi - lo) : 0;
+		if (rec[k].nsamp > maxn) maxn = rec[k].nsamp;
+		if ((rec[k].reclen - rec[k].dataoff)/MS_FRAME*106 + 1 > maxw) maxw = (rec[k].reclen - rec[k].dataoff)/MS_FRAME*106 + 1;
+	}
+	
+	memset(hdr, 0, sizeof(t_HeaderInfo));
+	t = (time_t)day;
+	ptm = gmtime(&t);
+	hdr->npts  = N;
+	hdr->dt    = (float)dt;
+	hdr->b     = (float)(t0 - day);
+	hdr->year  = ptm->tm_year + 1900;
+	hdr->yday  = ptm->tm_yday + 1;
+	hdr->t     = t;
+	hdr->nostloc = 1;
+	hdr->nocmp   = 1;
+	strcpy(hdr->net, id0[0]);
+	strcpy(hdr->sta, id0[1]);
+	strcpy(hdr->loc, id0[2]);
+	strcpy(hdr->chn, id0[3]);
+	
+	/* Records decoded in parallel, the gaps are zeros */
+	if (sig != NULL) {
+		memset(sig, 0, L*sizeof(float));
+		#pragma omp parallel default(shared) private(k, pr, lo, err) reduction(+:nbad, nxn)
+		{
+			float *y = (float *)malloc(maxn*sizeof(float));
+			int32_t *work = (int32_t *)malloc(maxw*sizeof(int32_t));
+	
+			if (y == NULL || work == NULL) {
+				#pragma omp atomic write
+				nerr = 4;
+			}
+			#pragma omp for schedule(dynamic, 16)
+			for (k=0; k<K; k++) {
+				pr = &rec[k];
+				if (pr->n == 0 || y == NULL || work == NULL) continue;
+				if ( (err = MsDecode (y, pr->nsamp, p + pr->off, pr, work)) == 1 ) { nbad++; continue; }
+				if (err == 2) nxn++;
+				lo = (pr->pos < 0) ? -pr->pos : 0;
+				memcpy(sig + pr->pos + lo, y + lo, pr->n*sizeof(float));
+			}
+			free(y);
+			free(work);
+		}
+		if (nbad) printf("MseedParse: %u records of %s cannot be decoded, their samples are zeros.\n", nbad, name);
+		if (nxn)  printf("MseedParse: WARNING, the last sample of %u records of %s is not the one expected (Xn).\n", nxn, name);
+	}
+	free(rec);
+	return nerr;
+}
+
+/* MseedParse of the file filename. Returns -2 when it cannot be read. */
+int ReadMseed (t_HeaderInfo * const hdr, float * const sig, const int Nsig, const char *filename) {
+	char *buf;
+	long size;
+	int nerr;
+	FILE *fid;
+	
+	if (NULL == (fid = fopen(filename, "rb"))) return -2;
+	if (fseek(fid, 0, SEEK_END) || (size = ftell(fid)) < 0 || fseek(fid, 0, SEEK_SET)) {
+		fclose(fid);
+		return -2;
+	}
+	if (NULL == (buf = (char *)malloc(size + 1) )) {
+		fclose(fid);
+		return 4;
+	}
+	if ((size_t)size != fread(buf, 1, size, fid)) nerr = -2;
+	else nerr = MseedParse (hdr, sig, Nsig, buf, size, filename);
+	fclose(fid);
+	free(buf);
+	return nerr;
+}
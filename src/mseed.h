@@ -0,0 +1,39 @@
+#ifndef MSEED_H
+#define MSEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ReadManySacs.h"
+
+#define MS_INT16   1   /* Data encodings of blockette 1000 */
+#define MS_INT32   3
+#define MS_FLOAT32 4
+#define MS_FLOAT64 5
+#define MS_STEIM1  10
+#define MS_STEIM2  11
+
+#define MS_FIXHDR  48  /* Bytes of the fixed header of the records */
+#define MS_FRAME   64  /* Bytes of a Steim frame (16 words)        */
+
+/* Data record of a miniSEED file. */
+typedef struct {
+	size_t   off;      /* Beginning of the record in the file.          */
+	double   t;        /* Time of its first sample (s since 1970).      */
+	double   dt;       /* Sampling period (s).                          */
+	uint32_t nsamp;    /* Number of samples.                            */
+	uint32_t reclen;   /* Record length (bytes).                        */
+	uint32_t dataoff;  /* Beginning of the data in the record.          */
+	int32_t  enc;      /* Encoding (MS_xxx).                            */
+	int32_t  wswap;    /* 1: the data words are little endian.          */
+	int64_t  pos;      /* Sample of the daily segment of its first one. */
+	uint32_t n;        /* Samples copied to the segment.                */
+} t_MsRecord;
+
+int IsMseed (const char * const buf, const size_t size);
+int SteimDiffs (int32_t * const d, uint32_t * const fo, const unsigned char * const p, const unsigned int nframes,
+	const int steim, const int wswap, int32_t * const x0, int32_t * const xn);
+int MsDecode (float * const y, const unsigned int n, const unsigned char * const rec, const t_MsRecord * const pr, int32_t * const work);
+int MseedParse (t_HeaderInfo * const hdr, float * const sig, const int Nsig, const char * const buf, const size_t size, const char *name);
+int ReadMseed (t_HeaderInfo * const hdr, float * const sig, const int Nsig, const char *filename);
+
+#endif
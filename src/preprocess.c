@@ -0,0 +1,391 @@
+/*****************************************************************************/
+/* Preprocessing of the traces of a station before the correlations.         */
+/*                                                                           */
+/* All the per-trace steps are fused in one kernel done in parallel over the */
+/* traces: signal conditioning (detrend, taper, band-pass & decimation),     */
+/* zero detection, energy, robust amplitude, polarity correction and         */
+/* clipping. The traces are then compacted once, removing the ones that are  */
+/* all zeros and the outliers.                                               */
+/*****************************************************************************/
+#include <complex.h>  /* When done before fftw3.h, makes fftw3.h use C99 complex types. */
+#include <fftw3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "preprocess.h"
+#include "rotlib.h"
+#include "resample.h"
+#include "FFTapps.h"
+#include "robust.h"
+
+#define PI 3.14159265358979323846
+
+/* Removes the least squares line of x. */
+void Detrend (float * const x, const unsigned int N) {
+	double c, da1, mean = 0, slope = 0;
+	unsigned int n;
+	
+	if (N < 2) return;
+	c = (N-1)/2.;
+	for (n=0; n<N; n++) {
+		da1 = x[n];
+		mean  += da1;
+		slope += (n-c)*da1;
+	}
+	mean /= N;
+	slope /= (double)N*((double)N*N-1)/12;  /* sum (n-c)^2 */
+	for (n=0; n<N; n++) x[n] -= (float)(mean + slope*(n-c));
+}
+
+/* Cosine tapers of Nt samples at both ends of x. */
+void CosTaper (float * const x, const unsigned int N, unsigned int Nt) {
+	float fa1;
+	unsigned int n;
+	
+	if (Nt > N/2) Nt = N/2;
+	for (n=0; n<Nt; n++) {
+		fa1 = 0.5*(1 - cos(PI*n/Nt));
+		x[n]       *= fa1;
+		x[N-1 - n] *= fa1;
+	}
+}
+
+/* Second order sections (b0, b1, b2, a1, a2) of a Butterworth low-pass (hp = 0) or high-pass  */
+/* (hp = 1) filter of corner fc (Hz) by the bilinear transform. Returns the number of sections. */
+unsigned int Butterworth_sos (double * const sos, const double fc, const double dt, const unsigned int order, const int hp) {
+	double K, Q, da1, *s = sos;
+	unsigned int k;
+	
+	K = tan(PI*fc*dt);  /* Prewarped corner */
+	for (k=0; k<order/2; k++, s+=5) {
+		Q = 1/(2*sin(PI*(2*k+1)/(2.*order)));
+		da1 = 1/(1 + K/Q + K*K);
+		s[0] = (hp) ? da1 : K*K*da1;
+		s[1] = (hp) ? -2*s[0] : 2*s[0];
+		s[2] = s[0];
+		s[3] = 2*(K*K - 1)*da1;
+		s[4] = (1 - K/Q + K*K)*da1;
+	}
+	if (order & 1) {  /* First order section */
+		s[0] = (hp) ? 1/(1+K) : K/(1+K);
+		s[1] = (hp) ? -s[0] : s[0];
+		s[2] = 0;
+		s[3] = (K-1)/(1+K);
+		s[4] = 0;
+		k++;
+	}
+	return k;
+}
+
+/* Zero-phase filtering of x by the ns second order sections sos, forward and backward. */
+void SOS_filtfilt (float * const x, const unsigned int N, const double * const sos, const unsigned int ns) {
+	double in, out, z1, z2;
+	const double *s;
+	unsigned int k;
+	int n;
+	
+	for (k=0, s=sos; k<ns; k++, s+=5) {
+		z1 = z2 = 0;
+		for (n=0; n<N; n++) {  /* Transposed direct form II */
+			in  = x[n];
+			out = s[0]*in + z1;
+			z1  = s[1]*in - s[3]*out + z2;
+			z2  = s[2]*in - s[4]*out;
+			x[n] = (float)out;
+		}
+	}
+	for (k=0, s=sos; k<ns; k++, s+=5) {
+		z1 = z2 = 0;
+		for (n=N-1; n>=0; n--) {
+			in  = x[n];
+			out = s[0]*in + z1;
+			z1  = s[1]*in - s[3]*out + z2;
+			z2  = s[2]*in - s[4]*out;
+			x[n] = (float)out;
+		}
+	}
+}
+
+/* Recursive STA/LTA detection of transients on the energy of x, STA & LTA of ns & nl samples.  */
+/* A transient starts ns samples before sta > on*lta and ends ns samples after sta < off*lta,   */
+/* the LTA being frozen meanwhile (for nl samples at most). Zero samples (gaps) are skipped.    */
+/* The transients are zeroed with cosine tapers of ns samples outside or, when dw, down-       */
+/* weighted by sqrt(lta/sta). One O(N) pass. Returns the number of samples masked or weighted. */
+unsigned int StaLta (float * const x, const unsigned int N, const unsigned int ns, const unsigned int nl, 
+		const double on, const double off, const int dw) {
+	double e, sta = 0, lta = 0, cs = 1./ns, cl = 1./nl;
+	unsigned int n, k, a, non = 0, z = 0, zend = 0, nm = 0, ne = 0;
+	int trig = 0;
+	
+	if (ns == 0 || nl == 0 || N == 0) return 0;
+	
+	/* Starts at the average energy of the first nl samples */
+	for (n=0; n<N && ne<nl; n++) 
+		if (x[n] != 0) {
+			lta += (double)x[n]*x[n];
+			ne++;
+		}
+	if (ne == 0) return 0;
+	sta = lta /= ne;
+	
+	for (n=0; n<N; n++) {
+		e = (double)x[n]*x[n];
+		if (e > 0) {
+			sta += cs*(e - sta);
+			if (!trig || n - non > nl) lta += cl*(e - lta);
+		}
+		
+		if (!trig && sta > on*lta) {
+			trig = 1;
+			non  = n;
+			if (!dw) {  /* Zeros the ns samples before, already read, and tapers the ones before them. */
+				a = (n > ns) ? n - ns : 0;
+				if (a < z) a = z;
+				for (k=a; k<n; k++) x[k] = 0;
+				nm += n - a;
+				if (a > z)
+					for (k=1; k<=ns && k<=a-z; k++) x[a-k] *= 0.5*(1 - cos(PI*k/ns));
+			}
+		} else if (trig && sta < off*lta) {
+			trig = 0;
+			zend = n + 1 + ns;
+			if (dw) zend = n;
+		}
+		
+		if (dw) {
+			if (trig) {
+				x[n] *= (float)sqrt(lta/sta);
+				nm++;
+			}
+		} else if (trig || n < zend) {
+			x[n] = 0;
+			z = n + 1;
+			nm++;
+		} else if (n < zend + ns) x[n] *= 0.5*(1 - cos(PI*(n + 1 - zend)/ns));
+	}
+	return nm;
+}
+
+/* Signal conditioning of one trace: detrend, taper, band-pass & decimation by the (1, D)      */
+/* resampler pr. b: scratch of N samples, only used when decimating. Returns the new length. */
+/* r: scratch of gap_runs_size(N, pc->gaps) to keep the gaps as zeros (NULL: none), the      */
+/* runs between them are then detrended and tapered one by one.                              */
+unsigned int ConditionTrace (float * const x, float * const b, const unsigned int N, const t_Conditioning * const pc, 
+		const double * const sos, const unsigned int ns, const t_Resampler * const pr, unsigned int * const r) {
+	unsigned int Nd, k, K = 0, Nt = (unsigned int)(pc->taper*N);
+	
+	if (r != NULL) {
+		K = GapRuns (r, x, N, pc->gaps);
+		for (k=0; k<K; k++) {
+			if (pc->detrend) Detrend (x + r[2*k], r[2*k+1] - r[2*k]);
+			if (pc->taper > 0) CosTaper (x + r[2*k], r[2*k+1] - r[2*k], Nt);
+		}
+	} else {
+		if (pc->detrend) Detrend (x, N);
+		if (pc->taper > 0) CosTaper (x, N, Nt);
+	}
+	if (ns) SOS_filtfilt (x, N, sos, ns);
+	if (r != NULL) GapZero (x, sizeof(float), r, K, N);
+	if (pr != NULL) {
+		Nd = (N + pr->q-1)/pr->q;
+		memcpy(b, x, N*sizeof(float));
+		Resample (x, Nd, b, N, pr);
+		if (r != NULL) {  /* Sample n is valid when n*q was. */
+			for (k=0; k<2*K; k++) r[k] = (r[k] + pr->q-1)/pr->q;
+			GapZero (x, sizeof(float), r, K, Nd);
+		}
+		return Nd;
+	}
+	return N;
+}
+
+/* Removes the traces that are all zeros and, when nstd > 0, the ones whose std is higher   */
+/* than nstd times the median std. polarity: corrects sign-flipped components (see         */
+/* CorrectRevesedPolarity). clip: clips at 4 times the std estimated from the median of |x|, */
+/* exact (1) or from a histogram in one pass without scratch (2, see hist_absmedian).       */
+/* pc: signal conditioning done first (NULL: none), it updates the length *pN and sampling   */
+/* period *pdt of the traces when decimating, and then the STA/LTA masking of transients,    */
+/* the fraction of samples masked is kept in the masked field of the headers.               */
+/* pc->gaps: the gaps, runs of at least pc->gaps zeros (see GapRuns), are kept as zeros and */
+/* left out of the std & the median of |x|, the other zeros being counted.                  */
+int PreprocessTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *pTr, unsigned int *pN, float *pdt, 
+		const t_Conditioning * const pc, int polarity, int clip, float nstd) {
+	unsigned int tr, Tr, Tr1, nskip, N, N0, ns = 0, D = 1, ua1, nsta = 0, nlta = 0;
+	float **x, *std, fa1 = 0, fa2 = 0;
+	double sos[5*(MAXBWORDER+2)];  /* Second order sections of the band-pass */
+	char *skip;  /* 1: all zeros, 2: outlier */
+	int nerr = 0, nerr1 = 0, gaps = (pc != NULL && pc->gaps);
+	t_HeaderInfo *phd;
+	t_Resampler *pr = NULL;
+	
+	if (xOut == NULL || SacHeader == NULL || pTr == NULL || pN == NULL || pdt == NULL) {
+		printf("PreprocessTraces: One required variable is NULL.\n");
+		return 1;
+	}
+	x   = *xOut;
+	phd = *SacHeader;
+	Tr  = *pTr;
+	N0  = *pN;
+	if (Tr == 0 || N0 == 0) return 0;
+	
+	/* Filters of the signal conditioning */
+	if (pc != NULL) {
+		ua1 = (pc->order) ? pc->order : 4;
+		if (ua1 > MAXBWORDER) ua1 = MAXBWORDER;
+		if (pc->fb[0] > 0)                                   ns += Butterworth_sos (sos + 5*ns, pc->fb[0], *pdt, ua1, 1);
+		if (pc->fb[1] > pc->fb[0] && pc->fb[1] < 0.5/(*pdt)) ns += Butterworth_sos (sos + 5*ns, pc->fb[1], *pdt, ua1, 0);
+		if (pc->D > 1) {
+			D = pc->D;
+			if (NULL == (pr = GetResampler (1, D) )) {
+				printf("PreprocessTraces: Out of memory\n");
+				return 4;
+			}
+		}
+	}
+	N = (N0 + D-1)/D;  /* Length after the conditioning */
+	if (pc != NULL && pc->stalta[1] > 0) {
+		nsta = (unsigned int)round(pc->stalta[0]/(*pdt*D));
+		nlta = (unsigned int)round(pc->stalta[1]/(*pdt*D));
+		if (nsta == 0) nsta = 1;
+		if (nlta <= nsta) {
+			printf("PreprocessTraces: Warning, the LTA must be longer than the STA, no transient masking.\n");
+			nlta = 0;
+		}
+	}
+	
+	std  = (float *)malloc(2*Tr*sizeof(float));
+	skip = (char *)calloc(Tr, sizeof(char));
+	if (std == NULL || skip == NULL) {
+		printf("PreprocessTraces: Out of memory\n");
+		free(std);
+		free(skip);
+		return 4;
+	}
+	
+	#pragma omp parallel
+	{
+		float *a = NULL, *b = NULL, *px, fa1, fa2;
+		double da1;
+		unsigned int n, n1 = 0, n2 = N, k, K = 1, Nv, *r = NULL;
+		int tr, sgn;
+		
+		#pragma omp critical
+		{
+			/* Scratch of the median of |x|, of the decimation and of the gaps, one per thread. */
+			if (clip == 1 && NULL == (a = (float *)malloc(N*sizeof(float)) )) nerr = 1;
+			if (D > 1 && NULL == (b = (float *)malloc(N0*sizeof(float)) )) nerr1 = 4;
+			if (gaps && NULL == (r = (unsigned int *)malloc(gap_runs_size(N0, pc->gaps)*sizeof(unsigned int)) )) nerr1 = 4;
+		}
+		
+		#pragma omp for schedule(static)
+		for (tr=0; tr<Tr; tr++) {
+			px = x[tr];
+			
+			/* Signal conditioning & transients */
+			if (pc != NULL && (D == 1 || b != NULL) && (!gaps || r != NULL)) ConditionTrace (px, b, N0, pc, sos, ns, pr, r);
+			if (nlta) phd[tr].masked = (float)StaLta (px, N, nsta, nlta, pc->stalta[2], pc->stalta[3], pc->downweight) / N;
+			
+			/* First pass: energy (0 only when all zeros) & |x|, of the K valid runs when gaps. */
+			if (r != NULL) K = GapRuns (r, px, N, pc->gaps);
+			da1 = 0;
+			Nv  = 0;
+			for (k=0; k<K; k++) {
+				if (r != NULL) {
+					n1 = r[2*k];
+					n2 = r[2*k+1];
+				}
+				for (n=n1; n<n2; n++) {
+					fa1 = px[n];
+					da1 += (double)fa1*fa1;
+					if (a != NULL) a[Nv] = fabsf(fa1);
+					Nv++;
+				}
+			}
+			
+			if (da1 == 0) {
+				skip[tr] = 1;
+				continue;
+			}
+			std[tr] = (float)sqrt(da1/Nv);  /* The signal should have no mean. */
+			
+			/* Second pass: polarity & clipping */
+			sgn = (polarity && ReversedPolarity (phd + tr)) ? -1 : 1;
+			if (clip) {
+				fa2 = 4*((a != NULL) ? qselect_median(a, Nv) : hist_absmedian(px, N, std[tr], r, K)) / 0.6745;
+				for (n=0; n<N; n++) {
+					fa1 = sgn*px[n];
+					if (fabsf(fa1) > fa2) fa1 = (fa1 > fa2) ? fa2 : -fa2;
+					px[n] = fa1;
+				}
+			} else if (sgn < 0)
+				for (n=0; n<N; n++) px[n] = -px[n];
+		}
+		
+		#pragma omp critical
+		{
+			free(a);
+			free(b);
+			free(r);
+		}
+	}
+	if (nerr) printf("PreprocessTraces: Out of memory, the medians of the clipping are estimated from histograms\n");
+	if (nerr1) {
+		printf("PreprocessTraces: Out of memory, the traces could not be conditioned\n");
+		free(skip);
+		free(std);
+		return nerr1;
+	}
+	if (D > 1) {
+		for (tr=0; tr<Tr; tr++) {
+			phd[tr].dt  *= D;
+			phd[tr].npts = ((unsigned)phd[tr].npts < N0) ? (phd[tr].npts + D-1)/D : N;  /* Valid samples */
+		}
+		*pdt *= D;
+		*pN   = N;
+	}
+	if (nlta) {
+		for (tr=0; tr<Tr; tr++) {
+			fa1 += phd[tr].masked;
+			if (fa2 < phd[tr].masked) fa2 = phd[tr].masked;
+		}
+		printf("PreprocessTraces: STA/LTA %s %.2f%% of the samples (%.2f%% at most on one trace)\n", 
+			(pc->downweight) ? "down-weighted" : "masked", 100*fa1/Tr, 100*fa2);
+		fa1 = 0;
+	}
+	
+	/* Outliers: traces having much higher energy than the other ones. */
+	if (nstd > 0) {
+		for (Tr1=0, tr=0; tr<Tr; tr++)
+			if (!skip[tr]) std[Tr + Tr1++] = std[tr];
+		fa1 = qselect_median(std + Tr, Tr1);
+		if (fa1 == 0) printf("PreprocessTraces: 0 average std!\n");
+		for (tr=0; tr<Tr; tr++)
+			if (!skip[tr] && std[tr] > nstd * fa1) skip[tr] = 2;
+	}
+	
+	/* Compaction */
+	nskip = 0;
+	for (tr=0; tr<Tr; tr++) {
+		if (skip[tr]) {
+			nskip++;
+			fftw_free(x[tr]); x[tr] = NULL;
+			if (skip[tr] == 1)
+				printf("PreprocessTraces: Skipping %s.%s.%s.%s at %4d-%03d %02d:%02d:%02d, it's all zeros!\n",
+					phd[tr].net, phd[tr].sta, phd[tr].loc, phd[tr].chn, phd[tr].year, phd[tr].yday,
+					phd[tr].hour, phd[tr].min, phd[tr].sec);
+			else
+				printf("PreprocessTraces: Skipping %s.%s.%s.%s, the std is %f times the average std!\n",
+					phd[tr].net, phd[tr].sta, phd[tr].loc, phd[tr].chn, std[tr]/fa1);
+		} else if (nskip) {
+			memcpy (&phd[tr-nskip], &phd[tr], sizeof(t_HeaderInfo));
+			x[tr-nskip] = x[tr];
+		}
+	}
+	*pTr = Tr - nskip;
+	
+	free(skip);
+	free(std);
+	return 0;
+}
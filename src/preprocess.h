@@ -0,0 +1,34 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include "ReadManySacs.h"
+#include "resample.h"
+
+#define MAXBWORDER 16  /* Maximum order of the Butterworth filters */
+
+/* Signal conditioning of the traces before the other preprocessing steps. */
+typedef struct {
+	int detrend;        /* 1: removes the linear trend. */
+	double taper;       /* Length of the cosine tapers at each end as a fraction of the trace (0: none). */
+	double fb[2];       /* Corners of the zero-phase Butterworth band-pass in Hz (0: none). */
+	unsigned int order; /* Order of the Butterworth filters (0: 4). */
+	unsigned int D;     /* Decimation factor (0 or 1: none). */
+	int gaps;           /* 1: the gaps, runs of at least GAPMIN zeros, are kept as zeros. */
+	double stalta[4];   /* Recursive STA/LTA: STA & LTA lengths in s, trigger on & off energy ratios (stalta[1] = 0: none). */
+	int downweight;     /* 1: the transients are down-weighted by sqrt(lta/sta) instead of masked (zeroed). */
+} t_Conditioning;
+
+void Detrend (float * const x, const unsigned int N);
+void CosTaper (float * const x, const unsigned int N, unsigned int Nt);
+unsigned int Butterworth_sos (double * const sos, const double fc, const double dt, const unsigned int order, const int hp);
+void SOS_filtfilt (float * const x, const unsigned int N, const double * const sos, const unsigned int ns);
+unsigned int ConditionTrace (float * const x, float * const b, const unsigned int N, const t_Conditioning * const pc, 
+	const double * const sos, const unsigned int ns, const t_Resampler * const pr, unsigned int * const r);
+
+unsigned int StaLta (float * const x, const unsigned int N, const unsigned int ns, const unsigned int nl, 
+	const double on, const double off, const int dw);
+
+int PreprocessTraces (float **xOut[], t_HeaderInfo *SacHeader[], unsigned int *pTr, unsigned int *pN, float *pdt, 
+	const t_Conditioning * const pc, int polarity, int clip, float nstd);
+
+#endif
@@ -0,0 +1,189 @@
+/*****************************************************************************/
+/* Reduced-precision storage of traces and correlations: float16, bfloat16  */
+/* or int16 with a scale factor per record, halving the size of the files.  */
+/*                                                                           */
+/* The conversions round to nearest even. They use F16C (float16) and       */
+/* AVX512-BF16 (bfloat16) when compiled for them (e.g., -march=native), the */
+/* scalar loops being the fallback and the reference. AVX512-BF16 flushes   */
+/* the subnormal inputs to zero.                                            */
+/*****************************************************************************/
+#include <string.h>
+#include <math.h>
+#include "quantize.h"
+#if defined(__F16C__) || defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
+
+typedef union {
+	float    f;
+	uint32_t u;
+} t_fu32;
+
+/* Bytes per sample */
+unsigned int EncSize (const int enc) {
+	return (enc == ENC_F32) ? 4 : 2;
+}
+
+const char *EncName (const int enc) {
+	switch (enc) {
+		case ENC_F16:  return "f16";
+		case ENC_BF16: return "bf16";
+		case ENC_I16:  return "i16";
+	}
+	return "f32";
+}
+
+/* Encoding named str (f32, f16, bf16 or i16). Returns 0 on success. */
+int EncParse (int * const enc, const char * const str) {
+	int k;
+	
+	for (k=ENC_F32; k<=ENC_I16; k++)
+		if (!strcmp(str, EncName(k))) {
+			*enc = k;
+			return 0;
+		}
+	return 1;
+}
+
+/* float to IEEE half, overflows going to inf. */
+uint16_t float2half (const float f) {
+	t_fu32 v, m = {0.5f};  /* m: magic number of the subnormals */
+	uint32_t sign;
+	
+	v.f  = f;
+	sign = (v.u >> 16) & 0x8000;
+	v.u &= 0x7fffffff;
+	if (v.u >= 0x47800000) return sign | ((v.u > 0x7f800000) ? 0x7e00 : 0x7c00);  /* inf & NaN */
+	if (v.u < 0x38800000) {  /* Subnormal or zero */
+		v.f += m.f;
+		return sign | (uint16_t)(v.u - m.u);
+	}
+	v.u += 0xc8000fff + ((v.u >> 13) & 1);  /* Rebias & round */
+	return sign | (uint16_t)(v.u >> 13);
+}
+
+float half2float (const uint16_t h) {
+	t_fu32 v, m = {0};
+	uint32_t e;
+	
+	m.u = 113 << 23;
+	v.u = (uint32_t)(h & 0x7fff) << 13;
+	e   = v.u & 0x0f800000;
+	v.u += (127 - 15) << 23;
+	if (e == 0x0f800000) v.u += (128 - 16) << 23;  /* inf & NaN */
+	else if (e == 0) {  /* Subnormal or zero */
+		v.u += 1 << 23;
+		v.f -= m.f;
+	}
+	v.u |= (uint32_t)(h & 0x8000) << 16;
+	return v.f;
+}
+
+uint16_t float2bf16 (const float f) {
+	t_fu32 v;
+	
+	v.f = f;
+	if ((v.u & 0x7fffffff) > 0x7f800000) return (uint16_t)((v.u >> 16) | 0x40);  /* Quiet NaN */
+	return (uint16_t)((v.u + 0x7fff + ((v.u >> 16) & 1)) >> 16);
+}
+
+float bf162float (const uint16_t h) {
+	t_fu32 v;
+	
+	v.u = (uint32_t)h << 16;
+	return v.f;
+}
+
+/* Encodes x[0...N-1] into q (N*EncSize(enc) bytes). Returns the scale factor, x being   */
+/* about scale*q. err: relative rms error of the encoding when not NULL.                 */
+float EncodeSamples (void * const q, const float * const x, const unsigned int N, const int enc, double * const err) {
+	uint16_t *q16 = (uint16_t *)q;
+	int16_t *qi = (int16_t *)q;
+	float fa1, max = 0, scale = 1, inv;
+	double e = 0, s = 0, d;
+	unsigned int n = 0;
+	int k;
+	
+	if (enc == ENC_F32) {
+		memcpy(q, x, N*sizeof(float));
+		if (err != NULL) *err = 0;
+		return 1;
+	}
+	if (enc == ENC_F16 || enc == ENC_I16) {
+		for (n=0; n<N; n++) 
+			if (max < fabsf(x[n])) max = fabsf(x[n]);
+		if (max > 0 && enc == ENC_I16) scale = max/32767;
+		if (max > 0 && enc == ENC_F16) {  /* max/scale in [2^14, 2^15) */
+			frexpf(max, &k);
+			scale = ldexpf(1, k - 15);
+		}
+	}
+	inv = 1/scale;
+	
+	n = 0;
+	switch (enc) {
+		case ENC_F16:
+#ifdef __F16C__
+			for (; n+8<=N; n+=8) 
+				_mm_storeu_si128((__m128i *)(q16 + n), _mm256_cvtps_ph(_mm256_mul_ps(_mm256_loadu_ps(x + n), _mm256_set1_ps(inv)), 
+					_MM_FROUND_TO_NEAREST_INT));
+#endif
+			for (; n<N; n++) q16[n] = float2half(inv*x[n]);
+			break;
+		case ENC_BF16:
+#ifdef __AVX512BF16__
+			for (; n+16<=N; n+=16) {
+				__m256bh b = _mm512_cvtneps_pbh(_mm512_loadu_ps(x + n));
+				memcpy(q16 + n, &b, 32);
+			}
+#endif
+			for (; n<N; n++) q16[n] = float2bf16(x[n]);
+			break;
+		case ENC_I16:
+			for (; n<N; n++) {
+				fa1 = inv*x[n];
+				qi[n] = (int16_t)(fa1 + ((fa1 < 0) ? -0.5f : 0.5f));
+			}
+			break;
+	}
+	
+	if (err != NULL) {
+		for (n=0; n<N; n++) {
+			switch (enc) {
+				case ENC_F16:  d = scale*half2float(q16[n]); break;
+				case ENC_BF16: d = bf162float(q16[n]);       break;
+				default:       d = scale*qi[n];
+			}
+			e += (d - x[n])*(d - x[n]);
+			s += (double)x[n]*x[n];
+		}
+		*err = (s > 0) ? sqrt(e/s) : 0;
+	}
+	return scale;
+}
+
+/* Decodes N samples of q, encoded by enc with scale, into x. */
+void DecodeSamples (float * const x, const void * const q, const unsigned int N, const int enc, const float scale) {
+	const uint16_t *q16 = (const uint16_t *)q;
+	const int16_t *qi = (const int16_t *)q;
+	unsigned int n = 0;
+	
+	switch (enc) {
+		case ENC_F32:
+			memcpy(x, q, N*sizeof(float));
+			break;
+		case ENC_F16:
+#ifdef __F16C__
+			for (; n+8<=N; n+=8) 
+				_mm256_storeu_ps(x + n, _mm256_mul_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(q16 + n))), _mm256_set1_ps(scale)));
+#endif
+			for (; n<N; n++) x[n] = scale*half2float(q16[n]);
+			break;
+		case ENC_BF16:
+			for (; n<N; n++) x[n] = bf162float(q16[n]);
+			break;
+		case ENC_I16:
+			for (; n<N; n++) x[n] = scale*qi[n];
+			break;
+	}
+}
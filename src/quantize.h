@@ -0,0 +1,22 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+
+/* Encodings of the stored samples */
+#define ENC_F32  0  /* float32 */
+#define ENC_F16  1  /* IEEE float16 of x/scale, scale being a power of 2 */
+#define ENC_BF16 2  /* bfloat16 */
+#define ENC_I16  3  /* int16 of x/scale, scale = max|x|/32767 */
+
+unsigned int EncSize (const int enc);
+const char *EncName (const int enc);
+int EncParse (int * const enc, const char * const str);
+uint16_t float2half (const float f);
+float half2float (const uint16_t h);
+uint16_t float2bf16 (const float f);
+float bf162float (const uint16_t h);
+float EncodeSamples (void * const q, const float * const x, const unsigned int N, const int enc, double * const err);
+void DecodeSamples (float * const x, const void * const q, const unsigned int N, const int enc, const float scale);
+
+#endif
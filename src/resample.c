@@ -0,0 +1,142 @@
+/*****************************************************************************/
+/* Rational polyphase resampling, used to bring traces recorded at different */
+/* sampling rates to a common one while reading them.                        */
+/*                                                                           */
+/* The anti-aliasing/interpolation filter is a Blackman windowed sinc of     */
+/* 32*max(p,q)+1 taps at the upsampled rate cutting at 0.8 times the lower   */
+/* Nyquist frequency. Only the kept output samples are computed, each one by */
+/* a single phase of Kp = 32*max(p,q)/p + 1 taps.                            */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "resample.h"
+
+#define PI 3.14159265358979323846
+#define MAXPQ 1000  /* Maximum p and q */
+
+t_Resampler *ResamplerCache = NULL;
+
+/* Smallest p/q (p, q <= MAXPQ) equal to dtin/dtout within 1e-6, by continued fractions. */
+/* Returns 0 on success, 1 when there is no such ratio.                                  */
+int Resampling_ratio (unsigned int * const p, unsigned int * const q, const double dtin, const double dtout) {
+	double r, a, x;
+	unsigned long p0=0, q0=1, p1=1, q1=0, p2, q2;
+	unsigned int k;
+	
+	if (!(dtin > 0 && dtout > 0)) return 1;
+	r = x = dtin/dtout;
+	for (k=0; k<64; k++) {
+		a  = floor(x);
+		p2 = (unsigned long)a*p1 + p0;
+		q2 = (unsigned long)a*q1 + q0;
+		if (p2 > MAXPQ || q2 > MAXPQ) break;
+		p0 = p1; q0 = q1; p1 = p2; q1 = q2;
+		if (fabs((double)p1/q1 - r) <= 1e-6*r) {
+			*p = p1;
+			*q = q1;
+			return 0;
+		}
+		if (x - a < 1e-12) break;
+		x = 1/(x - a);
+	}
+	return 1;
+}
+
+t_Resampler *CreateResampler (const unsigned int p, const unsigned int q) {
+	t_Resampler *pr;
+	double da1, fc, sum = 0, *h;
+	unsigned int k, j, ph, K, H, R = (p > q) ? p : q;
+	
+	K  = 32*R + 1;
+	H  = 16*R;
+	fc = 0.4/R;  /* In cycles per sample of the upsampled sequence */
+	if (NULL == (pr = (t_Resampler *)malloc(sizeof(t_Resampler)) )) return NULL;
+	pr->p  = p;
+	pr->q  = q;
+	pr->Kp = (K + p-1)/p;
+	pr->c  = H;
+	pr->next = NULL;
+	h = (double *)malloc(K*sizeof(double));
+	pr->h = (float *)calloc(p*pr->Kp, sizeof(float));
+	if (h == NULL || pr->h == NULL) {
+		free(h);
+		free(pr->h);
+		free(pr);
+		return NULL;
+	}
+	
+	for (k=0; k<K; k++) {
+		da1 = (k == H) ? 2*fc : sin(2*PI*fc*((double)k-H))/(PI*((double)k-H));
+		h[k] = da1 * (0.42 - 0.5*cos(2*PI*k/(K-1)) + 0.08*cos(4*PI*k/(K-1)));
+		sum += h[k];
+	}
+	da1 = p/sum;  /* Gain p to compensate the zeros of the upsampling */
+	
+	/* Phase ph: taps ph + j*p, reversed */
+	for (ph=0; ph<p; ph++)
+		for (j=0; ph + j*p < K; j++) 
+			pr->h[ph*pr->Kp + pr->Kp-1 - j] = (float)(da1*h[ph + j*p]);
+	
+	free(h);
+	return pr;
+}
+
+void DestroyResampler (t_Resampler *pr) {
+	if (pr == NULL) return;
+	free(pr->h);
+	free(pr);
+}
+
+/* Resampler of (p, q) from the cache, created when not found. NULL when out of memory. */
+t_Resampler *GetResampler (const unsigned int p, const unsigned int q) {
+	t_Resampler *pr;
+	
+	#pragma omp critical (ResamplerCache)
+	{
+		for (pr = ResamplerCache; pr != NULL; pr = pr->next) 
+			if (pr->p == p && pr->q == q) break;
+		if (pr == NULL && NULL != (pr = CreateResampler (p, q) )) {
+			pr->next = ResamplerCache;
+			ResamplerCache = pr;
+		}
+	}
+	return pr;
+}
+
+void ClearResamplerCache () {
+	t_Resampler *pr;
+	
+	#pragma omp critical (ResamplerCache)
+	{
+		while (ResamplerCache != NULL) {
+			pr = ResamplerCache->next;
+			DestroyResampler (ResamplerCache);
+			ResamplerCache = pr;
+		}
+	}
+}
+
+/* The first Ny samples of x (Nx samples) resampled by p/q, zeros are assumed outside x. */
+/* y[m] = sum_i h[ph][i] * x[n - Kp+1 + i], with n = (m*q + c)/p & ph = (m*q + c)%p.      */
+/* y and x must not overlap.                                                              */
+void Resample (float * const y, const unsigned int Ny, const float * const x, const unsigned int Nx, const t_Resampler * const pr) {
+	const unsigned int p = pr->p, q = pr->q, Kp = pr->Kp;
+	const float *h, *px;
+	unsigned long t;
+	long n0;
+	unsigned int m, i, i1, i2;
+	float fa1;
+	
+	for (m=0; m<Ny; m++) {
+		t  = (unsigned long)m*q + pr->c;
+		h  = pr->h + (t % p)*Kp;
+		n0 = (long)(t/p) - (long)Kp + 1;  /* Input sample of h[ph][0] */
+		i1 = (n0 < 0) ? -n0 : 0;
+		i2 = (n0 + (long)Kp > (long)Nx) ? (n0 < (long)Nx ? Nx - n0 : 0) : Kp;
+		px = x + n0;
+		fa1 = 0;
+		for (i=i1; i<i2; i++) fa1 += h[i]*px[i];
+		y[m] = fa1;
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+/* Rational resampler by p/q (output rate = p/q times the input rate): polyphase FIR */
+/* of p phases of Kp taps each, stored reversed so that every output is a contiguous  */
+/* dot product. Cached per (p, q).                                                    */
+typedef struct s_Resampler {
+	unsigned int p, q, Kp, c;
+	float *h;
+	struct s_Resampler *next;
+} t_Resampler;
+
+int Resampling_ratio (unsigned int * const p, unsigned int * const q, const double dtin, const double dtout);
+t_Resampler *CreateResampler (const unsigned int p, const unsigned int q);
+void DestroyResampler (t_Resampler *pr);
+t_Resampler *GetResampler (const unsigned int p, const unsigned int q);
+void ClearResamplerCache ();
+void Resample (float * const y, const unsigned int Ny, const float * const x, const unsigned int Nx, const t_Resampler * const pr);
+
+#endif
@@ -0,0 +1,85 @@
+/*****************************************************************************/
+/* Robust amplitudes (median of |x|) for the clipping and the rejection of   */
+/* outliers, all in linear time.                                             */
+/*                                                                           */
+/* The exact median is found by quickselect in place on a scratch copy. For  */
+/* very long traces the median of |x| can instead be estimated in one pass   */
+/* without any copy from a histogram on [0, sqrt(2)*rms], where it must lie  */
+/* (Markov: P(x^2 >= 2*rms^2) <= 1/2), interpolating inside the bin found.   */
+/* Its error is below sqrt(2)*rms/HISTBINS.                                  */
+/*****************************************************************************/
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include "robust.h"
+
+/* k-th smallest element of a[0...n-1] by quickselect, a is reordered so that */
+/* a[0...k-1] <= a[k] <= a[k+1...n-1].                                         */
+float qselect (float *a, const unsigned int n, const unsigned int k) {
+	int i, j, l, m;
+	float x, t;
+	
+	if (k >= n) return 0;
+	l = 0; m = n-1;
+	while (l < m) {
+		x = a[k];
+		i = l; j = m;
+		do {
+			while (a[i] < x) i++;
+			while (x < a[j]) j--;
+			if (i <= j) {
+				t = a[i];
+				a[i] = a[j];
+				a[j] = t;
+				i++; j--;
+			}
+		} while (i <= j);
+		if (j < (int)k) l = i;
+		if ((int)k < i) m = j;
+	}
+	return a[k];
+}
+
+/* Median of a[0...n-1] by quickselect, a is reordered. */
+float qselect_median (float *a, const unsigned int n) {
+	unsigned int i, k = n/2;
+	float t;
+	
+	if (n == 0) return 0;
+	qselect (a, n, k);
+	if (n % 2) return a[k];
+	t = -FLT_MAX;
+	for (i=0; i<k; i++)
+		if (t < a[i]) t = a[i];
+	return (a[k] + t)/2;
+}
+
+/* Estimate of the median of |x[0...N-1]| from a histogram, rms being the root mean  */
+/* square of x. r: only the samples of the K runs r[2k] ... r[2k+1]-1 are counted     */
+/* (rms must then be the one of these samples), NULL: all. One pass, no allocation.   */
+float hist_absmedian (const float * const x, const unsigned int N, const float rms, const unsigned int * const r, const unsigned int K) {
+	unsigned int h[HISTBINS], n, n1 = 0, n2 = N, b, k, Nv = 0, c = 0;
+	float fa1, s;
+	
+	if (!(rms > 0)) return 0;
+	for (b=0; b<HISTBINS; b++) h[b] = 0;
+	s = HISTBINS/(sqrtf(2)*rms);
+	for (k=0; k<((r != NULL) ? K : 1); k++) {
+		if (r != NULL) {
+			n1 = r[2*k];
+			n2 = r[2*k+1];
+		}
+		for (n=n1; n<n2; n++) {
+			fa1 = fabsf(x[n]) * s;
+			if (fa1 < HISTBINS) h[(unsigned int)fa1]++;
+		}
+		Nv += n2 - n1;
+	}
+	
+	k = Nv/2;  /* Bin of the (k+1)-th smallest */
+	for (b=0; b<HISTBINS; b++) {
+		if (c + h[b] > k) return (b + (k - c + 0.5f)/h[b]) / s;
+		c += h[b];
+	}
+	return HISTBINS/s;
+}
@@ -0,0 +1,10 @@
+#ifndef ROBUST_H
+#define ROBUST_H
+
+#define HISTBINS 4096  /* Bins of the histogram estimate of the median of |x| */
+
+float qselect (float *a, const unsigned int n, const unsigned int k);
+float qselect_median (float *a, const unsigned int n);
+float hist_absmedian (const float * const x, const unsigned int N, const float rms, const unsigned int * const r, const unsigned int K);
+
+#endif
@@ -11,24 +11,30 @@
 #include <math.h>
 #include "sph.h"
 
+/* Returns 1 when the component of Header is reversed, fixing cmpinc & cmpaz. */
+int ReversedPolarity (t_HeaderInfo *Header) {
+	float cmpinc = Header->cmpinc, cmpaz = Header->cmpaz;
+	
+	if (cmpinc == 180) {
+		Header->cmpinc = 0;
+		return 1;
+	} else if (cmpinc == 90) {
+		if (cmpaz < 315 && cmpaz > 135) {
+			Header->cmpaz -= 180;
+			if (Header->cmpaz < 0) Header->cmpaz += 360;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void CorrectRevesedPolarity (float **x, unsigned int N, unsigned int Tr, t_HeaderInfo *Header) {
 	unsigned int n, tr; 
-	float cmpinc, cmpaz, *px;
+	float *px;
 	
 	for (tr=0; tr<Tr; tr++) {
-		cmpinc = Header[tr].cmpinc;
-		cmpaz  = Header[tr].cmpaz;
 		px = x[tr];
-		
-		if (cmpinc == 180) {
+		if (ReversedPolarity (Header + tr)) 
 			for (n=0; n<N; n++) px[n] = -px[n];
-			Header[tr].cmpinc = 0;
-		} else if (cmpinc == 90) {
-			if (cmpaz < 315 && cmpaz > 135) {
-				for (n=0; n<N; n++) px[n] = -px[n];
-				Header[tr].cmpaz -= 180;
-				if (Header[tr].cmpaz < 0) Header[tr].cmpaz += 360;
-			}
-		}
 	}
 }
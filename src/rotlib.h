@@ -3,6 +3,7 @@
 
 #include "ReadManySacs.h"
 
+int ReversedPolarity (t_HeaderInfo *Header);
 void CorrectRevesedPolarity (float **x, unsigned int N, unsigned int Tr, t_HeaderInfo *Header); /* Not done for 3C */
 
 #endif
@@ -0,0 +1,235 @@
+/*****************************************************************************/
+/* Network correlation tensor: all the pairs on a common grid of time slots  */
+/* & lags in one memory mapped float32 file, for beamforming & tomography.  */
+/*                                                                           */
+/* Each run appends the rows of its pair (one per channels & method) to the */
+/* index under an fcntl lock, so that many runs can share a tensor, which   */
+/* grows sparse. The rows are mapped and the correlations computed straight */
+/* into their slots by the worker threads, without any copy or writing      */
+/* step. The slots written are flagged in the mask when closing.            */
+/*****************************************************************************/
+#define _POSIX_C_SOURCE 200809L  /* pread, pwrite, ftruncate, fcntl & mmap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "tensor.h"
+
+/* Waits for the lock type (F_WRLCK or F_UNLCK) of the whole file fd. */
+int TenLock (const int fd, const short type) {
+	struct flock fl;
+	
+	memset(&fl, 0, sizeof(struct flock));
+	fl.l_type   = type;
+	fl.l_whence = SEEK_SET;
+	return fcntl(fd, F_SETLKW, &fl);
+}
+
+/* Opens the tensor name, created with L lags from lag1 sampled at dt & T slots of step */
+/* seconds from t0 when it does not exist. Otherwise its time slots are kept and L, dt  */
+/* & lag1 must be the same. Returns NULL on errors.                                     */
+t_Tensor *OpenTensor (const char *name, const unsigned int L, const float dt, const float lag1, const int64_t t0, 
+		const double step, const unsigned int T) {
+	t_Tensor *pt;
+	t_TensorHeader *hdr;
+	struct stat st;
+	char *fname;
+	int nerr = 0;
+	
+	pt    = (t_Tensor *)calloc(1, sizeof(t_Tensor));
+	fname = (char *)malloc(strlen(name) + 5);
+	if (pt == NULL || fname == NULL) {
+		printf("OpenTensor: Out of memory\n");
+		free(pt);
+		free(fname);
+		return NULL;
+	}
+	hdr = &pt->hdr;
+	pt->fd = pt->fdi = pt->fdm = -1;
+	
+	sprintf(fname, "%s.idx", name);
+	if (-1 == (pt->fdi = open(fname, O_RDWR | O_CREAT, 0644)) || TenLock(pt->fdi, F_WRLCK) || fstat(pt->fdi, &st)) nerr = 2;
+	else if (st.st_size == 0) {  /* New tensor */
+		memcpy(hdr->magic, TENMAGIC, 8);
+		hdr->L     = L;
+		hdr->T     = T;
+		hdr->dt    = dt;
+		hdr->lag1  = lag1;
+		hdr->t0    = t0;
+		hdr->step  = step;
+		hdr->nrows = 0;
+		if (sizeof(t_TensorHeader) != pwrite(pt->fdi, hdr, sizeof(t_TensorHeader), 0)) nerr = 2;
+	} else if (sizeof(t_TensorHeader) != pread(pt->fdi, hdr, sizeof(t_TensorHeader), 0) || strncmp(hdr->magic, TENMAGIC, 8)) 
+		nerr = 2;
+	else if (hdr->L != L || hdr->dt != dt || hdr->lag1 != lag1) {
+		printf("OpenTensor: %s is a tensor of %u lags from %g s at %g s\n", name, hdr->L, hdr->lag1, hdr->dt);
+		nerr = 3;
+	}
+	if (pt->fdi != -1) TenLock(pt->fdi, F_UNLCK);
+	
+	if (!nerr) {
+		sprintf(fname, "%s.msk", name);
+		if (-1 == (pt->fd = open(name, O_RDWR | O_CREAT, 0644)) || -1 == (pt->fdm = open(fname, O_RDWR | O_CREAT, 0644))) nerr = 2;
+	}
+	if (nerr) {
+		if (nerr == 2) printf("OpenTensor: Cannot open the tensor %s\n", name);
+		if (pt->fd  != -1) close(pt->fd);
+		if (pt->fdi != -1) close(pt->fdi);
+		if (pt->fdm != -1) close(pt->fdm);
+		free(pt);
+		pt = NULL;
+	}
+	free(fname);
+	return pt;
+}
+
+/* Row of key (see ArcKey), appended to the tensor when new, mapped. NULL on errors. */
+t_TensorRow *TensorRow (t_Tensor * const pt, const char * const key) {
+	t_TensorHeader *hdr = &pt->hdr;
+	t_TensorRow *pr;
+	char keys[64*ARCKEY];
+	uint64_t r, k, n, off;
+	size_t rsize, pg;
+	struct stat st;
+	int nerr = 0;
+	
+	for (k=0; k<pt->nrows; k++)
+		if (!memcmp(pt->rows[k].key, key, ARCKEY)) return pt->rows + k;
+	if (NULL == (pr = (t_TensorRow *)realloc(pt->rows, (pt->nrows + 1)*sizeof(t_TensorRow)) )) {
+		printf("TensorRow: Out of memory\n");
+		return NULL;
+	}
+	pt->rows = pr;
+	pr = pt->rows + pt->nrows;
+	memset(pr, 0, sizeof(t_TensorRow));
+	memcpy(pr->key, key, ARCKEY);
+	rsize = (size_t)hdr->T*hdr->L*sizeof(float);
+	
+	/* Search & registration under the lock, by blocks of 64 keys */
+	if (TenLock(pt->fdi, F_WRLCK) || sizeof(t_TensorHeader) != pread(pt->fdi, hdr, sizeof(t_TensorHeader), 0)) nerr = 2;
+	for (r=0; !nerr && r<hdr->nrows; r+=n) {
+		n = (hdr->nrows - r < 64) ? hdr->nrows - r : 64;
+		if (n*ARCKEY != pread(pt->fdi, keys, n*ARCKEY, sizeof(t_TensorHeader) + r*ARCKEY)) nerr = 2;
+		for (k=0; !nerr && k<n; k++)
+			if (!memcmp(keys + k*ARCKEY, key, ARCKEY)) break;
+		if (k < n) {
+			r += k;
+			break;
+		}
+	}
+	if (!nerr && r == hdr->nrows) {  /* New row */
+		hdr->nrows++;
+		if (ARCKEY != pwrite(pt->fdi, key, ARCKEY, sizeof(t_TensorHeader) + r*ARCKEY) || 
+				sizeof(t_TensorHeader) != pwrite(pt->fdi, hdr, sizeof(t_TensorHeader), 0)) nerr = 2;
+	}
+	if (!nerr && !fstat(pt->fd, &st) && (uint64_t)st.st_size < (r + 1)*rsize && ftruncate(pt->fd, (r + 1)*rsize)) nerr = 2;
+	if (!nerr && !fstat(pt->fdm, &st) && (uint64_t)st.st_size < (r + 1)*hdr->T && ftruncate(pt->fdm, (r + 1)*hdr->T)) nerr = 2;
+	TenLock(pt->fdi, F_UNLCK);
+	
+	/* Mapping, from a page boundary */
+	if (!nerr) {
+		pg  = sysconf(_SC_PAGESIZE);
+		off = r*rsize;
+		pr->r   = r;
+		pr->len = rsize + off % pg;
+		if (MAP_FAILED == (pr->map = (char *)mmap(NULL, pr->len, PROT_READ | PROT_WRITE, MAP_SHARED, pt->fd, off - off % pg)) ) nerr = 2;
+		else if (NULL == (pr->claim = (unsigned char *)calloc(hdr->T, 1) )) {
+			munmap(pr->map, pr->len);
+			nerr = 4;
+		} else pr->base = (float *)(pr->map + off % pg);
+	}
+	if (nerr) {
+		printf("TensorRow: Cannot %s the row of %.8s.%.8s-%.8s.%.8s %.8s\n", (nerr == 4) ? "allocate" : "map", 
+			key, key + 8, key + 24, key + 32, key + 64);
+		return NULL;
+	}
+	pt->nrows++;
+	return pr;
+}
+
+/* Slot of the sequences of header h, -1 when out of the time grid. */
+long TensorSlot (const t_Tensor * const pt, const t_HeaderInfo * const h) {
+	double s;
+	
+	s = floor((difftime(h->t, (time_t)pt->hdr.t0) + h->msec/1000. + h->b)/pt->hdr.step + 0.5);
+	return (s < 0 || s >= pt->hdr.T) ? -1 : (long)s;
+}
+
+/* Outputs of the Tr correlations of headers h1 & h2 by method: yt[tr] points to their    */
+/* slots of the tensor, or to the scratch ys[tr] when out of the grid, already used by    */
+/* this run or when the row cannot be mapped (*nskip of them). Returns yt.                */
+float **TensorRows (t_Tensor * const pt, float **yt, float ** const ys, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, 
+		const unsigned int Tr, const char * const method, unsigned int * const nskip) {
+	t_TensorRow *pr = NULL;
+	char key[ARCKEY];
+	unsigned int tr;
+	long s;
+	
+	*nskip = 0;
+	for (tr=0; tr<Tr; tr++) {
+		ArcKey (key, h1 + tr, h2 + tr, method);
+		if (pr == NULL || memcmp(pr->key, key, ARCKEY)) pr = TensorRow (pt, key);
+		yt[tr] = ys[tr];
+		if (pr == NULL || -1 == (s = TensorSlot (pt, h1 + tr)) || pr->claim[s]) {
+			(*nskip)++;
+			continue;
+		}
+		pr->claim[s] = 1;
+		yt[tr] = pr->base + s*pt->hdr.L;
+	}
+	return yt;
+}
+
+/* Marks as failed the slots of the Tr outputs yt (from TensorRows with the same h1, h2 */
+/* & method) whose correlations could not be computed, so that they are not masked.    */
+void TensorRelease (t_Tensor * const pt, float ** const yt, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, 
+		const unsigned int Tr, const char * const method) {
+	t_TensorRow *pr = NULL;
+	char key[ARCKEY];
+	unsigned int tr;
+	long s;
+	
+	for (tr=0; tr<Tr; tr++) {
+		ArcKey (key, h1 + tr, h2 + tr, method);
+		if (pr == NULL || memcmp(pr->key, key, ARCKEY)) pr = TensorRow (pt, key);
+		if (pr == NULL || -1 == (s = TensorSlot (pt, h1 + tr)) || yt[tr] != pr->base + s*pt->hdr.L) continue;
+		pr->claim[s] = 2;
+	}
+}
+
+/* Sets the mask of the slots written by this run & clears the one of the failed slots, */
+/* writing only their bytes so that runs sharing the tensor do not undo each other, and */
+/* unmaps the rows.                                                                     */
+int CloseTensor (t_Tensor *pt) {
+	unsigned char *m, *c;
+	unsigned int k, s, e, T;
+	int nerr = 0;
+	
+	if (pt == NULL) return 0;
+	T = pt->hdr.T;
+	if (NULL == (m = (unsigned char *)calloc(2*T, 1) )) nerr = 4;  /* T ones & T zeros */
+	else memset(m, 1, T);
+	for (k=0; k<pt->nrows; k++) {
+		c = pt->rows[k].claim;
+		for (s=0; m != NULL && s<T; s=e) {
+			for (e=s+1; e<T && c[e] == c[s]; e++);
+			if (c[s] && (ssize_t)(e - s) != pwrite(pt->fdm, m + (c[s] == 2)*T, e - s, pt->rows[k].r*T + s)) nerr = 2;
+		}
+		munmap(pt->rows[k].map, pt->rows[k].len);
+		free(c);
+	}
+	if (nerr) printf("CloseTensor: Cannot update the mask\n");
+	free(m);
+	free(pt->rows);
+	close(pt->fd);
+	close(pt->fdi);
+	close(pt->fdm);
+	free(pt);
+	return nerr;
+}
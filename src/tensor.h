@@ -0,0 +1,52 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ReadManySacs.h"
+#include "ccarchive.h"
+
+/* Network correlation tensor, name: float32 array of rows x T time slots x L lags in row  */
+/* major order, sparse until written. name.idx: t_TensorHeader & the ARCKEY bytes key of   */
+/* each row (pair, channels & method, see t_ArcRecord). name.msk: rows x T bytes, 1 when  */
+/* the slot holds a correlation. Slot k is the one of the sequences starting at t0+k*step. */
+#define TENMAGIC "PCCTEN1"
+
+typedef struct {
+	char     magic[8];  /* TENMAGIC                  */
+	uint32_t L;         /* Number of lags.           */
+	uint32_t T;         /* Number of time slots.     */
+	float    dt;        /* Sampling period (s).      */
+	float    lag1;      /* Lowest lag time (s).      */
+	int64_t  t0;        /* Time of slot 0 (time_t).  */
+	double   step;      /* Time between slots (s).   */
+	uint64_t nrows;     /* Number of rows.           */
+} t_TensorHeader;
+
+typedef struct {
+	char key[ARCKEY];
+	uint64_t r;         /* Row in the tensor */
+	char *map;
+	size_t len;
+	float *base;        /* T x L of the row */
+	unsigned char *claim;  /* Slots written by this run (1), or failed (2) */
+} t_TensorRow;
+
+typedef struct {
+	int fd, fdi, fdm;   /* Tensor, index & mask files */
+	t_TensorHeader hdr;
+	t_TensorRow *rows;  /* Mapped by this run */
+	unsigned int nrows;
+} t_Tensor;
+
+t_Tensor *OpenTensor (const char *name, const unsigned int L, const float dt, const float lag1, const int64_t t0, 
+	const double step, const unsigned int T);
+t_TensorRow *TensorRow (t_Tensor * const pt, const char * const key);
+long TensorSlot (const t_Tensor * const pt, const t_HeaderInfo * const h);
+float **TensorRows (t_Tensor * const pt, float **yt, float ** const ys, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, 
+	const unsigned int Tr, const char * const method, unsigned int * const nskip);
+void TensorRelease (t_Tensor * const pt, float ** const yt, const t_HeaderInfo * const h1, const t_HeaderInfo * const h2, 
+	const unsigned int Tr, const char * const method);
+int CloseTensor (t_Tensor *pt);
+
+#endif
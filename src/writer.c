@@ -0,0 +1,110 @@
+/*****************************************************************************/
+/* Asynchronous writing of the outputs, so that the correlations are not     */
+/* stopped while thousands of files are written.                             */
+/*                                                                           */
+/* The jobs are written in order by a single background thread, because the  */
+/* sac library keeps the header being written in global variables. Each job  */
+/* gets a sequence number and WriterSync waits until a given job is written,  */
+/* for reusing its arrays. The queue is bounded: WriterSubmit waits while it  */
+/* is full (backpressure).                                                   */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "writer.h"
+
+void *WriterThread (void *arg) {
+	t_Writer *pw = (t_Writer *)arg;
+	t_WriteJob job;
+	int nerr;
+	
+	pthread_mutex_lock(&pw->mtx);
+	while (1) {
+		while (pw->count == 0 && !pw->stop) pthread_cond_wait(&pw->cjob, &pw->mtx);
+		if (pw->count == 0) break;  /* Stopped and drained */
+		job = pw->q[pw->head];
+		pw->head = (pw->head + 1) % pw->Q;
+		pw->count--;
+		pthread_mutex_unlock(&pw->mtx);
+		
+		nerr = pw->store(&job);
+		
+		pthread_mutex_lock(&pw->mtx);
+		if (nerr) pw->nerr++;
+		pw->ndone++;
+		pthread_cond_broadcast(&pw->cdone);
+	}
+	pthread_mutex_unlock(&pw->mtx);
+	return NULL;
+}
+
+/* Starts the writer pw with a queue of Q jobs written by store. */
+void StartWriter (t_Writer * const pw, const unsigned int Q, int (*store)(t_WriteJob *pj)) {
+	pw->store = store;
+	pw->Q     = 0;
+	pw->head  = pw->count = 0;
+	pw->nsub  = pw->ndone = 0;
+	pw->stop  = pw->running = pw->nerr = 0;
+	if (Q == 0 || NULL == (pw->q = (t_WriteJob *)malloc(Q*sizeof(t_WriteJob)) )) return;
+	pw->Q = Q;
+	pthread_mutex_init(&pw->mtx, NULL);
+	pthread_cond_init(&pw->cjob, NULL);
+	pthread_cond_init(&pw->cdone, NULL);
+	if (pthread_create(&pw->th, NULL, WriterThread, pw)) {
+		printf("StartWriter: Create thread error, the outputs are written synchronously\n");
+		pthread_cond_destroy(&pw->cdone);
+		pthread_cond_destroy(&pw->cjob);
+		pthread_mutex_destroy(&pw->mtx);
+		free(pw->q);
+		pw->Q = 0;
+		return;
+	}
+	pw->running = 1;
+}
+
+/* Queues a copy of *pj, waiting while the queue is full. Returns its sequence number. */
+unsigned long WriterSubmit (t_Writer * const pw, const t_WriteJob * const pj) {
+	t_WriteJob job;
+	unsigned long seq;
+	
+	if (!pw->running) {
+		job = *pj;
+		if (pw->store(&job)) pw->nerr++;
+		pw->ndone++;
+		return ++pw->nsub;
+	}
+	pthread_mutex_lock(&pw->mtx);
+	while (pw->count == pw->Q) pthread_cond_wait(&pw->cdone, &pw->mtx);
+	pw->q[(pw->head + pw->count) % pw->Q] = *pj;
+	pw->count++;
+	seq = ++pw->nsub;
+	pthread_cond_signal(&pw->cjob);
+	pthread_mutex_unlock(&pw->mtx);
+	return seq;
+}
+
+/* Waits until the jobs up to the sequence number seq are written (seq = 0: none). */
+void WriterSync (t_Writer * const pw, const unsigned long seq) {
+	if (!pw->running) return;
+	pthread_mutex_lock(&pw->mtx);
+	while (pw->ndone < seq) pthread_cond_wait(&pw->cdone, &pw->mtx);
+	pthread_mutex_unlock(&pw->mtx);
+}
+
+/* Writes the pending jobs and stops the writer. Returns the number of jobs that failed. */
+int StopWriter (t_Writer * const pw) {
+	if (pw->running) {
+		pthread_mutex_lock(&pw->mtx);
+		pw->stop = 1;
+		pthread_cond_signal(&pw->cjob);
+		pthread_mutex_unlock(&pw->mtx);
+		pthread_join(pw->th, NULL);
+		pthread_cond_destroy(&pw->cdone);
+		pthread_cond_destroy(&pw->cjob);
+		pthread_mutex_destroy(&pw->mtx);
+		pw->running = 0;
+	}
+	if (pw->Q) free(pw->q);
+	pw->Q = 0;
+	return pw->nerr;
+}
@@ -0,0 +1,42 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <pthread.h>
+#include "ReadManySacs.h"
+#include "ccarchive.h"
+
+#define WRQUEUE 16  /* Jobs waiting to be written at most */
+
+/* Correlations y[0...Tr-1] of L lags from Lag1 of the pairs of headers h1 & h2 to be written. */
+typedef struct {
+	float **y;
+	unsigned int L, Tr;
+	int Lag1;
+	t_HeaderInfo *h1, *h2;
+	float dt;
+	char ccname[16];
+	int oformat;     /* 1: sac, 2: bin, 3: archive */
+	char *prefix;
+	t_ArcWriter *arc;
+	int verbose;
+} t_WriteJob;
+
+/* Background writer of the outputs: a bounded FIFO of jobs written by one thread with the */
+/* store function. The writing is synchronous when the thread or the queue is not created. */
+typedef struct {
+	pthread_t th;
+	pthread_mutex_t mtx;
+	pthread_cond_t cjob, cdone;
+	t_WriteJob *q;
+	unsigned int Q, head, count;
+	unsigned long nsub, ndone;  /* Jobs submitted & written */
+	int stop, running, nerr;
+	int (*store)(t_WriteJob *pj);
+} t_Writer;
+
+void StartWriter (t_Writer * const pw, const unsigned int Q, int (*store)(t_WriteJob *pj));
+unsigned long WriterSubmit (t_Writer * const pw, const t_WriteJob * const pj);
+void WriterSync (t_Writer * const pw, const unsigned long seq);
+int StopWriter (t_Writer * const pw);
+
+#endif